@@ -0,0 +1,18 @@
+/* crc16.h - CRC-16/XMODEM used to protect SD helper packets */
+
+#ifndef __CRC16_H__
+#define __CRC16_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+uint16_t UpdateCRC16(uint16_t crc, const uint8_t *buf, int len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,21 @@
+/* crc32.h - CRC-32 used to compare files with the SD card */
+
+#ifndef __CRC32_H__
+#define __CRC32_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define CRC32_INIT  0xffffffff
+
+/* start with CRC32_INIT and complement the final value */
+uint32_t UpdateCRC32(uint32_t crc, const uint8_t *buf, int len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,77 @@
+/* deadline.c - monotonic clock and deadline-driven receive helpers
+
+This is shared by the serial and socket code. An exact receive is allowed a
+single overall timeout no matter how many partial reads it takes to fill the
+buffer. Restarting the timeout on every read would let a trickle of data
+stretch a receive far beyond its limit. Failing on the first short read would
+turn a TCP segment boundary in the middle of an ack into a lost packet.
+
+*/
+
+#include <stdint.h>
+#include "deadline.h"
+
+#ifdef __MINGW32__
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/* MillisecondTimer - return a monotonic millisecond count (wraps every ~49 days) */
+uint32_t MillisecondTimer(void)
+{
+#ifdef __MINGW32__
+    return (uint32_t)GetTickCount();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t)now.tv_sec * 1000 + (uint32_t)(now.tv_nsec / 1000000);
+#endif
+}
+
+/* MicrosecondTimer - return a monotonic microsecond count */
+uint64_t MicrosecondTimer(void)
+{
+#ifdef __MINGW32__
+    LARGE_INTEGER frequency, count;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&count);
+    return (uint64_t)(count.QuadPart / frequency.QuadPart) * 1000000
+         + (uint64_t)(count.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)(now.tv_nsec / 1000);
+#endif
+}
+
+/* MillisecondsRemaining - return the time left before a deadline or zero if it has passed */
+int MillisecondsRemaining(uint32_t deadline)
+{
+    int32_t remaining = (int32_t)(deadline - MillisecondTimer());
+    return remaining > 0 ? remaining : 0;
+}
+
+/* ReceiveExactWithDeadline - fill a buffer using as many reads as it takes before a single deadline */
+int ReceiveExactWithDeadline(ReceiveTimeoutFunction *receive, void *handle, void *buf, int len, int timeout)
+{
+    uint32_t deadline = MillisecondTimer() + timeout;
+    uint8_t *ptr = (uint8_t *)buf;
+    int remaining = len;
+    int cnt;
+
+    /* return only when the buffer contains the exact amount of data requested */
+    while (remaining > 0) {
+
+        /* once the deadline passes only data that has already arrived is accepted */
+        if ((cnt = (*receive)(handle, ptr, remaining, MillisecondsRemaining(deadline))) <= 0)
+            return -1;
+
+        /* update the buffer pointer */
+        remaining -= cnt;
+        ptr += cnt;
+    }
+
+    /* return the full size of the buffer */
+    return len;
+}
@@ -0,0 +1,24 @@
+/* deadline.h - monotonic clock and deadline-driven receive helpers */
+
+#ifndef __DEADLINE_H__
+#define __DEADLINE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* receive function that waits at most 'timeout' milliseconds and returns the number of bytes read or -1 */
+typedef int ReceiveTimeoutFunction(void *handle, void *buf, int len, int timeout);
+
+uint32_t MillisecondTimer(void);
+uint64_t MicrosecondTimer(void);
+int MillisecondsRemaining(uint32_t deadline);
+int ReceiveExactWithDeadline(ReceiveTimeoutFunction *receive, void *handle, void *buf, int len, int timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
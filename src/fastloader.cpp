@@ -6,8 +6,13 @@
 #include "loader.h"
 #include "proploader.h"
 #include "propimage.h"
+#include "deadline.h"
+#include "trace.h"
 
 #define MAX_RX_SENSE_ERROR      23          /* Maximum number of cycles by which the detection of a start bit could be off (as affected by the Loader code) */
+#define MAX_PACKET_ATTEMPTS     3           /* Number of times a packet is sent before giving up */
+#define MAX_PACKET_TIMEOUT      2000        /* Upper limit on the adaptive packet response timeout (in milliseconds) */
+#define EEPROM_PACKET_TIMEOUT   8000        /* Fixed response timeout for the EEPROM programming packet (in milliseconds) */
 
 // Offset (in bytes) from end of Loader Image pointing to where most host-initialized values exist.
 // Host-Initialized values are: Initial Bit Time, Final Bit Time, 1.5x Bit Time, Failsafe timeout,
@@ -16,6 +21,16 @@
 // NOTE: DAT block data is always placed before the first Spin method
 #define RAW_LOADER_INIT_OFFSET_FROM_END (-(10 * 4) - 8)
 
+// Offset (in bytes) from end of the programVerifyEEPROM packet to the host-initialized values that select the EEPROM
+// region it programs: EEPROM address, end of the region in RAM, region checksum, the ID of the next packet and
+// whether to read memory instead.  The values in the packet as generated program the application image.
+#define EEPROM_REGION_OFFSET_FROM_END   (-(5 * 4))
+
+#define READ_BLOCK_SIZE         (128 * 4)   /* Bytes in each block of memory read back (RMBlockLongs longs) */
+#define READ_WINDOW_SIZE        8192        /* Bytes read back for each read packet */
+#define READ_BLOCK_TIMEOUT      1000        /* Response timeout for each block read back (in milliseconds) */
+#define READ_QUIET_TIMEOUT      100         /* Time without data that means the loader stopped sending (in milliseconds) */
+
 // Raw loader image.  This is a memory image of a Propeller Application written in PASM that fits into our initial
 // download packet.  Once started, it assists with the remainder of the download (at a faster speed and with more
 // relaxed interstitial timing conducive of Internet Protocol delivery. This memory image isn't used as-is; before
@@ -45,6 +60,17 @@ static void setLong(uint8_t *buf, uint32_t value)
      buf[0] = value;
 }
 
+/* setEepromPacketValues - select what the programVerifyEEPROM packet programs or reads */
+static void setEepromPacketValues(uint8_t *packet, uint32_t address, uint32_t end, uint32_t sum, int32_t nextPacketID, int read)
+{
+    int offset = sizeof(programVerifyEEPROM) + EEPROM_REGION_OFFSET_FROM_END;
+    setLong(&packet[offset +  0], address);
+    setLong(&packet[offset +  4], end);
+    setLong(&packet[offset +  8], sum);
+    setLong(&packet[offset + 12], nextPacketID);
+    setLong(&packet[offset + 16], read);
+}
+
 double ClockSpeed = 80000000.0;
 
 uint8_t *Loader::generateInitialLoaderImage(int clockSpeed, int clockMode, int packetID, int loaderBaudRate, int fastLoaderBaudRate, int *pLength)
@@ -52,7 +78,7 @@ uint8_t *Loader::generateInitialLoaderImage(int clockSpeed, int clockMode, int p
     int initAreaOffset = sizeof(rawLoaderImage) + RAW_LOADER_INIT_OFFSET_FROM_END;
     double floatClockSpeed = (double)clockSpeed;
     uint8_t *loaderImage;
-    int checksum, i;
+    int checksum;
     
     // Allocate space for the image
     if (!(loaderImage = (uint8_t *)malloc(sizeof(rawLoaderImage))))
@@ -129,12 +155,8 @@ uint8_t *Loader::generateInitialLoaderImage(int clockSpeed, int clockMode, int p
     SetHostInitializedValue(loaderImage, initAreaOffset + 36, packetID);
 
     // Recalculate and update checksum so low byte of checksum calculates to 0.
-    checksum = 0;
     loaderImage[5] = 0; // start with a zero checksum
-    for (i = 0; i < (int)sizeof(rawLoaderImage); ++i)
-        checksum += loaderImage[i];
-    for (i = 0; i < (int)sizeof(initCallFrame); ++i)
-        checksum += initCallFrame[i];
+    checksum = PropImage::sumBytes(loaderImage, sizeof(rawLoaderImage)) + PropImage::sumBytes(initCallFrame, sizeof(initCallFrame));
     loaderImage[5] = 256 - (checksum & 0xFF);
     
     /* return the loader image */
@@ -164,7 +186,10 @@ int Loader::fastLoadFile(const char *file, LoadType loadType)
 
 int Loader::fastLoadImage(const uint8_t *image, int imageSize, LoadType loadType)
 {
+    TraceSpan span("fast-load");
     int sts;
+
+    m_connection->stats().begin();
     
     // get the binary clock settings
     PropImage img((uint8_t *)image, imageSize); // shouldn't really modify image!
@@ -182,10 +207,6 @@ int Loader::fastLoadImage(const uint8_t *image, int imageSize, LoadType loadType
         else
             fastLoaderClockSpeed = binaryClockSpeed;
     }
-    if (gotClockSpeed) {
-        img.setClkFreq(clockSpeed);
-        img.updateChecksum();
-    }
 
     // get the fast loader and program clock modes
     int fastLoaderClockMode, clockMode;
@@ -198,10 +219,10 @@ int Loader::fastLoadImage(const uint8_t *image, int imageSize, LoadType loadType
         else
             fastLoaderClockMode = binaryClockMode;
     }
-    if (gotClockMode) {
-        img.setClkMode(clockMode);
-        img.updateChecksum();
-    }
+
+    // apply the program clock settings and compute the checksum the loader verifies
+    img.prepare(m_connection->config());
+    int32_t checksum = img.loadChecksum();
         
     message("fastLoaderClockSpeed %d, fastLoadClockMode %02x, clockSpeed %d, clockMode %02x",
             fastLoaderClockSpeed,
@@ -217,21 +238,29 @@ int Loader::fastLoadImage(const uint8_t *image, int imageSize, LoadType loadType
         fastLoaderBaudRate = DEF_FAST_LOADER_BAUDRATE;
 
     for (;;) {
-        if ((sts = fastLoadImageHelper(image, imageSize, loadType, fastLoaderClockSpeed, fastLoaderClockMode, loaderBaudRate, fastLoaderBaudRate)) == 0)
-            return 0;
-        else if (sts == -2) {
-            if ((fastLoaderBaudRate /= 2) >= 115200)
-                nmessage(INFO_STEPPING_DOWN_BAUD_RATE, fastLoaderBaudRate);
-            else
+        if ((sts = fastLoadImageHelper(image, imageSize, checksum, loadType, fastLoaderClockSpeed, fastLoaderClockMode, loaderBaudRate, fastLoaderBaudRate)) != -2)
+            break;
+        if ((fastLoaderBaudRate /= 2) < 115200) {
+            /* the rom loader can't program eeprom regions */
+            if (m_eepromRegions && (loadType & ltDownloadAndProgram)) {
+                message("Can't program EEPROM regions with a single-stage download");
                 break;
+            }
+            /* try a slow load if all baud rates failed */
+            traceInstant("single-stage-fallback", NULL);
+            nmessage(INFO_USING_SINGLE_STAGE_LOADER);
+            if ((sts = m_connection->loadImage(image, imageSize, loadType, true)) == 0)
+                m_connection->stats().addPayloadBytes(imageSize);
+            break;
         }
-        else
-            return sts;
+        traceInstant("baud-step-down", "\"baud-rate\":%d", fastLoaderBaudRate);
+        nmessage(INFO_STEPPING_DOWN_BAUD_RATE, fastLoaderBaudRate);
     }
-        
-    /* try a slow load if all baud rates failed */
-    nmessage(INFO_USING_SINGLE_STAGE_LOADER);
-    return m_connection->loadImage(image, imageSize, loadType, true);
+
+    /* record the outcome for the load statistics */
+    m_connection->stats().end(sts == 0, m_connection->baudRate());
+
+    return sts;
 }
 
 /* returns:
@@ -239,76 +268,45 @@ int Loader::fastLoadImage(const uint8_t *image, int imageSize, LoadType loadType
     -1 for fatal errors
     -2 for errors where a lower baud rate might help
 */
-int Loader::fastLoadImageHelper(const uint8_t *image, int imageSize, LoadType loadType, int clockSpeed, int clockMode, int loaderBaudRate, int fastLoaderBaudRate)
+int Loader::fastLoadImageHelper(const uint8_t *image, int imageSize, int32_t checksum, LoadType loadType, int clockSpeed, int clockMode, int loaderBaudRate, int fastLoaderBaudRate)
 {
-    uint8_t *loaderImage, response[8];
-    int loaderImageSize, remaining, result, sts, i;
-    int32_t packetID, checksum;
+    int result, sts;
+    int32_t packetID, imagePacketID;
     SpinHdr *hdr = (SpinHdr *)image;
+    EepromRegion *regions, *region;
+    TracePhases phase;
 
     // don't need to load beyond this even for .eeprom images
     imageSize = hdr->vbase;
     
-    /* compute the image checksum */
-    checksum = 0;
-    for (i = 0; i < imageSize; ++i)
-        checksum += image[i];
-    for (i = 0; i < (int)sizeof(initCallFrame); ++i)
-        checksum += initCallFrame[i];
-    
     /* compute the packet ID (number of packets to be sent) */
-    packetID = (imageSize + m_connection->maxDataSize() - 1) / m_connection->maxDataSize();
+    imagePacketID = packetID = (imageSize + m_connection->maxDataSize() - 1) / m_connection->maxDataSize();
 
-    /* generate a loader image */
-    loaderImage = generateInitialLoaderImage(clockSpeed, clockMode, packetID, loaderBaudRate, fastLoaderBaudRate, &loaderImageSize);
-    if (!loaderImage) {
-        message("generateInitialLoaderImage failed");
-        nerror(ERROR_INTERNAL_CODE_ERROR);
-        return -1;
-    }
-        
-    /* load the second-stage loader using the Propeller ROM protocol */
-    message("Delivering second-stage loader");
-    result = m_connection->loadImage(loaderImage, loaderImageSize, response, sizeof(response));
-    free(loaderImage);
-    if (result != 0)
-        return result;
+    /* eeprom regions are downloaded and programmed before the image */
+    regions = (loadType & ltDownloadAndProgram) ? m_eepromRegions : NULL;
+    if (regions)
+        packetID = (regions->size + m_connection->maxDataSize() - 1) / m_connection->maxDataSize();
 
-    result = getLong(&response[0]);
-    if (result != packetID) {
-        message("Second-stage loader failed to start - packetID %d, result %d", packetID, result);
-        return -2;
-    }
+    /* load the second-stage loader */
+    phase.begin("loader-delivery");
+    if ((sts = startLoader(clockSpeed, clockMode, packetID, loaderBaudRate, fastLoaderBaudRate)) != 0)
+        return sts;
 
-    /* switch to the final baud rate */
-    m_connection->setBaudRate(fastLoaderBaudRate);
-    
-    /* open the transparent serial connection that will be used for the second-stage loader */
-    if (m_connection->connect() != 0) {
-        message("Failed to connect to target");
-        nerror(ERROR_COMMUNICATION_LOST);
-        return -1;
+    /* program the eeprom regions */
+    for (region = regions; region != NULL; region = region->next) {
+        int32_t nextPacketID = imagePacketID;
+        if (region->next)
+            nextPacketID = (region->next->size + m_connection->maxDataSize() - 1) / m_connection->maxDataSize();
+        phase.begin("program-eeprom-region");
+        if ((sts = programEepromRegion(region, &packetID, nextPacketID)) != 0)
+            return sts;
     }
 
     /* transmit the image */
+    phase.begin("image-download");
     nmessage(INFO_DOWNLOADING, m_connection->portName());
-    remaining = imageSize;
-    while (remaining > 0) {
-        int size;
-        nprogress(INFO_BYTES_REMAINING, (long)remaining);
-        if ((size = remaining) > m_connection->maxDataSize())
-            size = m_connection->maxDataSize();
-        if ((sts = transmitPacket(packetID, image, size, &result)) != 0)
-            return -2;
-        if (result != packetID - 1) {
-            message("Unexpected response: expected %d, received %d", packetID - 1, result);
-            return -2;
-        }
-        remaining -= size;
-        image += size;
-        --packetID;
-    }
-    nmessage(INFO_BYTES_SENT, (long)imageSize);
+    if ((sts = transmitData(image, imageSize, &packetID)) != 0)
+        return sts;
     
     /*
         When we're doing a download that does not include an EEPROM write, the Packet IDs end up as:
@@ -326,6 +324,7 @@ int Loader::fastLoadImageHelper(const uint8_t *image, int imageSize, LoadType lo
     */
     
     /* transmit the RAM verify packet and verify the checksum */
+    phase.begin("verify-ram");
     nmessage(INFO_VERIFYING_RAM);
     if ((sts = transmitPacket(packetID, verifyRAM, sizeof(verifyRAM), &result)) != 0)
         return sts;
@@ -336,8 +335,9 @@ int Loader::fastLoadImageHelper(const uint8_t *image, int imageSize, LoadType lo
     packetID = -checksum;
     
     if (loadType & ltDownloadAndProgram) {
+        phase.begin("program-eeprom");
         nmessage(INFO_PROGRAMMING_EEPROM);
-        if ((sts = transmitPacket(packetID, programVerifyEEPROM, sizeof(programVerifyEEPROM), &result, 8000)) != 0)
+        if ((sts = transmitPacket(packetID, programVerifyEEPROM, sizeof(programVerifyEEPROM), &result, EEPROM_PACKET_TIMEOUT)) != 0)
             return sts;
         if (result != -checksum*2) {
             nmessage(ERROR_EEPROM_CHECKSUM_FAILED);
@@ -346,8 +346,48 @@ int Loader::fastLoadImageHelper(const uint8_t *image, int imageSize, LoadType lo
         packetID = -checksum*2;
     }
     
+    /* leave the loader running for the next load instead of launching the image */
+    if (m_keepLoader) {
+        message("Keeping the second-stage loader for the next load");
+        m_loaderResident = true;
+        m_residentPacketID = packetID;
+        return 0;
+    }
+
     /* transmit the final launch packets */
+    phase.begin("launch");
+    if ((sts = launchImage(packetID)) != 0)
+        return sts;
     
+    message("Packet round-trip time %d ms, %d adaptive timeouts", m_connection->smoothedRtt(), m_connection->stats().adaptiveTimeouts());
+
+    /* return successfully */
+    return 0;
+}
+
+/*
+   fastLaunch - start the image in RAM of a loader that was kept running after loading it
+*/
+int Loader::fastLaunch()
+{
+    if (!m_loaderResident) {
+        message("No second-stage loader is running");
+        return -1;
+    }
+    m_loaderResident = false;
+    return launchImage(m_residentPacketID);
+}
+
+/* returns:
+    0 for success
+    -1 for fatal errors
+
+   Sends the readyToLaunch and launchNow packets starting with packetID.
+*/
+int Loader::launchImage(int32_t packetID)
+{
+    int result, sts;
+
     message("Sending readyToLaunch packet");
     if ((sts = transmitPacket(packetID, readyToLaunch, sizeof(readyToLaunch), &result)) != 0)
         return sts;
@@ -360,8 +400,121 @@ int Loader::fastLoadImageHelper(const uint8_t *image, int imageSize, LoadType lo
     message("Sending launchNow packet");
     if ((sts = transmitPacket(packetID, launchNow, sizeof(launchNow), NULL)) != 0)
         return sts;
+
+    return 0;
+}
+
+/* returns:
+    0 for success
+    -1 for fatal errors
+    -2 for errors where a lower baud rate might help
+
+   Resets the Propeller and loads the second-stage loader using the Propeller ROM protocol. The loader
+   then expects packetID at the fast loader baud rate. A loader left running by the previous load or
+   read is reused instead if it still answers.
+*/
+int Loader::startLoader(int clockSpeed, int clockMode, int32_t packetID, int loaderBaudRate, int fastLoaderBaudRate)
+{
+    uint8_t *loaderImage, response[8];
+    int loaderImageSize, result;
+
+    /* reuse a loader that is still running */
+    if (m_loaderResident) {
+        m_loaderResident = false;
+        if (reloadLoader(packetID) == 0)
+            return 0;
+        message("Second-stage loader is gone - resetting the Propeller");
+    }
+
+    /* generate a loader image */
+    loaderImage = generateInitialLoaderImage(clockSpeed, clockMode, packetID, loaderBaudRate, fastLoaderBaudRate, &loaderImageSize);
+    if (!loaderImage) {
+        message("generateInitialLoaderImage failed");
+        nerror(ERROR_INTERNAL_CODE_ERROR);
+        return -1;
+    }
+        
+    /* load the second-stage loader using the Propeller ROM protocol */
+    traceInstant("fast-load-attempt", "\"loader-baud-rate\":%d,\"fast-loader-baud-rate\":%d,\"packets\":%d",
+                 loaderBaudRate, fastLoaderBaudRate, packetID);
+    message("Delivering second-stage loader");
+    result = m_connection->loadImage(loaderImage, loaderImageSize, response, sizeof(response));
+    free(loaderImage);
+    if (result != 0)
+        return result;
+
+    result = getLong(&response[0]);
+    if (result != packetID) {
+        message("Second-stage loader failed to start - packetID %d, result %d", packetID, result);
+        return -2;
+    }
+
+    /* switch to the final baud rate */
+    m_connection->setBaudRate(fastLoaderBaudRate);
     
-    /* return successfully */
+    /* open the transparent serial connection that will be used for the second-stage loader */
+    if (m_connection->connect() != 0) {
+        message("Failed to connect to target");
+        nerror(ERROR_COMMUNICATION_LOST);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* returns:
+    0 for success
+    -1 if the loader didn't answer
+
+   Tells a loader left running by the previous load or read to expect packetID next. This is a read of
+   no bytes. The loader restarts the Propeller if it sees no packet for a couple of seconds so this only
+   works if the next load follows closely.
+*/
+int Loader::reloadLoader(int32_t packetID)
+{
+    uint8_t packet[sizeof(programVerifyEEPROM)];
+    int result;
+
+    traceInstant("loader-reload", "\"packets\":%d", packetID);
+    message("Reusing the second-stage loader");
+    memcpy(packet, programVerifyEEPROM, sizeof(packet));
+    setEepromPacketValues(packet, 0, 0, 0, packetID, mtHubRAM);
+    if (transmitPacket(m_residentPacketID, packet, sizeof(packet), &result) != 0 || result != packetID)
+        return -1;
+
+    return 0;
+}
+
+/* returns:
+    0 for success
+    -2 for errors where a lower baud rate might help
+
+   Sends data to be stored in RAM starting at the RAM address where the last data ended.
+*/
+int Loader::transmitData(const uint8_t *data, int size, int32_t *pPacketID)
+{
+    int32_t packetID = *pPacketID;
+    int remaining, result;
+
+    remaining = size;
+    while (remaining > 0) {
+        int packetSize;
+        nprogress(INFO_BYTES_REMAINING, (long)remaining);
+        if ((packetSize = remaining) > m_connection->maxDataSize())
+            packetSize = m_connection->maxDataSize();
+        if (transmitPacket(packetID, data, packetSize, &result) != 0)
+            return -2;
+        if (result != packetID - 1) {
+            message("Unexpected response: expected %d, received %d", packetID - 1, result);
+            return -2;
+        }
+        remaining -= packetSize;
+        data += packetSize;
+        --packetID;
+    }
+    nmessage(INFO_BYTES_SENT, (long)size);
+
+    *pPacketID = packetID;
     return 0;
 }
 
@@ -369,13 +522,67 @@ int Loader::fastLoadImageHelper(const uint8_t *image, int imageSize, LoadType lo
     0 for success
     -1 for fatal errors
     -2 for errors where a lower baud rate might help
+
+   The region is sent to RAM like an image, padded to a whole number of EEPROM pages, and is then
+   programmed by a programVerifyEEPROM packet with its values set to the region. The packet checks
+   the region's checksum, programs and verifies it and then expects the packets of the next download
+   starting with nextPacketID.
+*/
+int Loader::programEepromRegion(EepromRegion *region, int32_t *pPacketID, int32_t nextPacketID)
+{
+    uint8_t packet[sizeof(programVerifyEEPROM)], *data;
+    int size, result, sts;
+
+    /* pad the region to a whole number of pages with the value of erased eeprom */
+    size = (region->size + EEPROM_PAGE_SIZE - 1) & ~(EEPROM_PAGE_SIZE - 1);
+    if (!(data = (uint8_t *)malloc(size))) {
+        nmessage(ERROR_INSUFFICIENT_MEMORY);
+        return -1;
+    }
+    memcpy(data, region->data, region->size);
+    memset(&data[region->size], 0xFF, size - region->size);
+
+    /* send the region */
+    nmessage(INFO_PROGRAMMING_EEPROM_REGION, region->address, region->size);
+    if ((sts = transmitData(data, size, pPacketID)) != 0) {
+        free(data);
+        return sts;
+    }
+
+    /* program and verify it */
+    memcpy(packet, programVerifyEEPROM, sizeof(packet));
+    setEepromPacketValues(packet, region->address, size, PropImage::sumBytes(data, size), nextPacketID, 0);
+    free(data);
+    if ((sts = transmitPacket(*pPacketID, packet, sizeof(packet), &result, EEPROM_PACKET_TIMEOUT)) != 0)
+        return sts;
+    if (result != nextPacketID) {
+        nmessage(ERROR_EEPROM_CHECKSUM_FAILED);
+        return -1;
+    }
+
+    *pPacketID = nextPacketID;
+    return 0;
+}
+
+/* returns:
+    0 for success
+    -1 for fatal errors
+    -2 for errors where a lower baud rate might help
+
+   A timeout of zero selects an adaptive timeout based on the connection's round-trip time estimate.
+   Each attempt is sent with a new tag. A response carrying the tag of any attempt of this packet is
+   accepted and responses carrying unknown tags (late responses to earlier packets) are discarded.
 */
 int Loader::transmitPacket(int id, const uint8_t *payload, int payloadSize, int *pResult, int timeout)
 {
     int packetSize = 2*sizeof(uint32_t) + payloadSize;
     uint8_t *packet, response[8];
-    int retries, result;
-    int32_t tag, rtag;
+    int32_t tags[MAX_PACKET_ATTEMPTS], rtag;
+    uint32_t sendTimes[MAX_PACKET_ATTEMPTS];
+    uint64_t sendMicros[MAX_PACKET_ATTEMPTS];
+    int attempt, result, remaining, i;
+    bool adaptive = (timeout == 0);
+    TraceSpan span("packet");
     
     /* build the packet to transmit */
     if (!(packet = (uint8_t *)malloc(packetSize))) {
@@ -386,45 +593,78 @@ int Loader::transmitPacket(int id, const uint8_t *payload, int payloadSize, int
     memcpy(&packet[8], payload, payloadSize);
     
     /* send the packet */
-    retries = 3;
-    while (--retries >= 0) {
+    for (attempt = 0; attempt < MAX_PACKET_ATTEMPTS; ++attempt) {
     
         /* setup the packet header */
 #ifdef __MINGW32__
-        tag = (int32_t)rand() | ((int32_t)rand() << 16);
+        tags[attempt] = (int32_t)rand() | ((int32_t)rand() << 16);
 #else
-        tag = (int32_t)rand();
+        tags[attempt] = (int32_t)rand();
 #endif
-        setLong(&packet[4], tag);
-        //printf("transmit packet %d - tag %08x, size %d\n", id, tag, packetSize);
+        setLong(&packet[4], tags[attempt]);
+        //printf("transmit packet %d - tag %08x, size %d\n", id, tags[attempt], packetSize);
+        sendTimes[attempt] = MillisecondTimer();
+        sendMicros[attempt] = MicrosecondTimer();
+        if (attempt == 0)
+            m_connection->stats().addPacket();
+        else
+            m_connection->stats().countRetry();
+        traceInstant("packet-send", "\"id\":%d,\"attempt\":%d,\"bytes\":%d", id, attempt, packetSize);
         if (m_connection->sendData(packet, packetSize) != packetSize) {
             nmessage(ERROR_INTERNAL_CODE_ERROR);
             free(packet);
             return -1;
         }
     
-        /* receive the response */
-        if (pResult) {
-            if (m_connection->receiveDataExactTimeout(response, sizeof(response), timeout) != sizeof(response))
-                message("transmitPacket %d failed - receiveDataExactTimeout", id);
-            else if ((rtag = getLong(&response[4])) == tag) {
-                if ((result = getLong(&response[0])) == id)
-                    message("transmitPacket %d failed: duplicate id", id);
-                else {
-                    *pResult = result;
-                    free(packet);
-                    return 0;
-                }
-            }
-            else
-                message("transmitPacket %d failed: wrong tag %08x - expected %08x", id, rtag, tag);
-        }
-        
         /* don't wait for a result */
-        else {
+        if (!pResult) {
+            free(packet);
+            return 0;
+        }
+
+        /* determine how long to wait for the response to this attempt */
+        uint32_t deadline = sendTimes[attempt] + (adaptive
+                          ? m_connection->retransmitTimeout(packetSize + sizeof(response), attempt, MAX_PACKET_TIMEOUT)
+                          : timeout);
+
+        /* receive responses until one matches this packet or the deadline passes */
+        while ((remaining = MillisecondsRemaining(deadline)) > 0) {
+            if (m_connection->receiveDataExactTimeout(response, sizeof(response), remaining) != sizeof(response))
+                break;
+            rtag = getLong(&response[4]);
+            for (i = attempt; i >= 0; --i)
+                if (rtag == tags[i])
+                    break;
+            if (i < 0) {
+                m_connection->stats().countTagMismatch();
+                traceInstant("packet-stale-response", "\"id\":%d", id);
+                message("transmitPacket %d: discarding response with unknown tag %08x", id, rtag);
+                continue;
+            }
+            if ((result = getLong(&response[0])) == id) {
+                m_connection->stats().countDuplicateId();
+                traceInstant("packet-nak", "\"id\":%d", id);
+                message("transmitPacket %d failed: duplicate id", id);
+                break;
+            }
+            if (adaptive)
+                m_connection->updateRttEstimate((int)(MillisecondTimer() - sendTimes[i])
+                                                - m_connection->serializationTime(packetSize + sizeof(response)));
+            m_connection->stats().addRttSample((int)(MicrosecondTimer() - sendMicros[i]));
+            m_connection->stats().addPayloadBytes(payloadSize);
+            traceInstant("packet-ack", "\"id\":%d,\"result\":%d,\"attempt\":%d,\"rtt-ms\":%d",
+                         id, result, i, (int)(MillisecondTimer() - sendTimes[i]));
+            *pResult = result;
             free(packet);
             return 0;
         }
+
+        if (MillisecondsRemaining(deadline) == 0) {
+            traceInstant("packet-timeout", "\"id\":%d,\"attempt\":%d,\"adaptive\":%s", id, attempt, adaptive ? "true" : "false");
+            message("transmitPacket %d failed - receiveDataExactTimeout", id);
+            if (adaptive)
+                m_connection->stats().countAdaptiveTimeout();
+        }
         message("transmitPacket %d failed - retrying", id);
     }
     
@@ -436,3 +676,239 @@ int Loader::transmitPacket(int id, const uint8_t *payload, int payloadSize, int
     return -1;
 }
 
+/*
+   fastReadMemory - read hub RAM or EEPROM using the second-stage loader
+
+   The range is read in windows of READ_WINDOW_SIZE bytes. Each window is requested by an executable
+   packet and streamed back in blocks that each carry their offset and checksum.
+*/
+int Loader::fastReadMemory(MemoryType type, uint32_t address, uint8_t *buf, int size)
+{
+    TraceSpan span("fast-read");
+    int clockSpeed, clockMode, loaderBaudRate, fastLoaderBaudRate, sts;
+    BoardConfig *config = m_connection->config();
+
+    m_connection->stats().begin();
+
+    // get the loader clock settings
+    if (!GetNumericConfigField(config, "fast-loader-clkfreq", &clockSpeed) && !GetNumericConfigField(config, "clkfreq", &clockSpeed))
+        clockSpeed = DEF_CLOCK_SPEED;
+    if (!GetNumericConfigField(config, "fast-loader-clkmode", &clockMode) && !GetNumericConfigField(config, "clkmode", &clockMode))
+        clockMode = DEF_CLOCK_MODE;
+
+    // get the loader baudrates
+    if (!GetNumericConfigField(config, "loader-baud-rate", &loaderBaudRate))
+        loaderBaudRate = DEF_LOADER_BAUDRATE;
+    if (!GetNumericConfigField(config, "fast-loader-baud-rate", &fastLoaderBaudRate))
+        fastLoaderBaudRate = DEF_FAST_LOADER_BAUDRATE;
+
+    for (;;) {
+        if ((sts = fastReadMemoryHelper(type, address, buf, size, clockSpeed, clockMode, loaderBaudRate, fastLoaderBaudRate)) != -2)
+            break;
+        if ((fastLoaderBaudRate /= 2) < 115200)
+            break;
+        traceInstant("baud-step-down", "\"baud-rate\":%d", fastLoaderBaudRate);
+        nmessage(INFO_STEPPING_DOWN_BAUD_RATE, fastLoaderBaudRate);
+    }
+
+    /* record the outcome for the load statistics */
+    m_connection->stats().end(sts == 0, m_connection->baudRate());
+
+    return sts;
+}
+
+/* returns:
+    0 for success
+    -1 for fatal errors
+    -2 for errors where a lower baud rate might help
+*/
+int Loader::fastReadMemoryHelper(MemoryType type, uint32_t address, uint8_t *buf, int size, int clockSpeed, int clockMode, int loaderBaudRate, int fastLoaderBaudRate)
+{
+    uint8_t window[READ_WINDOW_SIZE];
+    int32_t packetID = 0;
+    TracePhases phase;
+    int offset, sts;
+
+    /* the loader goes straight to the executable packets */
+    phase.begin("loader-delivery");
+    if (type == mtHubRAM) {
+        /* hub RAM only holds an image while the loader that loaded it is still running */
+        if (!m_loaderResident) {
+            message("Hub RAM can only be read from a loader kept running after a load");
+            return -1;
+        }
+        m_loaderResident = false;
+        if (reloadLoader(packetID) != 0)
+            return -1;
+    }
+    else if ((sts = startLoader(clockSpeed, clockMode, packetID, loaderBaudRate, fastLoaderBaudRate)) != 0)
+        return sts;
+
+    /* read the range a window at a time */
+    phase.begin("read-memory");
+    for (offset = 0; offset < size; offset += READ_WINDOW_SIZE) {
+        int count = size - offset;
+        if (count > READ_WINDOW_SIZE)
+            count = READ_WINDOW_SIZE;
+        nprogress(INFO_BYTES_REMAINING, (long)(size - offset));
+
+        /* the loader reads whole longs */
+        if ((sts = readWindow(&packetID, type, address + offset, window, (count + 3) & ~3)) != 0)
+            return sts;
+        memcpy(&buf[offset], window, count);
+    }
+    nmessage(INFO_BYTES_RECEIVED, (long)size);
+
+    /* the loader is waiting for another request */
+    m_loaderResident = true;
+    m_residentPacketID = packetID;
+
+    return 0;
+}
+
+/* returns:
+    0 for success
+    -2 for errors where a lower baud rate might help
+
+   A window that isn't received completely is requested again once the loader has stopped sending.
+   If the loader already ran the request it answers with the next packet ID and no data and the
+   window is requested again with that ID.
+*/
+int Loader::readWindow(int32_t *pPacketID, MemoryType type, uint32_t address, uint8_t *buf, int size)
+{
+    uint8_t packet[2*sizeof(uint32_t) + sizeof(programVerifyEEPROM)], header[8], block[READ_BLOCK_SIZE];
+    int32_t packetID = *pPacketID, tag, value;
+    int attempt, offset, count, sts;
+
+    for (attempt = 0; attempt < MAX_PACKET_ATTEMPTS; ++attempt) {
+
+        /* build the read packet */
+        setLong(&packet[0], packetID);
+#ifdef __MINGW32__
+        tag = (int32_t)rand() | ((int32_t)rand() << 16);
+#else
+        tag = (int32_t)rand();
+#endif
+        setLong(&packet[4], tag);
+        memcpy(&packet[8], programVerifyEEPROM, sizeof(programVerifyEEPROM));
+        setEepromPacketValues(&packet[8], address, size, 0, packetID - 1, type);
+
+        /* send it */
+        if (attempt == 0)
+            m_connection->stats().addPacket();
+        else
+            m_connection->stats().countRetry();
+        traceInstant("packet-send", "\"id\":%d,\"attempt\":%d,\"bytes\":%d", packetID, attempt, (int)sizeof(packet));
+        if (m_connection->sendData(packet, sizeof(packet)) != (int)sizeof(packet))
+            return -2;
+
+        /* receive the blocks followed by the acknowledgement */
+        sts = -2;
+        for (offset = 0; ; offset += count) {
+            if (m_connection->receiveDataExactTimeout(header, sizeof(header), READ_BLOCK_TIMEOUT) != sizeof(header))
+                break;
+            value = getLong(&header[0]);
+
+            /* the acknowledgement */
+            if (offset == size || value < 0) {
+                if (value != packetID - 1 || getLong(&header[4]) != tag)
+                    break;
+                if (offset == size)
+                    sts = 0;
+                else {
+                    /* the request was run earlier but its data was lost; ask again */
+                    m_connection->stats().countDuplicateId();
+                    message("readWindow %d: already read, asking again", packetID);
+                    --packetID;
+                    sts = 1;
+                }
+                break;
+            }
+
+            /* a block */
+            if ((count = size - offset) > READ_BLOCK_SIZE)
+                count = READ_BLOCK_SIZE;
+            if (value != offset || m_connection->receiveDataExactTimeout(block, count, READ_BLOCK_TIMEOUT) != count)
+                break;
+            if (PropImage::sumBytes(block, count) != getLong(&header[4])) {
+                message("readWindow %d: bad checksum for block at offset %d", packetID, offset);
+                break;
+            }
+            memcpy(&buf[offset], block, count);
+        }
+
+        if (sts == 0) {
+            m_connection->stats().addPayloadBytes(size);
+            traceInstant("packet-ack", "\"id\":%d,\"result\":%d,\"attempt\":%d", packetID, packetID - 1, attempt);
+            *pPacketID = packetID - 1;
+            return 0;
+        }
+
+        /* wait for the loader to stop sending before asking again */
+        if (sts < 0) {
+            traceInstant("packet-timeout", "\"id\":%d,\"attempt\":%d,\"adaptive\":false", packetID, attempt);
+            message("readWindow %d failed - retrying", packetID);
+            while (m_connection->receiveDataTimeout(block, sizeof(block), READ_QUIET_TIMEOUT) > 0)
+                ;
+        }
+    }
+
+    message("readWindow %d failed - timeout", packetID);
+    return -2;
+}
+
+/*
+   fastVerifyEeprom - compare the EEPROM with what programming the image and any EEPROM regions would write
+
+   *pMismatch is set to the first EEPROM address that differs or to -1 if they match.
+*/
+int Loader::fastVerifyEeprom(const uint8_t *image, int imageSize, int *pMismatch)
+{
+    uint8_t *expected, *eeprom;
+    EepromRegion *region;
+    int size = MAX_IMAGE_SIZE;
+    SpinHdr *hdr;
+    int sts, i;
+
+    *pMismatch = -1;
+
+    /* read as much of the EEPROM as the regions cover */
+    for (region = m_eepromRegions; region != NULL; region = region->next)
+        if ((int)region->address + region->size > size)
+            size = region->address + region->size;
+
+    if (!(expected = (uint8_t *)calloc(1, MAX_IMAGE_SIZE)))
+        return -1;
+    if (!(eeprom = (uint8_t *)malloc(size))) {
+        free(expected);
+        return -1;
+    }
+
+    /* the RAM image as the loader programs it: the program clock settings, zeros and the initial call frame */
+    hdr = (SpinHdr *)image;
+    memcpy(expected, image, hdr->vbase < imageSize ? hdr->vbase : imageSize);
+    PropImage img(expected, MAX_IMAGE_SIZE);
+    img.prepare(m_connection->config());
+    if (hdr->dbase >= sizeof(initCallFrame) && hdr->dbase <= MAX_IMAGE_SIZE)
+        memcpy(&expected[hdr->dbase - sizeof(initCallFrame)], initCallFrame, sizeof(initCallFrame));
+
+    nmessage(INFO_VERIFYING_EEPROM);
+    if ((sts = fastReadMemory(mtEEPROM, 0, eeprom, size)) == 0) {
+        for (i = 0; i < MAX_IMAGE_SIZE; ++i)
+            if (eeprom[i] != expected[i]) {
+                *pMismatch = i;
+                break;
+            }
+        for (region = m_eepromRegions; *pMismatch < 0 && region != NULL; region = region->next)
+            for (i = 0; i < region->size; ++i)
+                if (eeprom[region->address + i] != region->data[i]) {
+                    *pMismatch = region->address + i;
+                    break;
+                }
+    }
+
+    free(expected);
+    free(eeprom);
+
+    return sts == 0 ? 0 : -1;
+}
@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include "imagepatch.h"
+#include "loadelf.h"
+#include "propimage.h"
+#include "proploader.h"
+
+#define MAP_SUFFIX      ".map"
+
+static int NewImagePatch(ImagePatch ***pNext, const char *name, int nameLen, const char *expr);
+static int AddImagePatchList(ImagePatch ***pNext, const char *manifest);
+static int FindElfPatchSymbols(FILE *fp, ElfHdr *hdr, ImagePatch *patches);
+static int FindMapPatchSymbols(const char *file, ImagePatch *patches);
+static char *TrimSpaces(char *str);
+
+/* NewImagePatch - add a patch to the list given the symbol name and value expression */
+static int NewImagePatch(ImagePatch ***pNext, const char *name, int nameLen, const char *expr)
+{
+    ImagePatch *patch;
+
+    if (nameLen == 0 || !*expr)
+        return error("expecting <symbol>=<value>");
+    if (!(patch = (ImagePatch *)malloc(sizeof(ImagePatch) + nameLen + strlen(expr) + 1)))
+        return nerror(ERROR_INSUFFICIENT_MEMORY);
+    patch->next = NULL;
+    patch->offset = -1;
+    patch->size = 0;
+    strncpy(patch->name, name, nameLen);
+    patch->name[nameLen] = '\0';
+    patch->expr = strcpy(&patch->name[nameLen + 1], expr);
+
+    **pNext = patch;
+    *pNext = &patch->next;
+    return 0;
+}
+
+/* AddImagePatchList - add the patches in a manifest with a <symbol>=<value> on each line */
+static int AddImagePatchList(ImagePatch ***pNext, const char *manifest)
+{
+    char line[256], *name, *p;
+    int lineNumber = 0, sts = 0;
+    FILE *fp;
+
+    if (!(fp = fopen(manifest, "r")))
+        return nerror(ERROR_CANT_OPEN_FILE, manifest);
+
+    while (sts == 0 && fgets(line, sizeof(line), fp)) {
+        ++lineNumber;
+        name = TrimSpaces(line);
+        if (!*name || *name == '#')
+            continue;
+        if (!(p = strchr(name, '=')))
+            sts = error("%s:%d: expecting <symbol>=<value>", manifest, lineNumber);
+        else {
+            *p = '\0';
+            name = TrimSpaces(name);
+            sts = NewImagePatch(pNext, name, strlen(name), TrimSpaces(p + 1));
+        }
+    }
+    fclose(fp);
+
+    return sts;
+}
+
+/* AddImagePatches - add a <symbol>=<value> patch or the patches in an @manifest */
+int AddImagePatches(ImagePatch ***pNext, const char *arg)
+{
+    const char *p;
+
+    if (*arg == '@')
+        return AddImagePatchList(pNext, arg + 1);
+
+    if (!(p = strchr(arg, '=')))
+        return error("expecting <symbol>=<value>: %s", arg);
+    return NewImagePatch(pNext, arg, p - arg, p + 1);
+}
+
+/*
+   PatchImageSymbols - store values in an image loaded from a file
+
+   Symbols are looked up in the symbol table of an elf file. A PropGCC C symbol can be given with
+   or without its leading underscore. For a Spin binary the offsets come from a map file next to
+   it with the same name and a .map extension. Each line of the map has a name, an offset in the
+   image and an optional size in bytes which defaults to 4.
+
+   Values are expressions that can refer to the board configuration variables.
+*/
+int PatchImageSymbols(BoardConfig *config, const char *file, uint8_t *image, int imageSize, ImagePatch *patches)
+{
+    PropImage img(image, imageSize);
+    BoardConfig *values;
+    ImagePatch *patch;
+    ElfHdr hdr;
+    FILE *fp;
+    int sts, value;
+
+    if (!patches)
+        return 0;
+
+    /* find the symbols, forgetting where they were in any earlier image */
+    for (patch = patches; patch != NULL; patch = patch->next) {
+        patch->offset = -1;
+        patch->size = 0;
+    }
+    if (!(fp = fopen(file, "rb")))
+        return nerror(ERROR_CANT_OPEN_FILE, file);
+    if (ReadAndCheckElfHdr(fp, &hdr))
+        sts = FindElfPatchSymbols(fp, &hdr, patches);
+    else
+        sts = FindMapPatchSymbols(file, patches);
+    fclose(fp);
+    if (sts != 0)
+        return sts;
+
+    /* evaluate the values and store them in the image */
+    values = NewBoardConfig(config, "");
+    for (patch = patches; patch != NULL; patch = patch->next) {
+        if (patch->offset < 0) {
+            error("Symbol '%s' not found", patch->name);
+            return nerror(ERROR_CANT_SET_SYMBOL, patch->name);
+        }
+        SetConfigField(values, "symbol-value", patch->expr);
+        if (!GetNumericConfigField(values, "symbol-value", &value)) {
+            error("Bad value for '%s': %s", patch->name, patch->expr);
+            return nerror(ERROR_CANT_SET_SYMBOL, patch->name);
+        }
+        if (img.patch(patch->offset, (uint32_t)value, patch->size) != PropImage::SUCCESS) {
+            error("Symbol '%s' at offset %d is outside of the image", patch->name, patch->offset);
+            return nerror(ERROR_CANT_SET_SYMBOL, patch->name);
+        }
+        nmessage(INFO_SETTING_SYMBOL, patch->name, value);
+    }
+
+    return 0;
+}
+
+/* FindElfPatchSymbols - find the image offsets of symbols in an elf file */
+static int FindElfPatchSymbols(FILE *fp, ElfHdr *hdr, ImagePatch *patches)
+{
+    uint32_t start, imageSize, cogImagesSize;
+    char name[ELFNAMEMAX];
+    ImagePatch *patch;
+    ElfSymbol symbol;
+    ElfContext *c;
+    int sts = 0;
+
+    if (!(c = OpenElfFile(fp, hdr)))
+        return error("Can't read the elf file");
+    if (!GetProgramSize(c, &start, &imageSize, &cogImagesSize)) {
+        FreeElfContext(c);
+        return error("Can't read the elf file");
+    }
+
+    for (patch = patches; sts == 0 && patch != NULL; patch = patch->next) {
+        if (!FindElfSymbol(c, patch->name, &symbol)) {
+            snprintf(name, sizeof(name), "_%s", patch->name);
+            if (!FindElfSymbol(c, name, &symbol))
+                continue;
+        }
+        if (symbol.value < start || symbol.value - start >= imageSize)
+            sts = error("Symbol '%s' is not in the image", patch->name);
+        else if (symbol.size != 0 && symbol.size != 1 && symbol.size != 2 && symbol.size != 4)
+            sts = error("Symbol '%s' is %d bytes, expecting 1, 2 or 4", patch->name, symbol.size);
+        else {
+            patch->offset = symbol.value - start;
+            patch->size = symbol.size ? symbol.size : 4;
+        }
+    }
+
+    FreeElfContext(c);
+    return sts;
+}
+
+/* FindMapPatchSymbols - find the image offsets of symbols in the map file for a Spin binary */
+static int FindMapPatchSymbols(const char *file, ImagePatch *patches)
+{
+    char path[PATH_MAX], line[256], *name, *offset, *size, *end, *p;
+    int lineNumber = 0, sts = 0;
+    ImagePatch *patch;
+    FILE *fp;
+
+    /* replace the extension of the image file with .map */
+    if (strlen(file) + sizeof(MAP_SUFFIX) > sizeof(path))
+        return error("File name too long: %s", file);
+    strcpy(path, file);
+    if ((p = strrchr(path, '.')) != NULL && !strchr(p, '/'))
+        *p = '\0';
+    strcat(path, MAP_SUFFIX);
+
+    if (!(fp = fopen(path, "r"))) {
+        error("Spin binaries need a symbol map in '%s'", path);
+        return nerror(ERROR_CANT_OPEN_FILE, path);
+    }
+
+    while (sts == 0 && fgets(line, sizeof(line), fp)) {
+        ++lineNumber;
+        if (!(name = strtok(line, " \t\r\n")) || *name == '#')
+            continue;
+        offset = strtok(NULL, " \t\r\n");
+        size = strtok(NULL, " \t\r\n");
+        if (!offset || strtok(NULL, " \t\r\n")) {
+            sts = error("%s:%d: expecting a name, an offset and an optional size", path, lineNumber);
+            break;
+        }
+        for (patch = patches; patch != NULL; patch = patch->next) {
+            if (strcmp(name, patch->name) != 0)
+                continue;
+            patch->offset = (int)strtol(offset, &end, 0);
+            if (*end == '\0' && size)
+                patch->size = (int)strtol(size, &end, 0);
+            else
+                patch->size = 4;
+            if (*end != '\0')
+                sts = error("%s:%d: bad offset or size", path, lineNumber);
+            else if (patch->offset < 0)
+                sts = error("%s:%d: offset of '%s' is negative", path, lineNumber, name);
+            else if (patch->size != 1 && patch->size != 2 && patch->size != 4)
+                sts = error("%s:%d: '%s' is %d bytes, expecting 1, 2 or 4", path, lineNumber, name, patch->size);
+            if (sts != 0)
+                break;
+        }
+    }
+    fclose(fp);
+
+    return sts;
+}
+
+/* TrimSpaces - remove leading and trailing white space */
+static char *TrimSpaces(char *str)
+{
+    char *end;
+    while (isspace((unsigned char)*str))
+        ++str;
+    end = str + strlen(str);
+    while (end > str && isspace((unsigned char)end[-1]))
+        --end;
+    *end = '\0';
+    return str;
+}
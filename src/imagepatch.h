@@ -0,0 +1,19 @@
+#ifndef IMAGEPATCH_H
+#define IMAGEPATCH_H
+
+#include <stdint.h>
+#include "config.h"
+
+/* a value to store in a named location in the image before it is loaded */
+typedef struct ImagePatch {
+    struct ImagePatch *next;
+    char *expr;                 /* the value, an expression like the ones used with -D */
+    int offset;                 /* offset of the value in the image, -1 until resolved */
+    int size;                   /* 1, 2 or 4 bytes */
+    char name[1];
+} ImagePatch;
+
+int AddImagePatches(ImagePatch ***pNext, const char *arg);
+int PatchImageSymbols(BoardConfig *config, const char *file, uint8_t *image, int imageSize, ImagePatch *patches);
+
+#endif
@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "inspect.h"
+#include "loader.h"
+#include "loadelf.h"
+#include "propimage.h"
+#include "proploader.h"
+
+/* threads used when the number of processors isn't known */
+#define DEF_INSPECT_THREADS     4
+
+typedef struct {
+    const char *file;
+    char *result;                       /* a line of JSON once the file has been inspected */
+    bool valid;
+} InspectJob;
+
+typedef struct {
+    InspectJob *jobs;
+    int count;
+    std::atomic<int> next;              /* next job to start */
+    std::mutex mutex;
+    std::condition_variable done;       /* signalled as each job finishes */
+} InspectQueue;
+
+static void InspectWorker(InspectQueue *queue);
+static char *InspectImage(const char *file, bool *pValid);
+static const char *ImageType(const char *file);
+static void JsonString(char *buf, int size, const char *str);
+
+/*
+   InspectImages - validate image files in parallel and show their headers
+
+   A line of JSON is written to stdout for each file in the order the files were given. Each
+   line has the file name, the image type and size, whether it is valid and why not, the state
+   of the checksum and the Spin header fields. Returns 0 if every image is valid.
+*/
+int InspectImages(const char **files, int count)
+{
+    std::thread *threads;
+    InspectQueue queue;
+    int threadCount, invalid = 0, i;
+
+    if (!(queue.jobs = (InspectJob *)calloc(count, sizeof(InspectJob))))
+        return nerror(ERROR_INSUFFICIENT_MEMORY);
+    for (i = 0; i < count; ++i)
+        queue.jobs[i].file = files[i];
+    queue.count = count;
+    queue.next = 0;
+
+    /* use a thread for each processor but no more than there are files */
+    if ((threadCount = std::thread::hardware_concurrency()) <= 0)
+        threadCount = DEF_INSPECT_THREADS;
+    if (threadCount > count)
+        threadCount = count;
+    threads = new std::thread[threadCount];
+    for (i = 0; i < threadCount; ++i)
+        threads[i] = std::thread(InspectWorker, &queue);
+
+    /* show the results in order as they become available */
+    for (i = 0; i < count; ++i) {
+        std::unique_lock<std::mutex> lock(queue.mutex);
+        queue.done.wait(lock, [&queue, i] { return queue.jobs[i].result != NULL; });
+        lock.unlock();
+        fputs(queue.jobs[i].result, stdout);
+        fflush(stdout);
+        if (!queue.jobs[i].valid)
+            ++invalid;
+        free(queue.jobs[i].result);
+    }
+
+    for (i = 0; i < threadCount; ++i)
+        threads[i].join();
+    delete[] threads;
+    free(queue.jobs);
+
+    return invalid == 0 ? 0 : -1;
+}
+
+/* InspectWorker - inspect files until there are none left */
+static void InspectWorker(InspectQueue *queue)
+{
+    int i;
+    while ((i = queue->next++) < queue->count) {
+        bool valid;
+        char *result = InspectImage(queue->jobs[i].file, &valid);
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        queue->jobs[i].valid = valid;
+        queue->jobs[i].result = result;
+        queue->done.notify_all();
+    }
+}
+
+/* InspectImage - read and validate an image and describe it in a line of JSON */
+static char *InspectImage(const char *file, bool *pValid)
+{
+    char line[PATH_MAX * 2 + 512], name[PATH_MAX * 2], *p;
+    const char *type, *reason, *checksum;
+    int imageSize, hubSize;
+    uint8_t *image;
+    SpinHdr *hdr;
+
+    JsonString(name, sizeof(name), file);
+    type = ImageType(file);
+    p = line + sprintf(line, "{\"file\":%s,\"type\":\"%s\"", name, type);
+
+    if (!(image = Loader::readFile(file, &imageSize))) {
+        sprintf(p, ",\"valid\":false,\"error\":\"can't read the image\"}\n");
+        *pValid = false;
+        return strdup(line);
+    }
+
+    /* the part of a large .eeprom image beyond hub memory is for the upper eeprom */
+    hubSize = imageSize;
+    if (strcmp(type, "eeprom") == 0 && imageSize > MAX_IMAGE_SIZE && imageSize <= MAX_EEPROM_SIZE)
+        hubSize = MAX_IMAGE_SIZE;
+
+    PropImage img(image, hubSize);
+    *pValid = img.validate(&reason) == PropImage::SUCCESS;
+    p += sprintf(p, ",\"size\":%d,\"valid\":%s", imageSize, *pValid ? "true" : "false");
+    if (reason)
+        p += sprintf(p, ",\"error\":\"%s\"", reason);
+
+    /* the header fields are only there if the image is at least as big as the header */
+    if (imageSize >= (int)sizeof(SpinHdr)) {
+        hdr = (SpinHdr *)image;
+        if (hdr->vbase > hubSize)
+            checksum = "unchecked";
+        else
+            checksum = (img.loadChecksum() & 0xFF) == 0 ? "ok" : "bad";
+        sprintf(p, ",\"checksum\":\"%s\",\"clkfreq\":%u,\"clkmode\":\"0x%02x\",\"chksum\":\"0x%02x\","
+                   "\"pbase\":%u,\"vbase\":%u,\"dbase\":%u,\"pcurr\":%u,\"dcurr\":%u}\n",
+                checksum, img.clkFreq(), img.clkMode(), hdr->chksum,
+                hdr->pbase, hdr->vbase, hdr->dbase, hdr->pcurr, hdr->dcurr);
+    }
+    else
+        sprintf(p, "}\n");
+
+    free(image);
+    return strdup(line);
+}
+
+/* ImageType - get the type of an image from its contents or extension */
+static const char *ImageType(const char *file)
+{
+    const char *ext;
+    ElfHdr hdr;
+    FILE *fp;
+    int isElf;
+
+    if (!(fp = fopen(file, "rb")))
+        return "unknown";
+    isElf = ReadAndCheckElfHdr(fp, &hdr);
+    fclose(fp);
+    if (isElf)
+        return "elf";
+
+    if ((ext = strrchr(file, '.')) != NULL && strcmp(ext, ".eeprom") == 0)
+        return "eeprom";
+    return "binary";
+}
+
+/* JsonString - quote a string for JSON */
+static void JsonString(char *buf, int size, const char *str)
+{
+    char *end = buf + size - 8;
+    *buf++ = '"';
+    for (; *str && buf < end; ++str) {
+        if (*str == '"' || *str == '\\') {
+            *buf++ = '\\';
+            *buf++ = *str;
+        }
+        else if ((unsigned char)*str < 0x20)
+            buf += sprintf(buf, "\\u%04x", (unsigned char)*str);
+        else
+            *buf++ = *str;
+    }
+    *buf++ = '"';
+    *buf = '\0';
+}
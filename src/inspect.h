@@ -0,0 +1,6 @@
+#ifndef INSPECT_H
+#define INSPECT_H
+
+int InspectImages(const char **files, int count);
+
+#endif
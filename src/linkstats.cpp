@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include "linkstats.h"
+#include "deadline.h"
+#include "messages.h"
+
+/* upper bounds of the packet round-trip time histogram buckets (in seconds) */
+static const double rttBuckets[] = { 0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1.0, 2.0 };
+#define RTT_BUCKET_COUNT    ((int)(sizeof(rttBuckets) / sizeof(rttBuckets[0])))
+
+LinkStats::LinkStats()
+    : m_rttSamples(NULL), m_rttMax(0)
+{
+    begin();
+}
+
+LinkStats::~LinkStats()
+{
+    if (m_rttSamples)
+        free(m_rttSamples);
+}
+
+/* begin - reset the counters at the start of a load */
+void LinkStats::begin()
+{
+    m_startTime = MicrosecondTimer();
+    m_elapsedTime = 0;
+    m_payloadBytes = 0;
+    m_wireBytes = 0;
+    m_packets = 0;
+    m_retries = 0;
+    m_tagMismatches = 0;
+    m_duplicateIds = 0;
+    m_adaptiveTimeouts = 0;
+    m_baudRate = 0;
+    m_success = false;
+    m_rttCount = 0;
+}
+
+/* end - record the outcome of a load */
+void LinkStats::end(bool success, int baudRate)
+{
+    m_elapsedTime = MicrosecondTimer() - m_startTime;
+    m_success = success;
+    m_baudRate = baudRate;
+}
+
+void LinkStats::addRttSample(int microseconds)
+{
+    if (m_rttCount >= m_rttMax) {
+        int newMax = m_rttMax ? m_rttMax * 2 : 64;
+        int *newSamples;
+        if (!(newSamples = (int *)realloc(m_rttSamples, newMax * sizeof(int))))
+            return;
+        m_rttSamples = newSamples;
+        m_rttMax = newMax;
+    }
+    m_rttSamples[m_rttCount++] = microseconds;
+}
+
+static int CompareInts(const void *p1, const void *p2)
+{
+    int v1 = *(const int *)p1, v2 = *(const int *)p2;
+    return v1 < v2 ? -1 : v1 > v2 ? 1 : 0;
+}
+
+/* rttPercentile - return a round-trip time percentile using the nearest-rank method */
+int LinkStats::rttPercentile(int percent)
+{
+    int rank;
+    if (m_rttCount == 0)
+        return 0;
+    qsort(m_rttSamples, m_rttCount, sizeof(int), CompareInts);
+    rank = (percent * m_rttCount + 99) / 100;
+    return m_rttSamples[rank > 0 ? rank - 1 : 0];
+}
+
+void LinkStats::printSummary()
+{
+    double seconds = m_elapsedTime / 1000000.0;
+    double rttMin = 0, rttAvg = 0, rttP99 = 0;
+    int i;
+
+    if (m_rttCount > 0) {
+        int64_t total = 0;
+        for (i = 0; i < m_rttCount; ++i)
+            total += m_rttSamples[i];
+        rttAvg = total / (double)m_rttCount / 1000.0;
+        rttP99 = rttPercentile(99) / 1000.0;
+        rttMin = m_rttSamples[0] / 1000.0; // sorted by rttPercentile
+    }
+
+    nmessage(INFO_LOAD_STATISTICS,
+             (long)m_payloadBytes, seconds, seconds > 0 ? m_payloadBytes / seconds : 0.0,
+             (long)m_wireBytes, seconds > 0 ? m_wireBytes / seconds : 0.0,
+             m_packets, rttMin, rttAvg, rttP99,
+             m_retries, m_tagMismatches, m_duplicateIds, m_adaptiveTimeouts, m_baudRate);
+}
+
+/* updatePrometheusTextfile - add the counters for this load to a Prometheus textfile collector file
+
+   Counters already in the file are read back and accumulated so repeated runs build up totals.
+   The file is written to a temporary name and renamed so a scraper never sees a partial file.
+*/
+int LinkStats::updatePrometheusTextfile(const char *path)
+{
+    std::map<std::string, double> values;
+    std::string tmpPath = std::string(path) + ".tmp";
+    char line[256], bucket[64];
+    FILE *fp;
+    int i;
+
+    /* read the existing values */
+    if ((fp = fopen(path, "r")) != NULL) {
+        while (fgets(line, sizeof(line), fp)) {
+            char *p;
+            if (line[0] == '#' || !(p = strrchr(line, ' ')))
+                continue;
+            *p++ = '\0';
+            values[line] += strtod(p, NULL);
+        }
+        fclose(fp);
+    }
+
+    /* accumulate the counters for this load */
+    values["proploader_loads_total{result=\"success\"}"] += m_success ? 1 : 0;
+    values["proploader_loads_total{result=\"failure\"}"] += m_success ? 0 : 1;
+    values["proploader_load_duration_seconds_total"] += m_elapsedTime / 1000000.0;
+    values["proploader_payload_bytes_total"] += (double)m_payloadBytes;
+    values["proploader_wire_bytes_total"] += (double)m_wireBytes;
+    values["proploader_packets_total"] += m_packets;
+    values["proploader_packet_retries_total"] += m_retries;
+    values["proploader_tag_mismatches_total"] += m_tagMismatches;
+    values["proploader_duplicate_id_responses_total"] += m_duplicateIds;
+    values["proploader_adaptive_timeouts_total"] += m_adaptiveTimeouts;
+    for (int b = 0; b < RTT_BUCKET_COUNT; ++b) {
+        int count = 0;
+        for (i = 0; i < m_rttCount; ++i)
+            if (m_rttSamples[i] <= rttBuckets[b] * 1000000.0)
+                ++count;
+        snprintf(bucket, sizeof(bucket), "proploader_packet_rtt_seconds_bucket{le=\"%g\"}", rttBuckets[b]);
+        values[bucket] += count;
+    }
+    values["proploader_packet_rtt_seconds_bucket{le=\"+Inf\"}"] += m_rttCount;
+    values["proploader_packet_rtt_seconds_count"] += m_rttCount;
+    for (i = 0; i < m_rttCount; ++i)
+        values["proploader_packet_rtt_seconds_sum"] += m_rttSamples[i] / 1000000.0;
+
+    /* gauges describe only the most recent load */
+    values["proploader_last_baud_rate"] = m_baudRate;
+    values["proploader_last_payload_bytes_per_second"] = m_elapsedTime > 0 ? m_payloadBytes / (m_elapsedTime / 1000000.0) : 0;
+
+    /* write the new file */
+    if (!(fp = fopen(tmpPath.c_str(), "w")))
+        return -1;
+    fprintf(fp, "# HELP proploader_loads_total Loads attempted by result.\n");
+    fprintf(fp, "# TYPE proploader_loads_total counter\n");
+    fprintf(fp, "# HELP proploader_packet_rtt_seconds Second-stage loader packet round-trip time.\n");
+    fprintf(fp, "# TYPE proploader_packet_rtt_seconds histogram\n");
+    fprintf(fp, "# TYPE proploader_last_baud_rate gauge\n");
+    fprintf(fp, "# TYPE proploader_last_payload_bytes_per_second gauge\n");
+    std::map<std::string, double>::iterator it;
+    for (it = values.begin(); it != values.end(); ++it)
+        fprintf(fp, "%s %.17g\n", it->first.c_str(), it->second);
+    if (fclose(fp) != 0)
+        return -1;
+#ifdef __MINGW32__
+    remove(path);
+#endif
+    return rename(tmpPath.c_str(), path) == 0 ? 0 : -1;
+}
@@ -0,0 +1,43 @@
+#ifndef LINKSTATS_H
+#define LINKSTATS_H
+
+#include <stdint.h>
+
+/* LinkStats - throughput and latency counters for one load over a connection */
+class LinkStats
+{
+public:
+    LinkStats();
+    ~LinkStats();
+    void begin();
+    void end(bool success, int baudRate);
+    void addPayloadBytes(int count) { m_payloadBytes += count; }
+    void addWireBytes(int count) { if (count > 0) m_wireBytes += count; }
+    void addPacket() { ++m_packets; }
+    void addRttSample(int microseconds);
+    void countRetry() { ++m_retries; }
+    void countTagMismatch() { ++m_tagMismatches; }
+    void countDuplicateId() { ++m_duplicateIds; }
+    void countAdaptiveTimeout() { ++m_adaptiveTimeouts; }
+    int adaptiveTimeouts() { return m_adaptiveTimeouts; }
+    void printSummary();
+    int updatePrometheusTextfile(const char *path);
+private:
+    int rttPercentile(int percent);
+    uint64_t m_startTime;
+    uint64_t m_elapsedTime;
+    int64_t m_payloadBytes;
+    int64_t m_wireBytes;
+    int m_packets;
+    int m_retries;
+    int m_tagMismatches;
+    int m_duplicateIds;
+    int m_adaptiveTimeouts;
+    int m_baudRate;
+    bool m_success;
+    int *m_rttSamples;
+    int m_rttCount;
+    int m_rttMax;
+};
+
+#endif // LINKSTATS_H
@@ -1,357 +1,610 @@
-/* loadelf.c - an elf loader for the Parallax Propeller microcontroller
-
-Copyright (c) 2011 David Michael Betz
-
-Permission is hereby granted, free of charge, to any person obtaining a copy of this software
-and associated documentation files (the "Software"), to deal in the Software without restriction,
-including without limitation the rights to use, copy, modify, merge, publish, distribute,
-sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
-furnished to do so, subject to the following conditions:
-
-The above copyright notice and this permission notice shall be included in all copies or
-substantial portions of the Software.
-
-THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
-BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
-NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
-DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
-OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
-
-*/
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdint.h>
-#include <string.h>
-#include "loadelf.h"
-#include "proploader.h"
-
-#ifndef TRUE
-#define TRUE    1
-#define FALSE   0
-#endif
-
-#define IDENT_SIGNIFICANT_BYTES 9
-
-static uint8_t ident[] = {
-    0x7f, 'E', 'L', 'F',                        // magic number
-    0x01,                                       // class
-    0x01,                                       // data
-    0x01,                                       // version
-    0x00,                                       // os / abi identification
-    0x00,                                       // abi version
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00    // padding
-};
-
-static int FindProgramTableEntry(ElfContext *c, ElfSectionHdr *section, ElfProgramHdr *program);
-static void ShowSectionHdr(ElfSectionHdr *section);
-static void ShowProgramHdr(ElfProgramHdr *program);
-
-int ReadAndCheckElfHdr(FILE *fp, ElfHdr *hdr)
-{
-    if (fread(hdr, 1, sizeof(ElfHdr), fp) != sizeof(ElfHdr))
-        return FALSE;
-    return memcmp(ident, hdr->ident, IDENT_SIGNIFICANT_BYTES) == 0;
-}
-
-ElfContext *OpenElfFile(FILE *fp, ElfHdr *hdr)
-{
-    ElfSectionHdr section;
-    ElfContext *c;
-    
-    /* allocate and initialize a context structure */
-    if (!(c = (ElfContext *)malloc(sizeof(ElfContext))))
-        return NULL;
-    memset(c, 0, sizeof(ElfContext));
-    c->hdr = *hdr;
-    c->fp = fp;
-        
-    /* get the string section offset */
-    if (!LoadSectionTableEntry(c, c->hdr.shstrndx, &section)) {
-        free(c);
-        return NULL;
-    }
-    c->stringOff = section.offset;
-    
-    /* get the symbol table section offset */
-    if (FindSectionTableEntry(c, ".symtab", &section)) {
-        c->symbolOff = section.offset;
-        c->symbolCnt = section.size / sizeof(ElfSymbol);
-        if (FindSectionTableEntry(c, ".strtab", &section))
-            c->symbolStringOff = section.offset;
-        else {
-            c->symbolOff = 0;
-            c->symbolCnt = 0;
-        }
-    }
-    
-    /* return the context */
-    return c;
-}
-
-void FreeElfContext(ElfContext *c)
-{
-    free(c);
-}
-
-int GetProgramSize(ElfContext *c, uint32_t *pStart, uint32_t *pSize, uint32_t *pCogImagesSize)
-{
-    ElfProgramHdr program;
-    uint32_t start = 0xffffffff;
-    uint32_t end = 0;
-    uint32_t cogImagesStart = 0xffffffff;
-    uint32_t cogImagesEnd = 0;
-    int cogImagesFound = FALSE;
-    int i;
-    for (i = 0; i < c->hdr.phnum; ++i) {
-        if (!LoadProgramTableEntry(c, i, &program)) {
-            message("Can't read ELF program header %d", i);
-            return FALSE;
-        }
-        if (program.paddr < COG_DRIVER_IMAGE_BASE) {
-            if (program.paddr < start)
-                start = program.paddr;
-            if (program.paddr + program.filesz > end)
-                end = program.paddr + program.filesz;
-        }
-        else {
-            if (program.paddr < cogImagesStart)
-                cogImagesStart = program.paddr;
-            if (program.paddr + program.filesz > cogImagesEnd)
-                cogImagesEnd = program.paddr + program.filesz;
-            cogImagesFound = TRUE;
-        }
-    }
-    *pStart = start;
-    *pSize = end - start;
-    *pCogImagesSize = cogImagesFound ? cogImagesEnd - cogImagesStart : 0;
-    return TRUE;
-}
-
-int FindProgramSegment(ElfContext *c, const char *name, ElfProgramHdr *program)
-{
-    ElfSectionHdr section;
-    if (!FindSectionTableEntry(c, name, &section))
-        return -1;
-    return FindProgramTableEntry(c, &section, program);
-}
-
-uint8_t *LoadProgramSegment(ElfContext *c, ElfProgramHdr *program)
-{
-    uint8_t *buf;
-    if (!(buf = (uint8_t *)malloc(program->filesz)))
-        return NULL;
-    if (fseek(c->fp, program->offset, SEEK_SET) != 0) {
-        free(buf);
-        return NULL;
-    }
-    if (fread(buf, 1, program->filesz, c->fp) != program->filesz) {
-        free(buf);
-        return NULL;
-    }
-    return buf;
-}
-
-int FindSectionTableEntry(ElfContext *c, const char *name, ElfSectionHdr *section)
-{
-    int i;
-    for (i = 0; i < c->hdr.shnum; ++i) {
-        char thisName[ELFNAMEMAX], *p = thisName;
-        int cnt, ch;
-        if (!LoadSectionTableEntry(c, i, section)) {
-            message("Can't read ELF section header %d", i);
-            return 1;
-        }
-        fseek(c->fp, c->stringOff + section->name, SEEK_SET);
-        for (cnt = 0; ++cnt < ELFNAMEMAX && (ch = getc(c->fp)) != '\0'; )
-            *p++ = ch;
-        *p = '\0';
-        if (strcmp(name, thisName) == 0)
-            return TRUE;
-    }
-    return FALSE;
-}
-
-int LoadSectionTableEntry(ElfContext *c, int i, ElfSectionHdr *section)
-{
-    return fseek(c->fp, c->hdr.shoff + i * c->hdr.shentsize, SEEK_SET) == 0
-        && fread(section, 1, sizeof(ElfSectionHdr), c->fp) == sizeof(ElfSectionHdr);
-}
-
-static int FindProgramTableEntry(ElfContext *c, ElfSectionHdr *section, ElfProgramHdr *program)
-{
-    int i;
-    for (i = 0; i < c->hdr.shnum; ++i) {
-        if (!LoadProgramTableEntry(c, i, program)) {
-            message("Can't read ELF program header %d", i);
-            return -1;
-        }
-        if (SectionInProgramSegment(section, program))
-            return i;
-    }
-    return -1;
-}
-
-int LoadProgramTableEntry(ElfContext *c, int i, ElfProgramHdr *program)
-{
-    return fseek(c->fp, c->hdr.phoff + i * c->hdr.phentsize, SEEK_SET) == 0
-        && fread(program, 1, sizeof(ElfProgramHdr), c->fp) == sizeof(ElfProgramHdr);
-}
-
-int FindElfSymbol(ElfContext *c, const char *name, ElfSymbol *symbol)
-{
-    int i;
-    for (i = 1; i < c->symbolCnt; ++i) {
-        char thisName[ELFNAMEMAX];
-        if (LoadElfSymbol(c, i, thisName, symbol) == 0 && strcmp(name, thisName) == 0)
-            return TRUE;
-    }
-    return FALSE;
-}
-
-int LoadElfSymbol(ElfContext *c, int i, char *name, ElfSymbol *symbol)
-{
-    char *p = name;
-    if (fseek(c->fp, c->symbolOff + i * sizeof(ElfSymbol), SEEK_SET) != 0
-    ||  fread(symbol, 1, sizeof(ElfSymbol), c->fp) != sizeof(ElfSymbol))
-        return -1;
-    if (symbol->name) {
-        int cnt, ch;
-        fseek(c->fp, c->symbolStringOff + symbol->name, SEEK_SET);
-        for (cnt = 0; ++cnt < ELFNAMEMAX && (ch = getc(c->fp)) != '\0'; )
-            *p++ = ch;
-    }
-    *p = '\0';
-    return 0;
-}
-
-void ShowElfFile(ElfContext *c)
-{
-    ElfSectionHdr section;
-    ElfProgramHdr program;
-    int i;
-
-    /* show file header */
-    printf("ELF Header:\n");
-    printf("  ident:    ");
-    for (i = 0; i < sizeof(c->hdr.ident); ++i)
-        printf(" %02x", c->hdr.ident[i]);
-    putchar('\n');
-    printf("  type:      %04x\n", c->hdr.type);
-    printf("  machine:   %04x\n", c->hdr.machine);
-    printf("  version:   %08x\n", c->hdr.version);
-    printf("  entry:     %08x\n", c->hdr.entry);
-    printf("  phoff:     %08x\n", c->hdr.phoff);
-    printf("  shoff:     %08x\n", c->hdr.shoff);
-    printf("  flags:     %08x\n", c->hdr.flags);
-    printf("  ehsize:    %d\n", c->hdr.entry);
-    printf("  phentsize: %d\n", c->hdr.phentsize);
-    printf("  phnum:     %d\n", c->hdr.phnum);
-    printf("  shentsize: %d\n", c->hdr.shentsize);
-    printf("  shnum:     %d\n", c->hdr.shnum);
-    printf("  shstrndx:  %d\n", c->hdr.shstrndx);
-    
-    /* show the section table */
-    for (i = 0; i < c->hdr.shnum; ++i) {
-        char name[ELFNAMEMAX], *p = name;
-        int cnt, ch;
-        if (!LoadSectionTableEntry(c, i, &section)) {
-            printf("error: can't read section header %d\n", i);
-            return;
-        }
-        fseek(c->fp, c->stringOff + section.name, SEEK_SET);
-        for (cnt = 0; ++cnt < ELFNAMEMAX && (ch = getc(c->fp)) != '\0'; )
-            *p++ = ch;
-        *p = '\0';
-        printf("SectionHdr %d:\n", i);
-        printf("  name:      %08x %s\n", section.name, name);
-        ShowSectionHdr(&section);
-    }
-        
-    /* show the program table */
-    for (i = 0; i < c->hdr.phnum; ++i) {
-        if (!LoadProgramTableEntry(c, i, &program)) {
-            printf("error: can't read program header %d\n", i);
-            return;
-        }
-        printf("ProgramHdr %d:\n", i);
-        ShowProgramHdr(&program);
-    }
-    
-    /* show the symbol table */
-    for (i = 1; i < c->symbolCnt; ++i) {
-        char name[ELFNAMEMAX];
-        ElfSymbol symbol;
-        if (LoadElfSymbol(c, i, name, &symbol) == 0 && symbol.name && INFO_BIND(symbol.info) == STB_GLOBAL)
-            printf("  %08x %s: %08x\n", symbol.name, name, symbol.value);
-    }
-}
-
-static void ShowSectionHdr(ElfSectionHdr *section)
-{
-    printf("  type:      %08x\n", section->type);
-    printf("  flags:     %08x\n", section->flags);
-    printf("  addr:      %08x\n", section->addr);
-    printf("  offset:    %08x\n", section->offset);
-    printf("  size:      %08x\n", section->size);
-    printf("  link:      %08x\n", section->link);
-    printf("  info:      %08x\n", section->info);
-    printf("  addralign: %08x\n", section->addralign);
-    printf("  entsize:   %08x\n", section->entsize);
-}
-
-static void ShowProgramHdr(ElfProgramHdr *program)
-{
-    printf("  type:      %08x\n", program->type);
-    printf("  offset:    %08x\n", program->offset);
-    printf("  vaddr:     %08x\n", program->vaddr);
-    printf("  paddr:     %08x\n", program->paddr);
-    printf("  filesz:    %08x\n", program->filesz);
-    printf("  memsz:     %08x\n", program->memsz);
-    printf("  flags:     %08x\n", program->flags);
-    printf("  align:     %08x\n", program->align);
-}
-
-#ifdef MAIN
-
-int main(int argc, char *argv[])
-{
-    ElfContext *c;
-    ElfHdr hdr;
-    FILE *fp;
-
-    /* check the arguments */
-    if (argc != 2) {
-        printf("usage: loadelf <file>\n");
-        return 1;
-    }
-    
-    /* open the image file */
-    if (!(fp = fopen(argv[1], "rb"))) {
-        printf("error: opening '%s'\n", argv[1]);
-        return 1;
-    }
-    
-    /* make sure it's an elf file */
-    if (!ReadAndCheckElfHdr(fp, &hdr)) {
-        printf("error: not an elf file");
-        return 1;
-    }
-    
-    /* open the elf file */
-    if (!(c = OpenElfFile(fp, &hdr))) {
-        printf("error: opening elf file\n");
-        return 1;
-    }
-    
-    /* show the contents of the elf file */
-    ShowElfFile(c);
-    
-    /* close the elf file */
-    CloseElfFile(c);
-    
-    return 0;
-}
-
-#endif
-
+/* loadelf.c - an elf loader for the Parallax Propeller microcontroller
+
+Copyright (c) 2011 David Michael Betz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the "Software"), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#endif
+#include "loadelf.h"
+#include "proploader.h"
+
+#ifndef TRUE
+#define TRUE    1
+#define FALSE   0
+#endif
+
+#define IDENT_SIGNIFICANT_BYTES 9
+
+static uint8_t ident[] = {
+    0x7f, 'E', 'L', 'F',                        // magic number
+    0x01,                                       // class
+    0x01,                                       // data
+    0x01,                                       // version
+    0x00,                                       // os / abi identification
+    0x00,                                       // abi version
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00    // padding
+};
+
+static int MapElfFile(ElfContext *c, FILE *fp);
+static int InElfFile(ElfContext *c, uint32_t offset, uint32_t size);
+static int TableInElfFile(ElfContext *c, uint32_t offset, int count, int entrySize, int minEntrySize);
+static const char *ElfString(ElfContext *c, uint32_t tableOff, uint32_t tableSize, uint32_t offset);
+static uint32_t HashElfName(const char *name);
+static int BuildElfIndexes(ElfContext *c);
+static int BuildElfAddressIndex(ElfContext *c);
+static int CompareElfAddressEntries(const void *p1, const void *p2);
+static int FindProgramTableEntry(ElfContext *c, ElfSectionHdr *section, ElfProgramHdr *program);
+static void ShowSectionHdr(ElfSectionHdr *section);
+static void ShowProgramHdr(ElfProgramHdr *program);
+
+int ReadAndCheckElfHdr(FILE *fp, ElfHdr *hdr)
+{
+    if (fread(hdr, 1, sizeof(ElfHdr), fp) != sizeof(ElfHdr))
+        return FALSE;
+    return memcmp(ident, hdr->ident, IDENT_SIGNIFICANT_BYTES) == 0;
+}
+
+/*
+   OpenElfFile - map an elf file into memory
+
+   All of the tables are checked against the size of the file here so the rest of the functions
+   can read headers, names and segment data directly from the mapping.
+*/
+ElfContext *OpenElfFile(FILE *fp, ElfHdr *hdr)
+{
+    ElfSectionHdr section;
+    ElfProgramHdr program;
+    ElfContext *c;
+    int i;
+    
+    /* allocate and initialize a context structure */
+    if (!(c = (ElfContext *)malloc(sizeof(ElfContext))))
+        return NULL;
+    memset(c, 0, sizeof(ElfContext));
+    c->hdr = *hdr;
+
+    /* map the file into memory */
+    if (!MapElfFile(c, fp)) {
+        free(c);
+        return NULL;
+    }
+
+    /* make sure the program and section tables are in the file */
+    if (!TableInElfFile(c, c->hdr.phoff, c->hdr.phnum, c->hdr.phentsize, sizeof(ElfProgramHdr))
+    ||  !TableInElfFile(c, c->hdr.shoff, c->hdr.shnum, c->hdr.shentsize, sizeof(ElfSectionHdr))) {
+        message("Bad ELF program or section table");
+        goto fail;
+    }
+
+    /* make sure the data for each program segment is in the file */
+    for (i = 0; i < c->hdr.phnum; ++i) {
+        LoadProgramTableEntry(c, i, &program);
+        if (!InElfFile(c, program.offset, program.filesz)) {
+            message("Bad ELF program header %d", i);
+            goto fail;
+        }
+    }
+        
+    /* get the string section offset */
+    if (!LoadSectionTableEntry(c, c->hdr.shstrndx, &section)
+    ||  !InElfFile(c, section.offset, section.size)) {
+        message("Bad ELF section name table");
+        goto fail;
+    }
+    c->stringOff = section.offset;
+    c->stringSize = section.size;
+    
+    /* build the section name and symbol name indexes */
+    if (!BuildElfIndexes(c))
+        goto fail;
+    
+    /* return the context */
+    return c;
+
+fail:
+    FreeElfContext(c);
+    return NULL;
+}
+
+void FreeElfContext(ElfContext *c)
+{
+    free(c->sectionHash);
+    free(c->symbolHash);
+    free(c->addressIndex);
+    if (c->data) {
+#ifndef __MINGW32__
+        if (c->mapped)
+            munmap((void *)c->data, c->size);
+        else
+#endif
+            free((void *)c->data);
+    }
+    free(c);
+}
+
+/* MapElfFile - map the file or read it into memory where it can't be mapped */
+static int MapElfFile(ElfContext *c, FILE *fp)
+{
+    struct stat info;
+    uint8_t *data;
+
+    if (fstat(fileno(fp), &info) != 0 || info.st_size < (off_t)sizeof(ElfHdr) || (uint64_t)info.st_size > 0xffffffff)
+        return FALSE;
+    c->size = (size_t)info.st_size;
+
+#ifndef __MINGW32__
+    if ((data = (uint8_t *)mmap(NULL, c->size, PROT_READ, MAP_PRIVATE, fileno(fp), 0)) != MAP_FAILED) {
+        c->data = data;
+        c->mapped = TRUE;
+        return TRUE;
+    }
+#endif
+
+    if (!(data = (uint8_t *)malloc(c->size)))
+        return FALSE;
+    if (fseek(fp, 0, SEEK_SET) != 0 || fread(data, 1, c->size, fp) != c->size) {
+        free(data);
+        return FALSE;
+    }
+    c->data = data;
+    return TRUE;
+}
+
+/* InElfFile - check that a range of bytes is in the file */
+static int InElfFile(ElfContext *c, uint32_t offset, uint32_t size)
+{
+    return offset <= c->size && size <= c->size - offset;
+}
+
+/* TableInElfFile - check that a table of entries of at least minEntrySize bytes is in the file */
+static int TableInElfFile(ElfContext *c, uint32_t offset, int count, int entrySize, int minEntrySize)
+{
+    if (count == 0)
+        return TRUE;
+    return entrySize >= minEntrySize && InElfFile(c, offset, (uint32_t)(count - 1) * entrySize + minEntrySize);
+}
+
+/* ElfString - get a pointer to a string in a string table or NULL if it runs off the end */
+static const char *ElfString(ElfContext *c, uint32_t tableOff, uint32_t tableSize, uint32_t offset)
+{
+    const char *str;
+    if (offset >= tableSize)
+        return NULL;
+    str = (const char *)&c->data[tableOff + offset];
+    return memchr(str, '\0', tableSize - offset) ? str : NULL;
+}
+
+/* HashElfName - FNV-1a hash of a section or symbol name */
+static uint32_t HashElfName(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    while (*name)
+        hash = (hash ^ (uint8_t)*name++) * 16777619u;
+    return hash;
+}
+
+/* HashTableMask - get the mask for an open addressed table with room for count names */
+static uint32_t HashTableMask(uint32_t count)
+{
+    uint32_t size = 16;
+    while (size < count * 2)
+        size <<= 1;
+    return size - 1;
+}
+
+/*
+   BuildElfIndexes - build the section name and symbol name hash tables
+
+   Both tables use linear probing and are filled in table order so a lookup finds the first
+   section or symbol with a name just like a scan of the table would.
+*/
+static int BuildElfIndexes(ElfContext *c)
+{
+    ElfSectionHdr section;
+    ElfSymbol symbol;
+    const char *name;
+    uint32_t slot, i;
+
+    /* hash the section names */
+    c->sectionHashMask = HashTableMask(c->hdr.shnum);
+    if (!(c->sectionHash = (uint16_t *)calloc(c->sectionHashMask + 1, sizeof(uint16_t))))
+        return FALSE;
+    for (i = 0; i < c->hdr.shnum; ++i) {
+        LoadSectionTableEntry(c, i, &section);
+        if (!(name = ElfString(c, c->stringOff, c->stringSize, section.name)))
+            continue;
+        for (slot = HashElfName(name) & c->sectionHashMask; c->sectionHash[slot]; slot = (slot + 1) & c->sectionHashMask)
+            ;
+        c->sectionHash[slot] = i + 1;
+    }
+
+    /* find the symbol table and its string table */
+    if (FindSectionTableEntry(c, ".symtab", &section) && InElfFile(c, section.offset, section.size)) {
+        c->symbolOff = section.offset;
+        c->symbolCnt = section.size / sizeof(ElfSymbol);
+        if (FindSectionTableEntry(c, ".strtab", &section) && InElfFile(c, section.offset, section.size)) {
+            c->symbolStringOff = section.offset;
+            c->symbolStringSize = section.size;
+        }
+        else {
+            c->symbolOff = 0;
+            c->symbolCnt = 0;
+        }
+    }
+
+    /* hash the symbol names skipping the null symbol at index 0 */
+    if (c->symbolCnt > 1) {
+        c->symbolHashMask = HashTableMask(c->symbolCnt);
+        if (!(c->symbolHash = (uint32_t *)calloc(c->symbolHashMask + 1, sizeof(uint32_t))))
+            return FALSE;
+        for (i = 1; i < c->symbolCnt; ++i) {
+            memcpy(&symbol, &c->data[c->symbolOff + i * sizeof(ElfSymbol)], sizeof(ElfSymbol));
+            if (!symbol.name || !(name = ElfString(c, c->symbolStringOff, c->symbolStringSize, symbol.name)))
+                continue;
+            for (slot = HashElfName(name) & c->symbolHashMask; c->symbolHash[slot]; slot = (slot + 1) & c->symbolHashMask)
+                ;
+            c->symbolHash[slot] = i;
+        }
+    }
+
+    return TRUE;
+}
+
+/* BuildElfAddressIndex - sort the defined code and data symbols by value */
+static int BuildElfAddressIndex(ElfContext *c)
+{
+    ElfSymbol symbol;
+    uint32_t i;
+
+    if (c->addressIndex)
+        return TRUE;
+    if (!(c->addressIndex = (ElfAddressEntry *)malloc((c->symbolCnt + 1) * sizeof(ElfAddressEntry))))
+        return FALSE;
+    c->addressCnt = 0;
+    for (i = 1; i < c->symbolCnt; ++i) {
+        memcpy(&symbol, &c->data[c->symbolOff + i * sizeof(ElfSymbol)], sizeof(ElfSymbol));
+        if (symbol.name && symbol.shndx != 0
+        &&  INFO_TYPE(symbol.info) != STT_SECTION && INFO_TYPE(symbol.info) != STT_FILE) {
+            c->addressIndex[c->addressCnt].value = symbol.value;
+            c->addressIndex[c->addressCnt].index = i;
+            ++c->addressCnt;
+        }
+    }
+    qsort(c->addressIndex, c->addressCnt, sizeof(ElfAddressEntry), CompareElfAddressEntries);
+    return TRUE;
+}
+
+static int CompareElfAddressEntries(const void *p1, const void *p2)
+{
+    const ElfAddressEntry *e1 = (const ElfAddressEntry *)p1;
+    const ElfAddressEntry *e2 = (const ElfAddressEntry *)p2;
+    if (e1->value != e2->value)
+        return e1->value < e2->value ? -1 : 1;
+    return e1->index < e2->index ? -1 : e1->index > e2->index;
+}
+
+int GetProgramSize(ElfContext *c, uint32_t *pStart, uint32_t *pSize, uint32_t *pCogImagesSize)
+{
+    ElfProgramHdr program;
+    uint32_t start = 0xffffffff;
+    uint32_t end = 0;
+    uint32_t cogImagesStart = 0xffffffff;
+    uint32_t cogImagesEnd = 0;
+    int cogImagesFound = FALSE;
+    int i;
+    for (i = 0; i < c->hdr.phnum; ++i) {
+        if (!LoadProgramTableEntry(c, i, &program)) {
+            message("Can't read ELF program header %d", i);
+            return FALSE;
+        }
+        if (program.paddr < COG_DRIVER_IMAGE_BASE) {
+            if (program.paddr < start)
+                start = program.paddr;
+            if (program.paddr + program.filesz > end)
+                end = program.paddr + program.filesz;
+        }
+        else {
+            if (program.paddr < cogImagesStart)
+                cogImagesStart = program.paddr;
+            if (program.paddr + program.filesz > cogImagesEnd)
+                cogImagesEnd = program.paddr + program.filesz;
+            cogImagesFound = TRUE;
+        }
+    }
+    *pStart = start;
+    *pSize = end - start;
+    *pCogImagesSize = cogImagesFound ? cogImagesEnd - cogImagesStart : 0;
+    return TRUE;
+}
+
+int FindProgramSegment(ElfContext *c, const char *name, ElfProgramHdr *program)
+{
+    ElfSectionHdr section;
+    if (!FindSectionTableEntry(c, name, &section))
+        return -1;
+    return FindProgramTableEntry(c, &section, program);
+}
+
+/* GetProgramSegmentData - get a pointer to the data for a program segment in the mapped file */
+const uint8_t *GetProgramSegmentData(ElfContext *c, ElfProgramHdr *program)
+{
+    if (!InElfFile(c, program->offset, program->filesz))
+        return NULL;
+    return &c->data[program->offset];
+}
+
+uint8_t *LoadProgramSegment(ElfContext *c, ElfProgramHdr *program)
+{
+    const uint8_t *data;
+    uint8_t *buf;
+    if (!(data = GetProgramSegmentData(c, program)))
+        return NULL;
+    if (!(buf = (uint8_t *)malloc(program->filesz)))
+        return NULL;
+    memcpy(buf, data, program->filesz);
+    return buf;
+}
+
+int FindSectionTableEntry(ElfContext *c, const char *name, ElfSectionHdr *section)
+{
+    uint32_t slot;
+    for (slot = HashElfName(name) & c->sectionHashMask; c->sectionHash[slot]; slot = (slot + 1) & c->sectionHashMask) {
+        const char *thisName;
+        LoadSectionTableEntry(c, c->sectionHash[slot] - 1, section);
+        if ((thisName = ElfString(c, c->stringOff, c->stringSize, section->name)) != NULL
+        &&  strcmp(name, thisName) == 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+int LoadSectionTableEntry(ElfContext *c, int i, ElfSectionHdr *section)
+{
+    if (i < 0 || i >= c->hdr.shnum)
+        return FALSE;
+    memcpy(section, &c->data[c->hdr.shoff + i * c->hdr.shentsize], sizeof(ElfSectionHdr));
+    return TRUE;
+}
+
+static int FindProgramTableEntry(ElfContext *c, ElfSectionHdr *section, ElfProgramHdr *program)
+{
+    int i;
+    for (i = 0; i < c->hdr.phnum; ++i) {
+        if (!LoadProgramTableEntry(c, i, program)) {
+            message("Can't read ELF program header %d", i);
+            return -1;
+        }
+        if (SectionInProgramSegment(section, program))
+            return i;
+    }
+    return -1;
+}
+
+int LoadProgramTableEntry(ElfContext *c, int i, ElfProgramHdr *program)
+{
+    if (i < 0 || i >= c->hdr.phnum)
+        return FALSE;
+    memcpy(program, &c->data[c->hdr.phoff + i * c->hdr.phentsize], sizeof(ElfProgramHdr));
+    return TRUE;
+}
+
+int FindElfSymbol(ElfContext *c, const char *name, ElfSymbol *symbol)
+{
+    uint32_t slot;
+    if (!c->symbolHash)
+        return FALSE;
+    for (slot = HashElfName(name) & c->symbolHashMask; c->symbolHash[slot]; slot = (slot + 1) & c->symbolHashMask) {
+        const char *thisName;
+        memcpy(symbol, &c->data[c->symbolOff + c->symbolHash[slot] * sizeof(ElfSymbol)], sizeof(ElfSymbol));
+        if ((thisName = ElfString(c, c->symbolStringOff, c->symbolStringSize, symbol->name)) != NULL
+        &&  strcmp(name, thisName) == 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/*
+   FindElfSymbolByAddress - find the symbol an address belongs to
+
+   This is the symbol with the highest value at or below the address, preferring a global symbol
+   when several have the same value. An address past the end of a symbol with a size doesn't match.
+*/
+int FindElfSymbolByAddress(ElfContext *c, uint32_t addr, char *name, ElfSymbol *symbol)
+{
+    uint32_t lo = 0, hi, mid, value, best;
+
+    if (c->symbolCnt == 0 || !BuildElfAddressIndex(c))
+        return FALSE;
+
+    /* find the first entry with a value above the address */
+    hi = c->addressCnt;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (c->addressIndex[mid].value <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return FALSE;
+
+    /* look back over the symbols with the same value for a global one */
+    value = c->addressIndex[lo - 1].value;
+    best = lo - 1;
+    for (mid = lo; mid > 0 && c->addressIndex[mid - 1].value == value; --mid) {
+        LoadElfSymbol(c, c->addressIndex[mid - 1].index, name, symbol);
+        if (INFO_BIND(symbol->info) == STB_GLOBAL) {
+            best = mid - 1;
+            break;
+        }
+    }
+
+    LoadElfSymbol(c, c->addressIndex[best].index, name, symbol);
+    return symbol->size == 0 || addr - symbol->value < symbol->size;
+}
+
+int LoadElfSymbol(ElfContext *c, int i, char *name, ElfSymbol *symbol)
+{
+    const char *thisName;
+    if (i < 0 || i >= c->symbolCnt)
+        return -1;
+    memcpy(symbol, &c->data[c->symbolOff + i * sizeof(ElfSymbol)], sizeof(ElfSymbol));
+    *name = '\0';
+    if (symbol->name && (thisName = ElfString(c, c->symbolStringOff, c->symbolStringSize, symbol->name)) != NULL) {
+        strncpy(name, thisName, ELFNAMEMAX - 1);
+        name[ELFNAMEMAX - 1] = '\0';
+    }
+    return 0;
+}
+
+void ShowElfFile(ElfContext *c)
+{
+    ElfSectionHdr section;
+    ElfProgramHdr program;
+    int i;
+
+    /* show file header */
+    printf("ELF Header:\n");
+    printf("  ident:    ");
+    for (i = 0; i < sizeof(c->hdr.ident); ++i)
+        printf(" %02x", c->hdr.ident[i]);
+    putchar('\n');
+    printf("  type:      %04x\n", c->hdr.type);
+    printf("  machine:   %04x\n", c->hdr.machine);
+    printf("  version:   %08x\n", c->hdr.version);
+    printf("  entry:     %08x\n", c->hdr.entry);
+    printf("  phoff:     %08x\n", c->hdr.phoff);
+    printf("  shoff:     %08x\n", c->hdr.shoff);
+    printf("  flags:     %08x\n", c->hdr.flags);
+    printf("  ehsize:    %d\n", c->hdr.entry);
+    printf("  phentsize: %d\n", c->hdr.phentsize);
+    printf("  phnum:     %d\n", c->hdr.phnum);
+    printf("  shentsize: %d\n", c->hdr.shentsize);
+    printf("  shnum:     %d\n", c->hdr.shnum);
+    printf("  shstrndx:  %d\n", c->hdr.shstrndx);
+    
+    /* show the section table */
+    for (i = 0; i < c->hdr.shnum; ++i) {
+        const char *name;
+        if (!LoadSectionTableEntry(c, i, &section)) {
+            printf("error: can't read section header %d\n", i);
+            return;
+        }
+        if (!(name = ElfString(c, c->stringOff, c->stringSize, section.name)))
+            name = "";
+        printf("SectionHdr %d:\n", i);
+        printf("  name:      %08x %s\n", section.name, name);
+        ShowSectionHdr(&section);
+    }
+        
+    /* show the program table */
+    for (i = 0; i < c->hdr.phnum; ++i) {
+        if (!LoadProgramTableEntry(c, i, &program)) {
+            printf("error: can't read program header %d\n", i);
+            return;
+        }
+        printf("ProgramHdr %d:\n", i);
+        ShowProgramHdr(&program);
+    }
+    
+    /* show the symbol table */
+    for (i = 1; i < c->symbolCnt; ++i) {
+        char name[ELFNAMEMAX];
+        ElfSymbol symbol;
+        if (LoadElfSymbol(c, i, name, &symbol) == 0 && symbol.name && INFO_BIND(symbol.info) == STB_GLOBAL)
+            printf("  %08x %s: %08x\n", symbol.name, name, symbol.value);
+    }
+}
+
+static void ShowSectionHdr(ElfSectionHdr *section)
+{
+    printf("  type:      %08x\n", section->type);
+    printf("  flags:     %08x\n", section->flags);
+    printf("  addr:      %08x\n", section->addr);
+    printf("  offset:    %08x\n", section->offset);
+    printf("  size:      %08x\n", section->size);
+    printf("  link:      %08x\n", section->link);
+    printf("  info:      %08x\n", section->info);
+    printf("  addralign: %08x\n", section->addralign);
+    printf("  entsize:   %08x\n", section->entsize);
+}
+
+static void ShowProgramHdr(ElfProgramHdr *program)
+{
+    printf("  type:      %08x\n", program->type);
+    printf("  offset:    %08x\n", program->offset);
+    printf("  vaddr:     %08x\n", program->vaddr);
+    printf("  paddr:     %08x\n", program->paddr);
+    printf("  filesz:    %08x\n", program->filesz);
+    printf("  memsz:     %08x\n", program->memsz);
+    printf("  flags:     %08x\n", program->flags);
+    printf("  align:     %08x\n", program->align);
+}
+
+#ifdef MAIN
+
+int main(int argc, char *argv[])
+{
+    ElfContext *c;
+    ElfHdr hdr;
+    FILE *fp;
+
+    /* check the arguments */
+    if (argc != 2) {
+        printf("usage: loadelf <file>\n");
+        return 1;
+    }
+    
+    /* open the image file */
+    if (!(fp = fopen(argv[1], "rb"))) {
+        printf("error: opening '%s'\n", argv[1]);
+        return 1;
+    }
+    
+    /* make sure it's an elf file */
+    if (!ReadAndCheckElfHdr(fp, &hdr)) {
+        printf("error: not an elf file");
+        return 1;
+    }
+    
+    /* open the elf file */
+    if (!(c = OpenElfFile(fp, &hdr))) {
+        printf("error: opening elf file\n");
+        return 1;
+    }
+    
+    /* show the contents of the elf file */
+    ShowElfFile(c);
+    
+    /* close the elf file */
+    FreeElfContext(c);
+    fclose(fp);
+    
+    return 0;
+}
+
+#endif
+
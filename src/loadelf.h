@@ -26,6 +26,7 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SO
 extern "C" {
 #endif
 
+#include <stdio.h>
 #include <stdint.h>
 
 /* base address of cog driver overlays to be loaded into eeprom */
@@ -107,13 +108,35 @@ typedef struct {
 #define STB_GLOBAL  1
 #define STB_WEAK    2
 
+#define STT_NOTYPE  0
+#define STT_OBJECT  1
+#define STT_FUNC    2
+#define STT_SECTION 3
+#define STT_FILE    4
+
+/* a symbol in the address index */
+typedef struct {
+    uint32_t    value;
+    uint32_t    index;
+} ElfAddressEntry;
+
 typedef struct {
     ElfHdr hdr;
+    const uint8_t *data;        /* the whole file, mapped or read into memory */
+    size_t size;
+    int mapped;
     uint32_t stringOff;
+    uint32_t stringSize;
     uint32_t symbolOff;
     uint32_t symbolStringOff;
+    uint32_t symbolStringSize;
     uint32_t symbolCnt;
-    FILE *fp;
+    uint16_t *sectionHash;      /* section index + 1 by name hash, 0 for an empty slot */
+    uint32_t sectionHashMask;
+    uint32_t *symbolHash;       /* symbol index by name hash, 0 for an empty slot */
+    uint32_t symbolHashMask;
+    ElfAddressEntry *addressIndex; /* named symbols sorted by value, built on first use */
+    uint32_t addressCnt;
 } ElfContext;
 
 #define SectionInProgramSegment(s, p) \
@@ -129,11 +152,13 @@ void FreeElfContext(ElfContext *c);
 int GetProgramSize(ElfContext *c, uint32_t *pStart, uint32_t *pSize, uint32_t *pCogImagesSize);
 int FindSectionTableEntry(ElfContext *c, const char *name, ElfSectionHdr *section);
 int FindProgramSegment(ElfContext *c, const char *name, ElfProgramHdr *program);
+const uint8_t *GetProgramSegmentData(ElfContext *c, ElfProgramHdr *program);
 uint8_t *LoadProgramSegment(ElfContext *c, ElfProgramHdr *program);
 int LoadSectionTableEntry(ElfContext *c, int i, ElfSectionHdr *section);
 int LoadProgramTableEntry(ElfContext *c, int i, ElfProgramHdr *program);
 int FindElfSymbol(ElfContext *c, const char *name, ElfSymbol *symbol);
 int LoadElfSymbol(ElfContext *c, int i, char *name, ElfSymbol *symbol);
+int FindElfSymbolByAddress(ElfContext *c, uint32_t addr, char *name, ElfSymbol *symbol);
 void ShowElfFile(ElfContext *c);
 
 #ifdef __cplusplus
@@ -28,27 +28,45 @@ int Loader::loadFile(const char *file, LoadType loadType)
 
 int Loader::loadImage(const uint8_t *image, int imageSize, LoadType loadType)
 {
-    // get the binary clock settings
-    PropImage img((uint8_t *)image, imageSize); // shouldn't really modify image!
-    
-    // get the fast loader and program clock speeds
-    int clockSpeed;
-    int gotClockSpeed = GetNumericConfigField(m_connection->config(), "clkfreq", &clockSpeed);
-    if (gotClockSpeed) {
-        img.setClkFreq(clockSpeed);
-        img.updateChecksum();
-    }
+    int sts;
 
-    // get the fast loader and program clock modes
-    int clockMode;
-    int gotClockMode = GetNumericConfigField(m_connection->config(), "clkmode", &clockMode);
-    if (gotClockMode) {
-        img.setClkMode(clockMode);
-        img.updateChecksum();
+    /* the rom loader only programs the first 32KB of eeprom */
+    if (m_eepromRegions && (loadType & ltDownloadAndProgram)) {
+        message("Can't program EEPROM regions with the ROM loader");
+        return -1;
     }
+
+    m_connection->stats().begin();
+
+    // apply the program clock settings
+    PropImage img((uint8_t *)image, imageSize); // shouldn't really modify image!
+    img.prepare(m_connection->config());
         
     nmessage(INFO_DOWNLOADING, m_connection->portName());
-    return m_connection->loadImage(image, imageSize, loadType);
+    if ((sts = m_connection->loadImage(image, imageSize, loadType)) == 0)
+        m_connection->stats().addPayloadBytes(imageSize);
+
+    /* record the outcome for the load statistics */
+    m_connection->stats().end(sts == 0, m_connection->baudRate());
+
+    return sts;
+}
+
+/* NewEepromRegion - add a region to the list of eeprom regions to program */
+EepromRegion *NewEepromRegion(EepromRegion ***pNext, uint32_t address, const uint8_t *data, int size)
+{
+    EepromRegion *region;
+
+    if (!(region = (EepromRegion *)malloc(sizeof(EepromRegion) + size)))
+        return NULL;
+    region->next = NULL;
+    region->address = address;
+    region->size = size;
+    memcpy(region->data, data, size);
+
+    **pNext = region;
+    *pNext = &region->next;
+    return region;
 }
 
 uint8_t *Loader::readFile(const char *file, int *pImageSize)
@@ -107,7 +125,8 @@ uint8_t *Loader::readElfFile(FILE *fp, ElfHdr *hdr, int *pImageSize)
 {
     uint32_t start, imageSize, cogImagesSize;
     ElfProgramHdr program;
-    uint8_t *image = NULL, *buf;
+    uint8_t *image = NULL;
+    const uint8_t *data;
     SpinHdr *spinHdr;
     ElfContext *c;
     int i;
@@ -132,12 +151,10 @@ uint8_t *Loader::readElfFile(FILE *fp, ElfHdr *hdr, int *pImageSize)
     /* load each program section */
     for (i = 0; i < c->hdr.phnum; ++i) {
         if (!LoadProgramTableEntry(c, i, &program)
-        ||  !(buf = LoadProgramSegment(c, &program))) {
-            free(image);
+        ||  !(data = GetProgramSegmentData(c, &program)))
             goto fail;
-        }
         if (program.paddr < COG_DRIVER_IMAGE_BASE)
-            memcpy(&image[program.paddr - start], buf, program.filesz);
+            memcpy(&image[program.paddr - start], data, program.filesz);
     }
     
     /* free the elf file context */
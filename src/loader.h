@@ -6,25 +6,60 @@
 #include "propconnection.h"
 #include "loadelf.h"
 
+#define EEPROM_PAGE_SIZE        64          /* eeprom regions start on a page boundary */
+#define MAX_EEPROM_SIZE         0x10000     /* the loader addresses eeproms of up to 64KB */
+
+/* data to program into a large eeprom above the 32KB used by the application image */
+typedef struct EepromRegion {
+    struct EepromRegion *next;
+    uint32_t address;           /* eeprom address of the first byte */
+    int size;
+    uint8_t data[1];
+} EepromRegion;
+
+/* the memory to read back (the values select it in the loader's programVerifyEEPROM packet) */
+typedef enum {
+    mtHubRAM = 1,
+    mtEEPROM = 2
+} MemoryType;
+
+EepromRegion *NewEepromRegion(EepromRegion ***pNext, uint32_t address, const uint8_t *data, int size);
+
 class Loader {
 public:
-    Loader() : m_connection(0) {}
-    Loader(PropConnection *connection) : m_connection(connection) {}
+    Loader() : m_connection(0), m_eepromRegions(0), m_keepLoader(false), m_loaderResident(false), m_residentPacketID(0) {}
+    Loader(PropConnection *connection) : m_connection(connection), m_eepromRegions(0), m_keepLoader(false), m_loaderResident(false), m_residentPacketID(0) {}
     ~Loader() {}
     void setConnection(PropConnection *connection) { m_connection = connection; }
+    void setEepromRegions(EepromRegion *regions) { m_eepromRegions = regions; }
+    void setKeepLoader(bool keep) { m_keepLoader = keep; }
     int identify(int *pVersion);
     int loadFile(const char *file, LoadType loadType = ltDownloadAndRun);
     int fastLoadFile(const char *file, LoadType loadType = ltDownloadAndRun);
     int loadImage(const uint8_t *image, int imageSize, LoadType loadType = ltDownloadAndRun);
     int fastLoadImage(const uint8_t *image, int imageSize, LoadType loadType = ltDownloadAndRun);
+    int fastReadMemory(MemoryType type, uint32_t address, uint8_t *buf, int size);
+    int fastVerifyEeprom(const uint8_t *image, int imageSize, int *pMismatch);
+    int fastLaunch();
     static uint8_t *readFile(const char *file, int *pImageSize);
+    static uint8_t *generateInitialLoaderImage(int clockSpeed, int clockMode, int packetID, int loaderBaudRate, int fastLoaderBaudRate, int *pLength);
 private:
-    int fastLoadImageHelper(const uint8_t *image, int imageSize, LoadType loadType, int clockSpeed, int clockMode, int loaderBaudRate, int fastLoaderBaudRate);
-    uint8_t *generateInitialLoaderImage(int clockSpeed, int clockMode, int packetID, int loaderBaudRate, int fastLoaderBaudRate, int *pLength);
-    int transmitPacket(int id, const uint8_t *payload, int payloadSize, int *pResult, int timeout = 2000);
+    int fastLoadImageHelper(const uint8_t *image, int imageSize, int32_t checksum, LoadType loadType, int clockSpeed, int clockMode, int loaderBaudRate, int fastLoaderBaudRate);
+    int fastReadMemoryHelper(MemoryType type, uint32_t address, uint8_t *buf, int size, int clockSpeed, int clockMode, int loaderBaudRate, int fastLoaderBaudRate);
+    int startLoader(int clockSpeed, int clockMode, int32_t packetID, int loaderBaudRate, int fastLoaderBaudRate);
+    int reloadLoader(int32_t packetID);
+    int launchImage(int32_t packetID);
+    int readWindow(int32_t *pPacketID, MemoryType type, uint32_t address, uint8_t *buf, int size);
+    int transmitData(const uint8_t *data, int size, int32_t *pPacketID);
+    int programEepromRegion(EepromRegion *region, int32_t *pPacketID, int32_t nextPacketID);
+    int transmitPacket(int id, const uint8_t *payload, int payloadSize, int *pResult, int timeout = 0);
     static uint8_t *readSpinBinaryFile(FILE *fp, int *pImageSize);
     static uint8_t *readElfFile(FILE *fp, ElfHdr *hdr, int *pImageSize);
     PropConnection *m_connection;
+    EepromRegion *m_eepromRegions;
+    bool m_keepLoader;              /* leave the second-stage loader running instead of launching the image */
+    bool m_loaderResident;          /* a second-stage loader is waiting for m_residentPacketID */
+    int32_t m_residentPacketID;
 };
 
 inline void msleep(int ms)
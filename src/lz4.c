@@ -0,0 +1,167 @@
+/* lz4.c - LZ4 block compression for SD card file transfers
+
+  Blocks use the standard LZ4 block format: a sequence of a token byte with the literal length
+  in the high nibble and the match length minus 4 in the low nibble (15 meaning more length
+  bytes follow), the literals, and a 16 bit little endian match offset. The last sequence has
+  only literals. The SD helper decompresses them with a PASM loop so the compressor favors a
+  simple greedy match search over compression ratio.
+*/
+
+#include <string.h>
+#include "lz4.h"
+
+#define MIN_MATCH       4
+#define LAST_LITERALS   5       /* the last five bytes are always literals */
+#define MF_LIMIT        12      /* the last match must start at least 12 bytes before the end */
+#define HASH_BITS       12
+#define MAX_OFFSET      65535
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static int hash32(uint32_t value)
+{
+    return (value * 2654435761U) >> (32 - HASH_BITS);
+}
+
+/* writeLength - write the extra bytes of a length that didn't fit in the token */
+static int writeLength(uint8_t *out, int op, int outMax, int len)
+{
+    for (len -= 15; len >= 255; len -= 255) {
+        if (op >= outMax)
+            return -1;
+        out[op++] = 255;
+    }
+    if (op >= outMax)
+        return -1;
+    out[op++] = len;
+    return op;
+}
+
+/* writeSequence - write literals followed by a match (or just literals if matchLen is zero) */
+static int writeSequence(uint8_t *out, int op, int outMax, const uint8_t *literals, int litLen, int offset, int matchLen)
+{
+    int token;
+
+    if (op >= outMax)
+        return -1;
+    token = (litLen >= 15 ? 15 : litLen) << 4;
+    if (matchLen > 0)
+        token |= matchLen - MIN_MATCH >= 15 ? 15 : matchLen - MIN_MATCH;
+    out[op++] = token;
+
+    if (litLen >= 15 && (op = writeLength(out, op, outMax, litLen)) < 0)
+        return -1;
+    if (op + litLen > outMax)
+        return -1;
+    memcpy(&out[op], literals, litLen);
+    op += litLen;
+
+    if (matchLen > 0) {
+        if (op + 2 > outMax)
+            return -1;
+        out[op++] = (uint8_t)offset;
+        out[op++] = (uint8_t)(offset >> 8);
+        if (matchLen - MIN_MATCH >= 15 && (op = writeLength(out, op, outMax, matchLen - MIN_MATCH)) < 0)
+            return -1;
+    }
+
+    return op;
+}
+
+/* CompressLZ4 - compress a block and return its length or -1 if it doesn't fit in outMax bytes */
+int CompressLZ4(const uint8_t *in, int inLen, uint8_t *out, int outMax)
+{
+    int table[1 << HASH_BITS];
+    int matchLimit = inLen - LAST_LITERALS;
+    int mfLimit = inLen - MF_LIMIT;
+    int pos = 0, anchor = 0, op = 0, i;
+
+    if (inLen > LZ4_MAX_INPUT)
+        return -1;
+
+    for (i = 0; i < (1 << HASH_BITS); ++i)
+        table[i] = -1;
+
+    while (pos < mfLimit) {
+        uint32_t sequence = read32(&in[pos]);
+        int h = hash32(sequence);
+        int ref = table[h];
+        int len;
+
+        table[h] = pos;
+        if (ref < 0 || pos - ref > MAX_OFFSET || read32(&in[ref]) != sequence) {
+            ++pos;
+            continue;
+        }
+
+        /* extend the match */
+        for (len = MIN_MATCH; pos + len < matchLimit && in[ref + len] == in[pos + len]; ++len)
+            ;
+
+        if ((op = writeSequence(out, op, outMax, &in[anchor], pos - anchor, pos - ref, len)) < 0)
+            return -1;
+        pos += len;
+        anchor = pos;
+    }
+
+    /* the rest of the input is literals */
+    return writeSequence(out, op, outMax, &in[anchor], inLen - anchor, 0, 0);
+}
+
+/* readLength - add the extra bytes of a length to the length from the token */
+static int readLength(const uint8_t *in, int *pIp, int inLen, int len)
+{
+    int ip = *pIp, byte;
+    if (len == 15) {
+        do {
+            if (ip >= inLen)
+                return -1;
+            len += byte = in[ip++];
+        } while (byte == 255);
+    }
+    *pIp = ip;
+    return len;
+}
+
+/* DecompressLZ4 - decompress a block and return its length or -1 if it's invalid or too long */
+int DecompressLZ4(const uint8_t *in, int inLen, uint8_t *out, int outMax)
+{
+    int ip = 0, op = 0, token, len, offset;
+
+    while (ip < inLen) {
+        token = in[ip++];
+
+        /* copy the literals */
+        if ((len = readLength(in, &ip, inLen, token >> 4)) < 0 || ip + len > inLen || op + len > outMax)
+            return -1;
+        memcpy(&out[op], &in[ip], len);
+        ip += len;
+        op += len;
+
+        /* the last sequence has no match */
+        if (ip >= inLen)
+            break;
+
+        /* copy the match a byte at a time since it may overlap its own output */
+        if (ip + 2 > inLen)
+            return -1;
+        offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        if ((len = readLength(in, &ip, inLen, token & 15)) < 0)
+            return -1;
+        len += MIN_MATCH;
+        if (offset == 0 || offset > op || op + len > outMax)
+            return -1;
+        while (--len >= 0) {
+            out[op] = out[op - offset];
+            ++op;
+        }
+    }
+
+    return op;
+}
@@ -0,0 +1,22 @@
+/* lz4.h - LZ4 block compression for SD card file transfers */
+
+#ifndef __LZ4_H__
+#define __LZ4_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* largest input block (match offsets are 16 bits) */
+#define LZ4_MAX_INPUT   65535
+
+int CompressLZ4(const uint8_t *in, int inLen, uint8_t *out, int outMax);
+int DecompressLZ4(const uint8_t *in, int inLen, uint8_t *out, int outMax);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -4,17 +4,26 @@
 #include <string.h>
 #include <limits.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 #include <iostream>
+#include <thread>
 
 #include "proploader.h"
 #include "loadelf.h"
 #include "propimage.h"
 #include "packet.h"
+#include "crc32.h"
+#include "lz4.h"
+#include "prefetch.h"
+#include "imagepatch.h"
+#include "inspect.h"
 #include "loader.h"
 #include "serialpropconnection.h"
 #include "wifipropconnection.h"
 #include "config.h"
+#include "trace.h"
 
 /* default port name prefix if only a partial name is specified */
 #if defined(CYGWIN) || defined(WIN32) || defined(MINGW)
@@ -41,25 +50,65 @@ usage: %s [options] [<file>]\n\
 options:\n\
     -b <type>       select target board and subtype (default is 'default:default')\n\
     -c              display numeric message codes\n\
+    -d <mem>=<path> read ram or eeprom into a file (use eeprom:<start>-<end> to pick a range)\n\
     -D var=value    define a board configuration variable\n\
     -e              program eeprom (and halt, unless combined with -r)\n\
-    -f <file>       write a file to the SD card\n\
+    -E <file>       program a file into eeprom above the image (use <file>@<addr> to pick the address)\n\
+    -f <path>       write a file, a directory or the files listed in @<list> to the SD card\n\
+    -g <name>       read a file from the SD card (use <name>=<path> to pick the local file)\n\
     -i <ip-addr>    IP address of the Parallax Wi-Fi module\n\
     -I <path>       add a directory to the include path\n\
+    -j <file>       write a timing trace of the load as JSON lines\n\
+    -J <file>       write a timing trace of the load in Chrome trace-event format\n\
+    -k              compare the eeprom with <file> (and any -E files) without programming it\n\
+    -l              list the files on the SD card\n\
+    -m              display throughput and latency statistics for the load\n\
+    -M <file>       add load statistics to a Prometheus textfile collector file\n\
     -n <name>       set the name of a Parallax Wi-Fi module\n\
     -p <port>       serial port\n\
     -P              show all serial ports\n\
     -r              run program after downloading (useful with -e)\n\
     -R              reset the Propeller\n\
     -s              do a serial download\n\
+    -S <sym>=<val>  set a symbol in the image before loading it (or use @<manifest>)\n\
     -t              enter terminal mode after the load is complete\n\
     -T              enter pst-compatible terminal mode after the load is complete\n\
+    -u              only write files that are missing or different on the SD card (with -f)\n\
     -v              enable verbose debugging output\n\
+    -V              validate and describe each <file> as a line of JSON without loading\n\
     -W              show all discovered wifi modules\n\
     -?              display a usage message and exit\n\
 \n\
 file:               binary file to load (.elf or .binary)\n\
 \n\
+The -f and -g options can be repeated and all of the files are written and read in order with\n\
+a single load of the SD helper. A directory writes every file in it. A list file has a path on\n\
+each line optionally followed by the name to use on the SD card. Relative paths are relative to\n\
+the list file. With -f the -p and -i options can also be repeated to write the same files to the\n\
+SD cards of several boards at once.\n\
+\n\
+With -V any number of files can be given and they are checked in parallel. The exit status is\n\
+zero only if every file is a valid image.\n\
+\n\
+When loading, several files can also be given. They are loaded in order by the same second-stage\n\
+loader without resetting the Propeller in between. Only the last one is started or programmed\n\
+into eeprom. The others are loaded into ram and checked but not started.\n\
+\n\
+The -S option can be repeated. The symbols of an elf file are used directly. A Spin binary needs\n\
+a map file next to it with a .map extension and a name, an image offset and an optional size in\n\
+bytes on each line. A manifest has a <sym>=<val> on each line. Values are expressions like the\n\
+ones used with -D and can refer to the board configuration variables.\n\
+\n\
+With -e a .eeprom image larger than 32KB and any -E files are written to the upper half of a\n\
+64KB eeprom by the fast loader. The -E option can be repeated. Without an address a file follows\n\
+the previous one starting at 0x8000. Addresses must be multiples of 64.\n\
+\n\
+The -d option reads memory back through the fast loader. <mem> is ram or eeprom optionally\n\
+followed by :<start>-<end>. By default all 32KB of ram or the lower 32KB of eeprom are read. Ram\n\
+needs a file: it is loaded, ram is read back while the loader is still running and then the\n\
+program is started. With -k the eeprom is read back and compared with what -e would program and\n\
+the exit status is zero only if they match.\n\
+\n\
 Target board type can be either a single identifier like 'propboe' in which case the subtype\n\
 defaults to 'default' or it can be of the form <type>:<subtype> like 'c3:ram'.\n\
 \n\
@@ -89,8 +138,53 @@ Examples:\n\
 
 static void ShowPorts(bool check);
 static void ShowWiFiModules(bool check);
-static int WriteFileToSDCard(BoardConfig *config, PropConnection *connection, const char *path, const char *target);
-static int LoadSDHelper(BoardConfig *config, PropConnection *connection);
+static PropConnection *OpenConnection(BoardConfig *config, bool useSerial, const char *address);
+/* files to write to or read from the SD card */
+typedef enum {
+    SD_WRITE,
+    SD_READ,
+    SD_LIST
+} SDOp;
+
+typedef struct SDFile SDFile;
+struct SDFile {
+    SDFile *next;
+    SDOp op;
+    const char *target;     /* name on the SD card */
+    uint8_t *data;          /* contents and crc when shared by several targets */
+    size_t size;
+    uint32_t crc;
+    char path[1];           /* local path */
+};
+
+/* SD helper image patched for the board configuration */
+typedef struct {
+    uint8_t *image;
+    int imageSize;
+    int baudRate;
+} SDHelperImage;
+
+/* a serial port or wifi module given on the command line */
+typedef struct {
+    bool serial;
+    const char *address;
+} TargetAddress;
+
+#define MAX_TARGETS 64
+
+static int AddSDFiles(SDFile ***pNext, const char *path);
+static int AddSDRead(SDFile ***pNext, const char *arg);
+static int NewSDFile(SDFile ***pNext, SDOp op, const char *dir, const char *name, const char *target);
+static int AccessSDCard(SDHelperImage *helper, PropConnection *connection, SDFile *files, bool update);
+static int PrepareSDHelper(BoardConfig *config, SDHelperImage *helper);
+static int LoadSDHelper(PropConnection *connection, SDHelperImage *helper);
+static int AddTarget(TargetAddress *targets, int *pCount, bool serial, const char *address);
+static int AddEepromFile(EepromRegion ***pNext, const char *arg, uint32_t *pAddress);
+static int CheckEepromRegions(EepromRegion *regions);
+static int ParseMemoryRange(const char *arg, MemoryType *pType, uint32_t *pAddress, int *pSize, const char **pPath);
+static int DumpMemory(Loader &loader, MemoryType type, uint32_t address, int size, const char *path);
+static int PreloadImages(Loader &loader, BoardConfig *config, const char **files, int count, ImagePatch *patches);
+static int ProvisionSDCards(BoardConfig *config, TargetAddress *targets, int targetCount, SDFile *files, bool update);
 
 int main(int argc, char *argv[])
 {
@@ -108,18 +202,40 @@ int main(int argc, char *argv[])
     const char *port = NULL;
     const char *name = NULL;
     const char *file = NULL;
+    const char **files;
+    int fileCount = 0;
+    bool inspectFiles = false;
     uint8_t *image = NULL;
     int imageSize;
     int loadType = ltShutdown;
     bool useSerial = false;
-    bool writeFile = false;
-    SerialPropConnection *serialConnection = NULL;
+    bool useSDCard = false;
+    bool updateFiles = false;
+    SDFile *sdFiles = NULL, **pNextSDFile = &sdFiles;
+    ImagePatch *patches = NULL, **pNextPatch = &patches;
+    EepromRegion *eepromRegions = NULL, **pNextEepromRegion = &eepromRegions;
+    uint32_t eepromAddress = MAX_IMAGE_SIZE;
+    bool verifyEeprom = false;
+    const char *dumpPath = NULL;
+    MemoryType dumpType = mtEEPROM;
+    uint32_t dumpAddress = 0;
+    int dumpSize = 0;
+    TargetAddress targets[MAX_TARGETS];
+    int targetCount = 0;
+    bool showStats = false;
+    const char *statsFile = NULL;
     WiFiPropConnection *wifiConnection = NULL;
     PropConnection *connection;
     Loader loader;
     const char *p;
     int sts, i;
     
+    /* make room for the file arguments */
+    if (!(files = (const char **)malloc(argc * sizeof(const char *)))) {
+        nmessage(ERROR_INSUFFICIENT_MEMORY);
+        return 1;
+    }
+
     /* setup a configuration to collect command line -D settings */
     configSettings = NewBoardConfig(NULL, "");
 
@@ -140,6 +256,16 @@ int main(int argc, char *argv[])
             case 'c':   // display numeric message codes
                 showMessageCodes = true;
                 break;
+            case 'd':   // read memory into a file
+                if (argv[i][2])
+                    p = &argv[i][2];
+                else if (++i < argc)
+                    p = argv[i];
+                else
+                    usage(argv[0]);
+                if (ParseMemoryRange(p, &dumpType, &dumpAddress, &dumpSize, &dumpPath) != 0)
+                    return 1;
+                break;
             case 'D':
                 if (argv[i][2])
                     p = &argv[i][2];
@@ -164,14 +290,37 @@ int main(int argc, char *argv[])
             case 'e':   // program eeprom
                 loadType |= ltDownloadAndProgram;
                 break;
+            case 'E':   // program a file into eeprom above the image
+                if (argv[i][2])
+                    p = &argv[i][2];
+                else if (++i < argc)
+                    p = argv[i];
+                else
+                    usage(argv[0]);
+                if (AddEepromFile(&pNextEepromRegion, p, &eepromAddress) != 0)
+                    return 1;
+                break;
             case 'f':   // write a file to the SD card
                 if (argv[i][2])
-                    file = &argv[i][2];
+                    p = &argv[i][2];
+                else if (++i < argc)
+                    p = argv[i];
+                else
+                    usage(argv[0]);
+                if (AddSDFiles(&pNextSDFile, p) != 0)
+                    return 1;
+                useSDCard = true;
+                break;
+            case 'g':   // read a file from the SD card
+                if (argv[i][2])
+                    p = &argv[i][2];
                 else if (++i < argc)
-                    file = argv[i];
+                    p = argv[i];
                 else
                     usage(argv[0]);
-                writeFile = true;
+                if (AddSDRead(&pNextSDFile, p) != 0)
+                    return 1;
+                useSDCard = true;
                 break;
             case 'i':   // set the ip address
                 if (argv[i][2])
@@ -180,6 +329,8 @@ int main(int argc, char *argv[])
                     ipaddr = argv[i];
                 else
                     usage(argv[0]);
+                if (AddTarget(targets, &targetCount, false, ipaddr) != 0)
+                    return 1;
                 useSerial = false;
                 break;
             case 'I':   // add a directory to the .cfg include path
@@ -191,6 +342,41 @@ int main(int argc, char *argv[])
                     usage(argv[0]);
                 xbAddPath(p);
                 break;
+            case 'j':   // write a timing trace as JSON lines
+            case 'J':   // write a timing trace in Chrome trace-event format
+                {
+                    TraceFormat format = argv[i][1] == 'J' ? TRACE_CHROME : TRACE_JSON_LINES;
+                    if (argv[i][2])
+                        p = &argv[i][2];
+                    else if (++i < argc)
+                        p = argv[i];
+                    else
+                        usage(argv[0]);
+                    if (traceOpen(p, format) != 0) {
+                        nmessage(ERROR_CANT_OPEN_FILE, p);
+                        return 1;
+                    }
+                }
+                break;
+            case 'k':   // compare the eeprom with the file
+                verifyEeprom = true;
+                break;
+            case 'l':   // list the files on the SD card
+                if (NewSDFile(&pNextSDFile, SD_LIST, NULL, "", NULL) != 0)
+                    return 1;
+                useSDCard = true;
+                break;
+            case 'm':   // display load statistics
+                showStats = true;
+                break;
+            case 'M':   // accumulate load statistics in a Prometheus textfile
+                if (argv[i][2])
+                    statsFile = &argv[i][2];
+                else if (++i < argc)
+                    statsFile = argv[i];
+                else
+                    usage(argv[0]);
+                break;
             case 'n':   // name a wifi module
                 if (argv[i][2])
                     name = &argv[i][2];
@@ -229,6 +415,8 @@ int main(int argc, char *argv[])
                     port = buf;
                 }
 #endif
+                if (AddTarget(targets, &targetCount, true, port) != 0)
+                    return 1;
                 useSerial = true;
                 break;
             case 'P':   // show serial ports
@@ -244,6 +432,16 @@ int main(int argc, char *argv[])
             case 's':   // use the serial loader instead of the wifi loader
                 useSerial = true;
                 break;
+            case 'S':   // set a symbol in the image
+                if (argv[i][2])
+                    p = &argv[i][2];
+                else if (++i < argc)
+                    p = argv[i];
+                else
+                    usage(argv[0]);
+                if (AddImagePatches(&pNextPatch, p) != 0)
+                    return 1;
+                break;
             case 't':   // enter terminal emulator mode after loading
                 terminalMode = true;
                 pstTerminalMode = false;
@@ -252,9 +450,15 @@ int main(int argc, char *argv[])
                 terminalMode = true;
                 pstTerminalMode = true;
                 break;
+            case 'u':   // only write files that are different on the SD card
+                updateFiles = true;
+                break;
             case 'v':   // enable verbose debugging output
                 ++verbose;
                 break;
+            case 'V':   // validate and describe image files
+                inspectFiles = true;
+                break;
             case 'W':   // show wifi modules
                 showModules = true;
                 break;
@@ -266,13 +470,23 @@ int main(int argc, char *argv[])
         }
         
         /* remember the file to load */
-        else {
-            if (file)
-                usage(argv[0]);
-            file = argv[i];
-        }
+        else
+            files[fileCount++] = argv[i];
     }
 
+    /* validate and describe image files */
+    if (inspectFiles) {
+        if (fileCount == 0)
+            usage(argv[0]);
+        return InspectImages(files, fileCount) == 0 ? 0 : 1;
+    }
+
+    /* the last file is the one that is started or programmed */
+    if ((fileCount > 0 && useSDCard) || (fileCount > 1 && verifyEeprom))
+        usage(argv[0]);
+    if (fileCount > 0)
+        file = files[fileCount - 1];
+
     /* show ports if requested */
     if (showPorts) {
         ShowPorts(false);
@@ -286,12 +500,29 @@ int main(int argc, char *argv[])
     }
 
     /* before we do anything else, make sure we can read the Propeller image file */
-    if (file && !writeFile) {
+    if (file) {
         nmessage(INFO_OPENING_FILE, file);
         if (!(image = Loader::readFile(file, &imageSize))) {
             nmessage(ERROR_CANT_OPEN_FILE, file);
             return 1;
         }
+        
+        /* the part of a .eeprom image beyond hub memory goes in the upper eeprom */
+        if (imageSize > MAX_IMAGE_SIZE && (p = strrchr(file, '.')) != NULL && strcmp(p, ".eeprom") == 0) {
+            EepromRegion *upper = NULL, **pUpper = &upper;
+            if (imageSize > MAX_EEPROM_SIZE) {
+                printf("error: '%s' is larger than %d bytes\n", file, MAX_EEPROM_SIZE);
+                return 1;
+            }
+            if (!NewEepromRegion(&pUpper, MAX_IMAGE_SIZE, &image[MAX_IMAGE_SIZE], imageSize - MAX_IMAGE_SIZE)) {
+                nmessage(ERROR_INSUFFICIENT_MEMORY);
+                return 1;
+            }
+            upper->next = eepromRegions;
+            eepromRegions = upper;
+            imageSize = MAX_IMAGE_SIZE;
+        }
+        
         switch (PropImage::validate(image, imageSize)) {
         case PropImage::SUCCESS:
             // success
@@ -319,6 +550,8 @@ int main(int argc, char *argv[])
     /* finish the include path */
     if (file)
         xbAddFilePath(file);
+    else if (sdFiles && sdFiles->op == SD_WRITE)
+        xbAddFilePath(sdFiles->path);
     xbAddEnvironmentPath("PROPELLER_LOAD_PATH");
     xbAddProgramPath(argv);
 #if defined(LINUX) || defined(MACOSX) || defined(CYGWIN)
@@ -368,103 +601,78 @@ int main(int argc, char *argv[])
     /* override with any command line settings */
     config = MergeConfigs(config, configSettings);
     
+    /* set symbols in the image */
+    if (patches) {
+        if (!file)
+            usage(argv[0]);
+        if (PatchImageSymbols(config, file, image, imageSize, patches) != 0)
+            return 1;
+    }
+    
     /* decide whether to use the fast or rom loader */
     if ((p = GetConfigField(config, "loader")) != NULL && strcmp(p, "rom") == 0)
         useFastLoader = false;
+    if (fileCount > 1 && !useFastLoader) {
+        printf("error: several files can only be loaded with the fast loader\n");
+        return 1;
+    }
     
    /* make sure a file to load was specified */
-    if (!done && !reset && !file && !terminalMode)
+    if (!done && !reset && !file && !useSDCard && !dumpPath && !terminalMode)
         usage(argv[0]);
         
     /* check to there is anything more to do */
-    if (!reset && !file && !name && !terminalMode)
+    if (!reset && !file && !useSDCard && !dumpPath && !name && !terminalMode)
         goto finish;
 
+    /* write the same files to the SD cards of several targets at once */
+    if (targetCount > 1) {
+        if (file || reset || name || terminalMode || dumpPath || !useSDCard) {
+            printf("error: more than one -p or -i can only be used with -f\n");
+            return 1;
+        }
+        return ProvisionSDCards(config, targets, targetCount, sdFiles, updateFiles) == 0 ? 0 : 1;
+    }
+
     /* default to 'download and run' if neither -e nor -r are specified */
     if (loadType == ltShutdown)
         loadType = ltDownloadAndRun;
         
-    /* do a serial download */
-    if (useSerial) {
-        SerialInfo info; // needs to stay in scope as long as we're using port
-        if (!(serialConnection = new SerialPropConnection)) {
-            nmessage(ERROR_INSUFFICIENT_MEMORY);
-            return 1;
-        }
-        if (!port) {
-            SerialInfoList ports;
-            if (SerialPropConnection::findPorts(true, ports) != 0) {
-                nmessage(ERROR_SERIAL_PORT_DISCOVERY_FAILED);
-                return 1;
-            }
-            if (ports.size() == 0) {
-                nmessage(ERROR_NO_SERIAL_PORTS_FOUND);
-                return 1;
-            }
-            info = ports.front();
-            port = info.port();
-        }
-        int loaderBaudRate;
-        if (!GetNumericConfigField(config, "loader-baud-rate", &loaderBaudRate))
-            loaderBaudRate = DEF_LOADER_BAUDRATE;
-        if ((sts = serialConnection->open(port, loaderBaudRate)) != 0) {
-            nmessage(ERROR_UNABLE_TO_CONNECT_TO_PORT, port);
-            return 1;
-        }
-        connection = serialConnection;
+    /* comparing the eeprom doesn't load anything */
+    if (verifyEeprom && (!file || (loadType & ltDownloadAndProgram) || useSDCard)) {
+        printf("error: -k needs a file and can't be used with -e or -f\n");
+        return 1;
     }
-    
-    /* do a wifi download */
-    else {
-        if (!(wifiConnection = new WiFiPropConnection)) {
-            nmessage(ERROR_INSUFFICIENT_MEMORY);
-            return 1;
-        }
-        if (!ipaddr) {
-            WiFiInfoList addrs;
-            if (WiFiPropConnection::findModules(false, addrs, 1) != 0) {
-                nmessage(ERROR_WIFI_MODULE_DISCOVERY_FAILED);
-                return 1;
-            }
-            if (addrs.size() == 0) {
-                nmessage(ERROR_NO_WIFI_MODULES_FOUND);
-                return 1;
-            }
-            const char *ipaddr2 = addrs.front().address();
-            char *p;
-            if (!(p = (char *)malloc(strlen(ipaddr2) + 1))) {
-                nmessage(ERROR_INSUFFICIENT_MEMORY);
-                return 1;
-            }
-            strcpy(p, ipaddr2);
-            ipaddr = p;
-        }
-        if ((sts = wifiConnection->setAddress(ipaddr)) != 0) {
-            nmessage(ERROR_INVALID_MODULE_ADDRESS, ipaddr);
-            return 1;
-        }
-        if (wifiConnection->getVersion() != 0) {
-            nmessage(ERROR_UNABLE_TO_CONNECT_TO_MODULE, ipaddr);
-            return 1;
-        }
-        if ((sts = wifiConnection->checkVersion()) != 0) {
-            nmessage(ERROR_WRONG_WIFI_MODULE_FIRMWARE, wifiConnection->version(), WIFI_REQUIRED_MAJOR_VERSION);
-            return 1;
-        }
-        connection = wifiConnection;
+
+    /* ram is read back after loading a file and eeprom without loading anything */
+    if (dumpPath && (dumpType == mtHubRAM) != (file != NULL)) {
+        printf("error: -d ram needs a file to load and -d eeprom can't be used with one\n");
+        return 1;
     }
-    
-    /* set the connection configuration */
-    connection->setConfig(config);
-    
-    /* setup the reset method */
-    if ((p = GetConfigField(config, "reset")) != NULL) {
-        if (connection->setResetMethod(p) != 0) {
-            nmessage(ERROR_NO_RESET_METHOD, p);
+    if (dumpPath && file && (!useFastLoader || verifyEeprom)) {
+        printf("error: -d ram needs the fast loader and can't be used with -k\n");
+        return 1;
+    }
+
+    /* eeprom regions are only programmed or compared along with the image */
+    if (pNextEepromRegion != &eepromRegions && !(loadType & ltDownloadAndProgram) && !verifyEeprom) {
+        printf("error: -E can only be used with -e or -k\n");
+        return 1;
+    }
+    if (eepromRegions && ((loadType & ltDownloadAndProgram) || verifyEeprom)) {
+        if (!file)
+            usage(argv[0]);
+        if (CheckEepromRegions(eepromRegions) != 0)
             return 1;
-        }
+        loader.setEepromRegions(eepromRegions);
     }
         
+    /* open the connection to the target */
+    if (!(connection = OpenConnection(config, useSerial, useSerial ? port : ipaddr)))
+        return 1;
+    if (!useSerial)
+        wifiConnection = (WiFiPropConnection *)connection;
+
     /* reset the Propeller */
     if (reset) {
         if (connection->generateResetSignal() != 0) {
@@ -527,29 +735,65 @@ int main(int argc, char *argv[])
         }
     }
     
-    /* write a file to the SD card */
-    if (writeFile) {
-        nmessage(INFO_WRITING_TO_SD_CARD, file);
-        if (WriteFileToSDCard(config, connection, file, nullptr) != 0) {
-            nmessage(ERROR_FAILED_TO_WRITE_TO_SD_CARD, file);
+    /* write files to and read files from the SD card */
+    if (useSDCard) {
+        if (!sdFiles) {
+            message("No files to write to the SD card");
+            return 1;
+        }
+        SDHelperImage helper;
+        if (PrepareSDHelper(config, &helper) != 0 || AccessSDCard(&helper, connection, sdFiles, updateFiles) != 0)
+            return 1;
+    }
+    
+    /* read eeprom into a file */
+    else if (dumpPath && !file) {
+        loader.setConnection(connection);
+        if (DumpMemory(loader, dumpType, dumpAddress, dumpSize, dumpPath) != 0)
+            return 1;
+    }
+    
+    /* compare the eeprom with the file */
+    else if (verifyEeprom) {
+        int mismatch;
+        loader.setConnection(connection);
+        if (loader.fastVerifyEeprom(image, imageSize, &mismatch) != 0) {
+            nmessage(ERROR_FAILED_TO_READ_MEMORY, "EEPROM");
             return 1;
         }
+        if (mismatch >= 0) {
+            nmessage(ERROR_EEPROM_DIFFERS, file, mismatch);
+            return 1;
+        }
+        nmessage(INFO_EEPROM_MATCHES, file);
     }
     
     /* load a file */
     else if (file) {
         loader.setConnection(connection);
-        if (useFastLoader) {
-            if ((sts = loader.fastLoadImage(image, imageSize, (LoadType)loadType)) != 0) {
-                nmessage(ERROR_DOWNLOAD_FAILED);
-                return 1;
+        sts = PreloadImages(loader, config, files, fileCount - 1, patches);
+        if (sts == 0) {
+            if (useFastLoader) {
+                /* keep the loader running to read ram back before the program starts */
+                loader.setKeepLoader(dumpPath != NULL);
+                sts = loader.fastLoadImage(image, imageSize, (LoadType)loadType);
+                loader.setKeepLoader(false);
+                if (sts == 0 && dumpPath) {
+                    if (DumpMemory(loader, dumpType, dumpAddress, dumpSize, dumpPath) != 0)
+                        return 1;
+                    sts = loader.fastLaunch();
+                }
             }
+            else
+                sts = loader.loadImage(image, imageSize, (LoadType)loadType);
         }
-        else {
-            if ((sts = loader.loadImage(image, imageSize, (LoadType)loadType)) != 0) {
-                nmessage(ERROR_DOWNLOAD_FAILED);
-                return 1;
-            }
+        if (showStats)
+            connection->stats().printSummary();
+        if (statsFile && connection->stats().updatePrometheusTextfile(statsFile) != 0)
+            message("Failed to update statistics file '%s'", statsFile);
+        if (sts != 0) {
+            nmessage(ERROR_DOWNLOAD_FAILED);
+            return 1;
         }
         nmessage(INFO_DOWNLOAD_SUCCESSFUL);
     }
@@ -590,98 +834,895 @@ finish:
     return 0;
 }
 
-static void ShowPorts(bool check)
-{
-    SerialInfoList ports;
-    if (SerialPropConnection::findPorts(check, ports) == 0) {
-        SerialInfoList::iterator i = ports.begin();
-        while (i != ports.end()) {
-            std::cout << i->port() << std::endl;
-            ++i;
-        }
-    }
-}
-
-static void ShowWiFiModules(bool show)
-{
-    WiFiInfoList modules;
-    WiFiPropConnection::findModules(true, modules);
-}
-
-#define TYPE_FILE_WRITE     0
-#define TYPE_DATA           1
-#define TYPE_EOF            2
-
-static int WriteFileToSDCard(BoardConfig *config, PropConnection *connection, const char *path, const char *target)
+/* AddEepromFile - add a <file> or <file>@<addr> to the eeprom regions to program */
+static int AddEepromFile(EepromRegion ***pNext, const char *arg, uint32_t *pAddress)
 {
-    PacketDriver packetDriver(*connection);
-    uint8_t buf[PKTMAXLEN];
-    size_t size, remaining, cnt;
+    char path[PATH_MAX], *end;
+    uint32_t address = *pAddress;
+    uint8_t *data;
+    const char *p;
+    int size;
     FILE *fp;
 
-    /* open the file */
-    nmessage(INFO_OPENING_FILE, path);
-    if ((fp = fopen(path, "rb")) == NULL)
-        return nerror(ERROR_CANT_OPEN_FILE, path);
-
-    if (!target) {
-        if (!(target = strrchr(path, '/')))
-            target = path;
-        else
-            ++target; // skip past the slash
+    /* get the file name and the address */
+    if ((p = strrchr(arg, '@')) != NULL) {
+        if (p - arg >= (int)sizeof(path))
+            return error("File name too long: %s", arg);
+        strncpy(path, arg, p - arg);
+        path[p - arg] = '\0';
+        address = (uint32_t)strtoul(p + 1, &end, 0);
+        if (p[1] == '\0' || *end != '\0')
+            return error("Bad eeprom address: %s", p + 1);
     }
+    else if (strlen(arg) >= sizeof(path))
+        return error("File name too long: %s", arg);
+    else
+        strcpy(path, arg);
 
+    /* read the file */
+    if (!(fp = fopen(path, "rb")))
+        return nerror(ERROR_CANT_OPEN_FILE, path);
     fseek(fp, 0, SEEK_END);
-    size = remaining = ftell(fp);
+    size = (int)ftell(fp);
     fseek(fp, 0, SEEK_SET);
-
-    message("Loading SD helper");
-    if (LoadSDHelper(config, connection) != 0) {
+    if (size <= 0 || size > MAX_EEPROM_SIZE || !(data = (uint8_t *)malloc(size))) {
         fclose(fp);
-        return error("Loading SD helper");
+        return error("Can't read '%s'", path);
     }
-
-    /* wait for the SD helper to complete initialization */
-    if (!packetDriver.waitForInitialAck())
-        return error("Failed to connect to helper");
-
-    if (!packetDriver.sendPacket(TYPE_FILE_WRITE, (uint8_t *)target, strlen(target) + 1)) {
+    if ((int)fread(data, 1, size, fp) != size) {
+        free(data);
         fclose(fp);
-        return error("SendPacket FILE_WRITE failed");
-    }
-
-    while ((cnt = fread(buf, 1, PKTMAXLEN, fp)) > 0) {
-        nprogress(INFO_BYTES_REMAINING, (long)remaining);
-        if (!packetDriver.sendPacket(TYPE_DATA, buf, cnt)) {
-            fclose(fp);
-            return error("SendPacket DATA failed");
-        }
-        remaining -= cnt;
+        return error("Can't read '%s'", path);
     }
-    nmessage(INFO_BYTES_SENT, (long)size);
-
     fclose(fp);
 
-    if (!packetDriver.sendPacket(TYPE_EOF, (uint8_t *)"", 0))
-        return error("SendPacket EOF failed");
-
-    /*
-       We send two EOF packets for SD card writes.  The reason is that the EOF
-       packet does actual work, and that work takes time.  The packet
-       transmission protocol uses read-ahead buffering on the receiving end.
-       Therefore, we need to make sure the first EOF packet was received and
-       processed before resetting the Prop!
-    */
-    if (!packetDriver.sendPacket(TYPE_EOF, (uint8_t *)"", 0))
-        return error("Second SendPacket EOF failed");
+    if (!NewEepromRegion(pNext, address, data, size)) {
+        free(data);
+        return nerror(ERROR_INSUFFICIENT_MEMORY);
+    }
+    free(data);
 
+    /* the next file without an address follows this one */
+    *pAddress = (address + size + EEPROM_PAGE_SIZE - 1) & ~(EEPROM_PAGE_SIZE - 1);
     return 0;
 }
 
-extern "C" {
-    extern uint8_t sd_helper_array[];
-    extern int sd_helper_size;
-}
+/* CheckEepromRegions - make sure the eeprom regions are page aligned and don't overlap the image or each other */
+static int CheckEepromRegions(EepromRegion *regions)
+{
+    EepromRegion *region, *other;
+
+    for (region = regions; region != NULL; region = region->next) {
+        if (region->address % EEPROM_PAGE_SIZE != 0) {
+            printf("error: eeprom address 0x%04x is not a multiple of %d\n", region->address, EEPROM_PAGE_SIZE);
+            return -1;
+        }
+        if (region->address < MAX_IMAGE_SIZE || region->address + region->size > MAX_EEPROM_SIZE) {
+            printf("error: eeprom region 0x%04x-0x%04x is outside of 0x%04x-0x%04x\n",
+                   region->address, region->address + region->size - 1, MAX_IMAGE_SIZE, MAX_EEPROM_SIZE - 1);
+            return -1;
+        }
+        for (other = region->next; other != NULL; other = other->next) {
+            if (region->address < other->address + other->size && other->address < region->address + region->size) {
+                printf("error: eeprom regions at 0x%04x and 0x%04x overlap\n", region->address, other->address);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* ParseMemoryRange - parse a <type>[:<start>-<end>]=<path> memory range to read */
+static int ParseMemoryRange(const char *arg, MemoryType *pType, uint32_t *pAddress, int *pSize, const char **pPath)
+{
+    uint32_t start = 0, end, maxEnd;
+    const char *p;
+    char *next;
+    int len;
+
+    /* get the memory type */
+    len = strcspn(arg, ":=");
+    if (len == 3 && strncmp(arg, "ram", 3) == 0) {
+        *pType = mtHubRAM;
+        maxEnd = MAX_IMAGE_SIZE - 1;
+    }
+    else if (len == 6 && strncmp(arg, "eeprom", 6) == 0) {
+        *pType = mtEEPROM;
+        maxEnd = MAX_EEPROM_SIZE - 1;
+    }
+    else {
+        printf("error: unknown memory type in '%s'\n", arg);
+        return -1;
+    }
+    end = MAX_IMAGE_SIZE - 1;
+    p = arg + len;
+
+    /* get the range */
+    if (*p == ':') {
+        start = (uint32_t)strtoul(p + 1, &next, 0);
+        if (next == p + 1 || *next != '-') {
+            printf("error: bad memory range in '%s'\n", arg);
+            return -1;
+        }
+        p = next + 1;
+        end = (uint32_t)strtoul(p, &next, 0);
+        if (next == p || end < start || end > maxEnd) {
+            printf("error: bad memory range in '%s'\n", arg);
+            return -1;
+        }
+        p = next;
+    }
+
+    /* get the local file */
+    if (*p != '=' || p[1] == '\0') {
+        printf("error: no file to read '%s' into\n", arg);
+        return -1;
+    }
+
+    *pAddress = start;
+    *pSize = end - start + 1;
+    *pPath = p + 1;
+    return 0;
+}
+
+/* DumpMemory - read a range of hub RAM or EEPROM into a file */
+static int DumpMemory(Loader &loader, MemoryType type, uint32_t address, int size, const char *path)
+{
+    const char *memory = type == mtEEPROM ? "EEPROM" : "RAM";
+    uint8_t *buf;
+    FILE *fp;
+    int sts;
+
+    if (!(buf = (uint8_t *)malloc(size))) {
+        nmessage(ERROR_INSUFFICIENT_MEMORY);
+        return -1;
+    }
+
+    nmessage(INFO_READING_MEMORY, memory, address, address + size - 1);
+    if (loader.fastReadMemory(type, address, buf, size) != 0) {
+        nmessage(ERROR_FAILED_TO_READ_MEMORY, memory);
+        free(buf);
+        return -1;
+    }
+
+    if (!(fp = fopen(path, "wb"))) {
+        nmessage(ERROR_CANT_OPEN_FILE, path);
+        free(buf);
+        return -1;
+    }
+    sts = (int)fwrite(buf, 1, size, fp) == size ? 0 : -1;
+    fclose(fp);
+    free(buf);
+
+    if (sts != 0)
+        printf("error: failed to write '%s'\n", path);
+    return sts;
+}
+
+/* PreloadImages - load the files before the last one into RAM with a second-stage loader that stays running */
+static int PreloadImages(Loader &loader, BoardConfig *config, const char **files, int count, ImagePatch *patches)
+{
+    uint8_t *image;
+    int imageSize, sts, i;
+
+    loader.setKeepLoader(true);
+    for (i = 0, sts = 0; sts == 0 && i < count; ++i) {
+        nmessage(INFO_OPENING_FILE, files[i]);
+        if (!(image = Loader::readFile(files[i], &imageSize))) {
+            nmessage(ERROR_CANT_OPEN_FILE, files[i]);
+            sts = -1;
+            break;
+        }
+
+        /* only the part of a .eeprom image that fits in hub memory is loaded */
+        if (imageSize > MAX_IMAGE_SIZE)
+            imageSize = MAX_IMAGE_SIZE;
+
+        if (PropImage::validate(image, imageSize) != PropImage::SUCCESS) {
+            nmessage(ERROR_FILE_CORRUPTED);
+            sts = -1;
+        }
+        else if (patches && PatchImageSymbols(config, files[i], image, imageSize, patches) != 0)
+            sts = -1;
+        else
+            sts = loader.fastLoadImage(image, imageSize, ltDownloadAndRun);
+        free(image);
+    }
+    loader.setKeepLoader(false);
+
+    return sts;
+}
+
+/* AddTarget - add a serial port or wifi module to the list of targets */
+static int AddTarget(TargetAddress *targets, int *pCount, bool serial, const char *address)
+{
+    if (*pCount >= MAX_TARGETS) {
+        printf("error: too many targets\n");
+        return -1;
+    }
+    targets[*pCount].serial = serial;
+    if (!(targets[*pCount].address = strdup(address))) {
+        nmessage(ERROR_INSUFFICIENT_MEMORY);
+        return -1;
+    }
+    ++*pCount;
+    return 0;
+}
+
+/* OpenConnection - open a serial port or a wifi module connection, finding one if no address is given */
+static PropConnection *OpenConnection(BoardConfig *config, bool useSerial, const char *address)
+{
+    PropConnection *connection;
+    const char *p;
+
+    /* open a serial port */
+    if (useSerial) {
+        SerialPropConnection *serialConnection;
+        SerialInfo info; // needs to stay in scope as long as we're using port
+        const char *port = address;
+        if (!(serialConnection = new SerialPropConnection)) {
+            nmessage(ERROR_INSUFFICIENT_MEMORY);
+            return NULL;
+        }
+        if (!port) {
+            SerialInfoList ports;
+            if (SerialPropConnection::findPorts(true, ports) != 0) {
+                nmessage(ERROR_SERIAL_PORT_DISCOVERY_FAILED);
+                return NULL;
+            }
+            if (ports.size() == 0) {
+                nmessage(ERROR_NO_SERIAL_PORTS_FOUND);
+                return NULL;
+            }
+            info = ports.front();
+            port = info.port();
+        }
+        int loaderBaudRate;
+        if (!GetNumericConfigField(config, "loader-baud-rate", &loaderBaudRate))
+            loaderBaudRate = DEF_LOADER_BAUDRATE;
+        if (serialConnection->open(port, loaderBaudRate) != 0) {
+            nmessage(ERROR_UNABLE_TO_CONNECT_TO_PORT, port);
+            return NULL;
+        }
+        connection = serialConnection;
+    }
+    
+    /* connect to a wifi module */
+    else {
+        WiFiPropConnection *wifiConnection;
+        const char *ipaddr = address;
+        if (!(wifiConnection = new WiFiPropConnection)) {
+            nmessage(ERROR_INSUFFICIENT_MEMORY);
+            return NULL;
+        }
+        if (!ipaddr) {
+            WiFiInfoList addrs;
+            if (WiFiPropConnection::findModules(false, addrs, 1) != 0) {
+                nmessage(ERROR_WIFI_MODULE_DISCOVERY_FAILED);
+                return NULL;
+            }
+            if (addrs.size() == 0) {
+                nmessage(ERROR_NO_WIFI_MODULES_FOUND);
+                return NULL;
+            }
+            const char *ipaddr2 = addrs.front().address();
+            char *p;
+            if (!(p = (char *)malloc(strlen(ipaddr2) + 1))) {
+                nmessage(ERROR_INSUFFICIENT_MEMORY);
+                return NULL;
+            }
+            strcpy(p, ipaddr2);
+            ipaddr = p;
+        }
+        if (wifiConnection->setAddress(ipaddr) != 0) {
+            nmessage(ERROR_INVALID_MODULE_ADDRESS, ipaddr);
+            return NULL;
+        }
+        if (wifiConnection->getVersion() != 0) {
+            nmessage(ERROR_UNABLE_TO_CONNECT_TO_MODULE, ipaddr);
+            return NULL;
+        }
+        if (wifiConnection->checkVersion() != 0) {
+            nmessage(ERROR_WRONG_WIFI_MODULE_FIRMWARE, wifiConnection->version(), WIFI_REQUIRED_MAJOR_VERSION);
+            return NULL;
+        }
+        connection = wifiConnection;
+    }
+    
+    /* set the connection configuration */
+    connection->setConfig(config);
+    
+    /* setup the reset method */
+    if ((p = GetConfigField(config, "reset")) != NULL) {
+        if (connection->setResetMethod(p) != 0) {
+            nmessage(ERROR_NO_RESET_METHOD, p);
+            return NULL;
+        }
+    }
+        
+    return connection;
+}
+
+static void ShowPorts(bool check)
+{
+    SerialInfoList ports;
+    if (SerialPropConnection::findPorts(check, ports) == 0) {
+        SerialInfoList::iterator i = ports.begin();
+        while (i != ports.end()) {
+            std::cout << i->port() << std::endl;
+            ++i;
+        }
+    }
+}
+
+static void ShowWiFiModules(bool show)
+{
+    WiFiInfoList modules;
+    WiFiPropConnection::findModules(true, modules);
+}
+
+#define TYPE_FILE_WRITE     0
+#define TYPE_DATA           1
+#define TYPE_EOF            2
+#define TYPE_FILE_STAT      3
+#define TYPE_DATA_LZ        4
+#define TYPE_FILE_READ      5
+#define TYPE_DIR_LIST       6
+
+/* NewSDFile - add a file to the list of files to write to or read from the SD card */
+static int NewSDFile(SDFile ***pNext, SDOp op, const char *dir, const char *name, const char *target)
+{
+    int dirLen = dir ? strlen(dir) + 1 : 0;
+    SDFile *file;
+
+    if (!(file = (SDFile *)malloc(sizeof(SDFile) + dirLen + strlen(name) + (target ? strlen(target) + 1 : 0))))
+        return error("insufficient memory");
+    file->next = NULL;
+    file->op = op;
+    file->data = NULL;
+
+    /* build the path */
+    if (dir)
+        sprintf(file->path, "%s/%s", dir, name);
+    else
+        strcpy(file->path, name);
+
+    /* use the name part of the path on the SD card unless a name is given */
+    if (target)
+        file->target = strcpy(&file->path[strlen(file->path) + 1], target);
+    else if ((file->target = strrchr(file->path, '/')) != NULL)
+        ++file->target;
+    else
+        file->target = file->path;
+
+    **pNext = file;
+    *pNext = &file->next;
+    return 0;
+}
+
+static int CompareNames(const void *p1, const void *p2)
+{
+    return strcmp(*(const char **)p1, *(const char **)p2);
+}
+
+/* AddSDDirectory - add every file in a directory in name order */
+static int AddSDDirectory(SDFile ***pNext, const char *dir)
+{
+    char **names = NULL, path[PATH_MAX];
+    int count = 0, max = 0, sts = 0, i;
+    struct dirent *entry;
+    struct stat info;
+    DIR *dirp;
+
+    if (!(dirp = opendir(dir)))
+        return nerror(ERROR_CANT_OPEN_FILE, dir);
+
+    while ((entry = readdir(dirp)) != NULL) {
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (stat(path, &info) != 0 || !S_ISREG(info.st_mode))
+            continue;
+        if (count >= max) {
+            char **newNames;
+            max += 16;
+            if (!(newNames = (char **)realloc(names, max * sizeof(char *)))) {
+                sts = error("insufficient memory");
+                break;
+            }
+            names = newNames;
+        }
+        if (!(names[count] = strdup(entry->d_name))) {
+            sts = error("insufficient memory");
+            break;
+        }
+        ++count;
+    }
+    closedir(dirp);
+
+    if (count > 0)
+        qsort(names, count, sizeof(char *), CompareNames);
+    for (i = 0; i < count; ++i) {
+        if (sts == 0)
+            sts = NewSDFile(pNext, SD_WRITE, dir, names[i], NULL);
+        free(names[i]);
+    }
+    free(names);
+
+    return sts;
+}
+
+/* AddSDList - add the files in a list file */
+static int AddSDList(SDFile ***pNext, const char *listFile)
+{
+    char line[PATH_MAX + 256], dir[PATH_MAX], *name, *target, *p;
+    int lineNumber = 0, sts = 0;
+    FILE *fp;
+
+    if (!(fp = fopen(listFile, "r")))
+        return nerror(ERROR_CANT_OPEN_FILE, listFile);
+
+    /* relative paths in the list are relative to the directory containing it */
+    strncpy(dir, listFile, sizeof(dir) - 1);
+    dir[sizeof(dir) - 1] = '\0';
+    if ((p = strrchr(dir, '/')) != NULL)
+        *p = '\0';
+    else
+        strcpy(dir, ".");
+
+    while (sts == 0 && fgets(line, sizeof(line), fp)) {
+        ++lineNumber;
+        if (!(name = strtok(line, " \t\r\n")) || *name == '#')
+            continue;
+        target = strtok(NULL, " \t\r\n");
+        if (strtok(NULL, " \t\r\n"))
+            sts = error("%s:%d: expecting a path and an optional SD card name", listFile, lineNumber);
+        else
+            sts = NewSDFile(pNext, SD_WRITE, *name == '/' ? NULL : dir, name, target);
+    }
+    fclose(fp);
+
+    return sts;
+}
+
+/* AddSDFiles - add a file, a directory or the files in an @list to the SD card file list */
+static int AddSDFiles(SDFile ***pNext, const char *path)
+{
+    struct stat info;
+
+    if (*path == '@')
+        return AddSDList(pNext, path + 1);
+
+    if (stat(path, &info) == 0 && S_ISDIR(info.st_mode))
+        return AddSDDirectory(pNext, path);
+
+    return NewSDFile(pNext, SD_WRITE, NULL, path, NULL);
+}
+
+/* AddSDRead - add an SD card file to read given <name> or <name>=<path> */
+static int AddSDRead(SDFile ***pNext, const char *arg)
+{
+    char target[PATH_MAX];
+    const char *p;
+
+    if (!(p = strchr(arg, '=')))
+        return NewSDFile(pNext, SD_READ, NULL, arg, arg);
+
+    if (p - arg >= (int)sizeof(target))
+        return error("SD card file name too long: %s", arg);
+    strncpy(target, arg, p - arg);
+    target[p - arg] = '\0';
+    return NewSDFile(pNext, SD_READ, NULL, p + 1, target);
+}
+
+/* FILE_STAT and FILE_READ status codes */
+#define STAT_OK             0
+#define STAT_MISSING        1
+
+/* the helper hashes the file on the SD card before replying to FILE_STAT */
+#define STAT_TIMEOUT        10000   // 10 seconds
+#define STAT_BYTES_PER_MS   100     // plus a millisecond for every 100 bytes
+
+/* the helper streams a file back without waiting so a damaged packet is recovered from by
+   waiting for the EOF packet and asking for the rest of the file */
+#define READ_TIMEOUT        10000   // 10 seconds
+#define READ_RETRIES        3
+#define READ_HDR_LEN        8       // file offset and size in front of each DATA packet
+#define READ_BUFFER_SIZE    65536   // buffering for the local file
+
+static uint32_t GetLong(const uint8_t *buf)
+{
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+static void PutLong(uint8_t *buf, uint32_t value)
+{
+    buf[0] = (uint8_t)value;
+    buf[1] = (uint8_t)(value >> 8);
+    buf[2] = (uint8_t)(value >> 16);
+    buf[3] = (uint8_t)(value >> 24);
+}
+
+/* SDFileUnchanged - check whether the SD card already has a file with the same size and contents */
+static int SDFileUnchanged(PacketDriver &packetDriver, SDFile *file, FILE *fp, size_t size, bool *pUnchanged)
+{
+    FilePrefetcher prefetcher;
+    uint8_t buf[PKTMAXLEN];
+    const uint8_t *data;
+    const char *target = file->target;
+    uint32_t crc = CRC32_INIT;
+    int targetLen = strlen(target) + 1;
+    int type, cnt;
+
+    *pUnchanged = false;
+
+    /* ask the helper for the size and crc of the file on the SD card */
+    if (4 + targetLen > packetDriver.maxDataLen())
+        return error("SD card file name too long: %s", target);
+    PutLong(buf, size);
+    memcpy(&buf[4], target, targetLen);
+    if (!packetDriver.sendPacket(TYPE_FILE_STAT, buf, 4 + targetLen) || !packetDriver.flush())
+        return error("SendPacket FILE_STAT failed");
+
+    /* compute the crc of the local file while the helper computes its crc */
+    if (file->data)
+        crc = file->crc;
+    else {
+        if (prefetcher.start(fp, PKTMAXLEN) != 0)
+            return error("insufficient memory");
+        while ((cnt = prefetcher.next(&data)) > 0)
+            crc = UpdateCRC32(crc, data, cnt);
+        prefetcher.stop();
+        crc = ~crc;
+        fseek(fp, 0, SEEK_SET);
+    }
+
+    if ((cnt = packetDriver.receivePacket(&type, buf, sizeof(buf), STAT_TIMEOUT + size / STAT_BYTES_PER_MS)) != 12
+    ||  type != TYPE_FILE_STAT)
+        return error("No response to FILE_STAT");
+
+    *pUnchanged = GetLong(&buf[0]) == STAT_OK && GetLong(&buf[4]) == size && GetLong(&buf[8]) == crc;
+    return 0;
+}
+
+/*
+   Each block of the file is sent as a DATA_LZ packet if it compresses to fewer bytes than a
+   DATA packet would take. The helper decompresses it into a buffer the size of its largest
+   packet so a block is never longer than that. The blocks are read ahead on a background
+   thread so a slow disk or network file system doesn't hold up the link unless the file is
+   already in memory because it's being written to several SD cards.
+*/
+static int WriteFileToSDCard(PacketDriver &packetDriver, SDFile *file, bool update)
+{
+    FilePrefetcher prefetcher;
+    const char *target = file->target;
+    uint8_t zbuf[PKTMAXLEN];
+    const uint8_t *buf;
+    size_t size, remaining, sent = 0;
+    bool unchanged;
+    int cnt, zcnt;
+    FILE *fp = NULL;
+
+    /* open the file */
+    if (file->data)
+        size = remaining = file->size;
+    else {
+        nmessage(INFO_OPENING_FILE, file->path);
+        if ((fp = fopen(file->path, "rb")) == NULL)
+            return nerror(ERROR_CANT_OPEN_FILE, file->path);
+        fseek(fp, 0, SEEK_END);
+        size = remaining = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+    }
+
+    /* skip files that are already on the SD card */
+    if (update) {
+        if (SDFileUnchanged(packetDriver, file, fp, size, &unchanged) != 0) {
+            if (fp)
+                fclose(fp);
+            return -1;
+        }
+        if (unchanged) {
+            nmessage(INFO_SD_CARD_FILE_UNCHANGED, target);
+            if (fp)
+                fclose(fp);
+            return 0;
+        }
+    }
+
+    if (!packetDriver.sendPacket(TYPE_FILE_WRITE, (uint8_t *)target, strlen(target) + 1)) {
+        if (fp)
+            fclose(fp);
+        return error("SendPacket FILE_WRITE failed");
+    }
+
+    if ((fp ? prefetcher.start(fp, packetDriver.maxDataLen()) : prefetcher.start(file->data, size, packetDriver.maxDataLen())) != 0) {
+        if (fp)
+            fclose(fp);
+        return error("insufficient memory");
+    }
+
+    while ((cnt = prefetcher.next(&buf)) > 0) {
+        nprogress(INFO_BYTES_REMAINING, (long)remaining);
+        if ((zcnt = CompressLZ4(buf, cnt, &zbuf[2], cnt - 3)) > 0) {
+            zbuf[0] = (uint8_t)cnt;
+            zbuf[1] = (uint8_t)(cnt >> 8);
+            if (!packetDriver.sendPacket(TYPE_DATA_LZ, zbuf, 2 + zcnt)) {
+                prefetcher.stop();
+                if (fp)
+                    fclose(fp);
+                return error("SendPacket DATA_LZ failed");
+            }
+            sent += 2 + zcnt;
+        }
+        else {
+            if (!packetDriver.sendPacket(TYPE_DATA, buf, cnt)) {
+                prefetcher.stop();
+                if (fp)
+                    fclose(fp);
+                return error("SendPacket DATA failed");
+            }
+            sent += cnt;
+        }
+        remaining -= cnt;
+    }
+    prefetcher.stop();
+    if (fp)
+        fclose(fp);
+    if (cnt < 0)
+        return error("Read failed");
+
+    nmessage(INFO_BYTES_SENT, (long)size);
+    message("%ld bytes sent as %ld packet bytes", (long)size, (long)sent);
+
+    /* the EOF packet closes the file and the next FILE_WRITE packet opens another one */
+    if (!packetDriver.sendPacket(TYPE_EOF, (uint8_t *)"", 0))
+        return error("SendPacket EOF failed");
+
+    return 0;
+}
+
+/* ReadSDCardFile - receive a file from the SD card starting at an offset */
+static int ReadSDCardFile(PacketDriver &packetDriver, const char *target, FILE *fp, uint32_t *pOffset, uint32_t *pSize, bool *pFound)
+{
+    uint8_t buf[PKTMAXLEN];
+    int targetLen = strlen(target) + 1;
+    int type, cnt;
+
+    /* ask for the file starting at the first byte not yet received */
+    if (4 + targetLen > packetDriver.maxDataLen())
+        return error("SD card file name too long: %s", target);
+    PutLong(buf, *pOffset);
+    memcpy(&buf[4], target, targetLen);
+    if (!packetDriver.sendPacket(TYPE_FILE_READ, buf, 4 + targetLen) || !packetDriver.flush())
+        return error("SendPacket FILE_READ failed");
+
+    /* keep the DATA packets that continue the file and drop any that follow a damaged one */
+    while ((cnt = packetDriver.receivePacket(&type, buf, sizeof(buf), READ_TIMEOUT)) != PKT_TIMEOUT) {
+        if (cnt == PKT_BAD)
+            message("Damaged packet from SD helper");
+        else if (type == TYPE_EOF && cnt == 8) {
+            *pFound = GetLong(&buf[0]) == STAT_OK;
+            *pSize = GetLong(&buf[4]);
+            return 0;
+        }
+        else if (type == TYPE_DATA && cnt > READ_HDR_LEN && GetLong(&buf[0]) == *pOffset) {
+            *pSize = GetLong(&buf[4]);
+            nprogress(INFO_BYTES_REMAINING, (long)(*pSize - *pOffset));
+            if (fwrite(&buf[READ_HDR_LEN], 1, cnt - READ_HDR_LEN, fp) != (size_t)(cnt - READ_HDR_LEN))
+                return error("Write failed");
+            *pOffset += cnt - READ_HDR_LEN;
+        }
+    }
+
+    return error("No EOF from FILE_READ");
+}
+
+static int ReadFileFromSDCard(PacketDriver &packetDriver, const char *target, const char *path)
+{
+    uint32_t offset = 0, size = 0;
+    bool found = true;
+    int retries = 0, sts;
+    FILE *fp;
+
+    nmessage(INFO_OPENING_FILE, path);
+    if ((fp = fopen(path, "wb")) == NULL)
+        return nerror(ERROR_CANT_OPEN_FILE, path);
+    setvbuf(fp, NULL, _IOFBF, READ_BUFFER_SIZE);
+
+    while ((sts = ReadSDCardFile(packetDriver, target, fp, &offset, &size, &found)) == 0
+    &&     found && offset < size && ++retries <= READ_RETRIES)
+        message("Resuming read of '%s' at %ld", target, (long)offset);
+
+    if (fclose(fp) != 0 && sts == 0)
+        sts = error("Write failed");
+    if (sts == 0 && !found)
+        sts = error("'%s' isn't on the SD card", target);
+    else if (sts == 0 && offset != size)
+        sts = error("Read %ld of %ld bytes", (long)offset, (long)size);
+    if (sts != 0) {
+        remove(path);
+        return sts;
+    }
+
+    nmessage(INFO_BYTES_RECEIVED, (long)size);
+    return 0;
+}
+
+/* ListSDCardFiles - show the files in the root directory of the SD card */
+static int ListSDCardFiles(PacketDriver &packetDriver)
+{
+    std::string listing;
+    uint8_t buf[PKTMAXLEN];
+    int retries = 0, type, cnt, i;
+    bool damaged;
+
+    do {
+        if (!packetDriver.sendPacket(TYPE_DIR_LIST, (uint8_t *)"", 0) || !packetDriver.flush())
+            return error("SendPacket DIR_LIST failed");
+
+        /* each entry is a file size followed by a zero terminated name */
+        listing.clear();
+        damaged = false;
+        while ((cnt = packetDriver.receivePacket(&type, buf, sizeof(buf), READ_TIMEOUT)) != PKT_TIMEOUT) {
+            if (cnt == PKT_BAD)
+                damaged = true;
+            else if (type == TYPE_EOF)
+                break;
+            else if (type == TYPE_DIR_LIST && cnt > 0) {
+                buf[cnt - 1] = '\0';
+                for (i = 0; i + 4 < cnt; i += 4 + strlen((char *)&buf[i + 4]) + 1) {
+                    char line[64];
+                    snprintf(line, sizeof(line), "%-12.12s %10lu\n", (char *)&buf[i + 4], (unsigned long)GetLong(&buf[i]));
+                    listing += line;
+                }
+            }
+        }
+        if (cnt == PKT_TIMEOUT)
+            return error("No EOF from DIR_LIST");
+    } while (damaged && ++retries <= READ_RETRIES);
+
+    if (damaged)
+        return error("Damaged packets from DIR_LIST");
+
+    fputs(listing.c_str(), stdout);
+    return 0;
+}
+
+static int AccessSDCard(SDHelperImage *helper, PropConnection *connection, SDFile *files, bool update)
+{
+    PacketDriver packetDriver(*connection);
+    SDFile *file;
+
+    message("Loading SD helper");
+    if (LoadSDHelper(connection, helper) != 0)
+        return error("Loading SD helper");
+
+    /* wait for the SD helper to complete initialization */
+    if (!packetDriver.waitForInitialAck())
+        return error("Failed to connect to helper");
+
+    for (file = files; file != NULL; file = file->next) {
+        switch (file->op) {
+        case SD_WRITE:
+            nmessage(INFO_WRITING_TO_SD_CARD, file->path);
+            if (WriteFileToSDCard(packetDriver, file, update) != 0)
+                return nerror(ERROR_FAILED_TO_WRITE_TO_SD_CARD, file->path);
+            break;
+        case SD_READ:
+            nmessage(INFO_READING_FROM_SD_CARD, file->target);
+            if (ReadFileFromSDCard(packetDriver, file->target, file->path) != 0)
+                return nerror(ERROR_FAILED_TO_READ_FROM_SD_CARD, file->target);
+            break;
+        case SD_LIST:
+            if (ListSDCardFiles(packetDriver) != 0)
+                return error("Listing the SD card failed");
+            break;
+        }
+    }
+
+    /*
+       We send two EOF packets for SD card writes.  The reason is that the EOF
+       packet does actual work, and that work takes time.  The packet
+       transmission protocol uses read-ahead buffering on the receiving end.
+       Therefore, we need to make sure the first EOF packet was received and
+       processed before resetting the Prop!
+    */
+    if (!packetDriver.sendPacket(TYPE_EOF, (uint8_t *)"", 0))
+        return error("Second SendPacket EOF failed");
+
+    /* wait for both EOF packets to be acknowledged */
+    if (!packetDriver.flush())
+        return error("SendPacket EOF failed");
+
+    return 0;
+}
+
+/* LoadSDFileData - read the files to write into memory once for all of the targets */
+static int LoadSDFileData(SDFile *files)
+{
+    SDFile *file;
+    FILE *fp;
+
+    for (file = files; file != NULL; file = file->next) {
+        nmessage(INFO_OPENING_FILE, file->path);
+        if (!(fp = fopen(file->path, "rb")))
+            return nerror(ERROR_CANT_OPEN_FILE, file->path);
+        fseek(fp, 0, SEEK_END);
+        file->size = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        if (!(file->data = (uint8_t *)malloc(file->size + 1))) {
+            fclose(fp);
+            return nerror(ERROR_INSUFFICIENT_MEMORY);
+        }
+        if (fread(file->data, 1, file->size, fp) != file->size) {
+            fclose(fp);
+            return nerror(ERROR_CANT_OPEN_FILE, file->path);
+        }
+        fclose(fp);
+        file->crc = ~UpdateCRC32(CRC32_INIT, file->data, file->size);
+    }
+
+    return 0;
+}
+
+/* ProvisionSDCard - write the files to the SD card of one target */
+static void ProvisionSDCard(BoardConfig *config, TargetAddress *target, SDHelperImage *helper, SDFile *files, bool update, int *pResult)
+{
+    PropConnection *connection;
+
+    setMessagePrefix(target->address);
+    if (!(connection = OpenConnection(config, target->serial, target->address))) {
+        *pResult = -1;
+        return;
+    }
+    *pResult = AccessSDCard(helper, connection, files, update);
+    connection->close();
+    delete connection;
+}
+
+/*
+   ProvisionSDCards - write the same files to the SD cards of several targets at once
+
+   The SD helper is patched and the files are read once and shared by a thread for each target.
+   Messages from each thread start with the name of its port or module.
+*/
+static int ProvisionSDCards(BoardConfig *config, TargetAddress *targets, int targetCount, SDFile *files, bool update)
+{
+    std::thread threads[MAX_TARGETS];
+    int results[MAX_TARGETS];
+    SDHelperImage helper;
+    SDFile *file;
+    int written = 0, i;
+
+    for (file = files; file != NULL; file = file->next) {
+        if (file->op != SD_WRITE) {
+            printf("error: -g and -l can only be used with a single target\n");
+            return -1;
+        }
+    }
+
+    if (LoadSDFileData(files) != 0 || PrepareSDHelper(config, &helper) != 0)
+        return -1;
+
+    for (i = 0; i < targetCount; ++i)
+        threads[i] = std::thread(ProvisionSDCard, config, &targets[i], &helper, files, update, &results[i]);
+
+    for (i = 0; i < targetCount; ++i) {
+        threads[i].join();
+        if (results[i] == 0)
+            ++written;
+        else
+            nmessage(ERROR_FAILED_TO_PROVISION_SD_CARD, targets[i].address);
+    }
+    nmessage(INFO_SD_CARDS_WRITTEN, written, targetCount);
+
+    return written == targetCount ? 0 : -1;
+}
+
+extern "C" {
+    extern uint8_t sd_helper_array[];
+    extern int sd_helper_size;
+}
 
 /* DAT header in sd_helper.spin */
 typedef struct {
@@ -696,10 +1737,10 @@ typedef struct {
     uint32_t select_mask;
 } SDHelperDatHdr;
 
-static int LoadSDHelper(BoardConfig *config, PropConnection *connection)
+/* PatchSDHelper - set the clock, baud rate and SD card pins in a copy of the SD helper */
+static int PatchSDHelper(BoardConfig *config, uint8_t *imageData, int imageSize, int *pBaudRate)
 {
-    Loader loader(connection);
-    PropImage image(sd_helper_array, sd_helper_size);
+    PropImage image(imageData, imageSize);
     SpinHdr *hdr = (SpinHdr *)image.imageData();
     SpinObj *obj = (SpinObj *)(image.imageData() + hdr->pbase);
     SDHelperDatHdr *dat = (SDHelperDatHdr *)((uint8_t *)obj + (obj->pubcnt + obj->objcnt) * sizeof(uint32_t));
@@ -753,12 +1794,44 @@ static int LoadSDHelper(BoardConfig *config, PropConnection *connection)
     /* recompute the checksum */
     image.updateChecksum();
 
+    *pBaudRate = dat->baudrate;
+    return 0;
+}
+
+/* PrepareSDHelper - patch the SD helper once for any number of targets */
+static int PrepareSDHelper(BoardConfig *config, SDHelperImage *helper)
+{
+    if (!(helper->image = (uint8_t *)malloc(sd_helper_size)))
+        return error("insufficient memory");
+    memcpy(helper->image, sd_helper_array, sd_helper_size);
+    helper->imageSize = sd_helper_size;
+    if (PatchSDHelper(config, helper->image, helper->imageSize, &helper->baudRate) != 0) {
+        free(helper->image);
+        helper->image = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static int LoadSDHelper(PropConnection *connection, SDHelperImage *helper)
+{
+    Loader loader(connection);
+    uint8_t *image;
+    int sts;
+
+    /* the loader sets the clock in the image it's given so each target gets its own copy */
+    if (!(image = (uint8_t *)malloc(helper->imageSize)))
+        return error("insufficient memory");
+    memcpy(image, helper->image, helper->imageSize);
+
     /* load the SD helper program */
-    if (loader.fastLoadImage(image.imageData(), image.imageSize(), ltDownloadAndRun) != 0)
+    sts = loader.fastLoadImage(image, helper->imageSize, ltDownloadAndRun);
+    free(image);
+    if (sts != 0)
         return error("Helper load failed");
         
     /* select the sd helper baud rate */
-    connection->setBaudRate(dat->baudrate);
+    connection->setBaudRate(helper->baudRate);
 
     return 0;
 }
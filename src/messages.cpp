@@ -2,6 +2,7 @@
 #include <stdarg.h>
 #include <ctype.h>
 #include "messages.h"
+#include "deadline.h"
 
 /*
 
@@ -42,7 +43,16 @@ static const char *infoText[] = {
 "Using port %s instead of port %s",
 "Stepping down to %d baud",
 "Using single-stage download",
-"Verifying EEPROM"
+"Verifying EEPROM",
+"%ld payload bytes in %.3f s (%.0f B/s), %ld wire bytes (%.0f B/s), %d packets, RTT min/avg/p99 %.1f/%.1f/%.1f ms, %d retries, %d tag mismatches, %d duplicate ids, %d adaptive timeouts, %d baud",
+"'%s' is unchanged on the SD card",
+"Reading '%s' from the SD card",
+"%ld bytes received              ",
+"Wrote the SD card files to %d of %d targets",
+"Setting '%s' to %d",
+"Programming EEPROM at 0x%04x (%d bytes)",
+"Reading %s 0x%04x-0x%04x",
+"EEPROM matches '%s'"
 };
 
 // message codes 100 and up -- must be in the same order as the ERROR_xxx enum values in messsages.h
@@ -78,11 +88,24 @@ static const char *errorText[] = {
 "EEPROM checksum failed",
 "EEPROM verify failed",
 "Communication lost",
-"Load image failed"
+"Load image failed",
+"Failed to read SD card file '%s'",
+"Failed to write the SD card files to %s",
+"Can't set '%s' in the image",
+"Failed to read %s",
+"EEPROM differs from '%s' at 0x%04x"
 };
 
+/* progress messages for a target loaded in parallel with others are shown at most this often */
+#define PREFIXED_PROGRESS_INTERVAL  1000    // 1 second
+
 static void vmessage(const char *fmt, va_list ap, int eol);
 static void vnmessage(int code, const char *fmt, va_list ap, int eol);
+static void showMessage(int code, const char *fmt, va_list ap, int eol);
+
+/* the name of the target the current thread is working on or NULL */
+static thread_local const char *messagePrefix = NULL;
+static thread_local uint32_t lastProgressTime;
 
 static const char *messageText(int code)
 {
@@ -133,6 +156,13 @@ void nmessage(int code, ...)
     va_end(ap);
 }
 
+/* setMessagePrefix - start the messages from the current thread with the name of its target */
+void setMessagePrefix(const char *prefix)
+{
+    messagePrefix = prefix;
+    lastProgressTime = MillisecondTimer() - PREFIXED_PROGRESS_INTERVAL;
+}
+
 void nprogress(int code, ...)
 {
     va_list ap;
@@ -155,29 +185,50 @@ static void vmessage(const char *fmt, va_list ap, int eol)
     }
 
     /* display messages in verbose mode or when the code is > 0 */
-    if (verbose || code > 0) {
-        if (showMessageCodes)
-            printf("%03d-", code);
-        if (code > 99)
-            printf("ERROR: ");
-        vprintf(fmt, ap);
-        putchar(eol);
-        if (eol == '\r')
-            fflush(stdout);
-    }
+    if (verbose || code > 0)
+        showMessage(code, fmt, ap, eol);
 }
 
 static void vnmessage(int code, const char *fmt, va_list ap, int eol)
 {
     /* display messages in verbose mode or when the code is > 0 */
-    if (verbose || code > 0) {
-        if (showMessageCodes)
-            printf("%03d-", code);
-        if (code > 99)
-            printf("ERROR: ");
-        vprintf(fmt, ap);
-        putchar(eol);
-        if (eol == '\r')
-            fflush(stdout);
+    if (verbose || code > 0)
+        showMessage(code, fmt, ap, eol);
+}
+
+/*
+   showMessage - write a message as a single line
+
+   Messages from targets loaded in parallel carry the target name and are written with one call
+   so they don't get mixed up. Their progress messages are written as whole lines now and then
+   instead of being overwritten in place.
+*/
+static void showMessage(int code, const char *fmt, va_list ap, int eol)
+{
+    char line[1024];
+    int len = 0;
+
+    if (messagePrefix) {
+        if (eol == '\r') {
+            if ((uint32_t)(MillisecondTimer() - lastProgressTime) < PREFIXED_PROGRESS_INTERVAL)
+                return;
+            lastProgressTime = MillisecondTimer();
+            eol = '\n';
+        }
+        len += snprintf(&line[len], sizeof(line) - len, "%s: ", messagePrefix);
     }
+    if (showMessageCodes && len < (int)sizeof(line))
+        len += snprintf(&line[len], sizeof(line) - len, "%03d-", code);
+    if (code > 99 && len < (int)sizeof(line))
+        len += snprintf(&line[len], sizeof(line) - len, "ERROR: ");
+    if (len < (int)sizeof(line))
+        len += vsnprintf(&line[len], sizeof(line) - len, fmt, ap);
+    if (len > (int)sizeof(line) - 2)
+        len = sizeof(line) - 2;
+    while (messagePrefix && len > 0 && line[len - 1] == ' ')   // drop the padding used to overwrite progress
+        --len;
+    line[len++] = eol;
+    fwrite(line, 1, len, stdout);
+    if (eol == '\r' || messagePrefix)
+        fflush(stdout);
 }
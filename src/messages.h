@@ -49,6 +49,15 @@ enum {
     /* 012 */ INFO_STEPPING_DOWN_BAUD_RATE,
     /* 013 */ INFO_USING_SINGLE_STAGE_LOADER,
     /* 014 */ INFO_VERIFYING_EEPROM,
+    /* 015 */ INFO_LOAD_STATISTICS,
+    /* 016 */ INFO_SD_CARD_FILE_UNCHANGED,
+    /* 017 */ INFO_READING_FROM_SD_CARD,
+    /* 018 */ INFO_BYTES_RECEIVED,
+    /* 019 */ INFO_SD_CARDS_WRITTEN,
+    /* 020 */ INFO_SETTING_SYMBOL,
+    /* 021 */ INFO_PROGRAMMING_EEPROM_REGION,
+    /* 022 */ INFO_READING_MEMORY,
+    /* 023 */ INFO_EEPROM_MATCHES,
     MAX_INFO,
     
     MIN_ERROR                                       = 100,
@@ -82,6 +91,11 @@ enum {
     /* 127 */ ERROR_EEPROM_VERIFY_FAILED,
     /* 128 */ ERROR_COMMUNICATION_LOST,
     /* 129 */ ERROR_LOAD_IMAGE_FAILED,
+    /* 130 */ ERROR_FAILED_TO_READ_FROM_SD_CARD,
+    /* 131 */ ERROR_FAILED_TO_PROVISION_SD_CARD,
+    /* 132 */ ERROR_CANT_SET_SYMBOL,
+    /* 133 */ ERROR_FAILED_TO_READ_MEMORY,
+    /* 134 */ ERROR_EEPROM_DIFFERS,
     MAX_ERROR
 };
 
@@ -93,6 +107,7 @@ int nerror(int code, ...);
 void message(const char *fmt, ...);
 void nmessage(int code, ...);
 void nprogress(int code, ...);
+void setMessagePrefix(const char *prefix);
 
 #ifdef __cplusplus
 }
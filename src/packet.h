@@ -24,18 +24,47 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SO
 
 #include "propconnection.h"
 
-#define PKTMAXLEN   1024
+/* largest packet data length and the length accepted by helpers that don't report theirs */
+#define PKTMAXLEN   8192
+#define PKTDEFLEN   1024
+
+/* number of packets that can be sent before waiting for an acknowledgement */
+#define PKTWINDOW   2
+
+/* packet header and crc lengths */
+#define PKTHDRLEN   6
+#define PKTCRCLEN   2
+
+/* maximum length of a frame */
+#define FRAMELEN    (PKTHDRLEN + PKTMAXLEN + PKTCRCLEN)
+
+/* receivePacket results other than a payload length */
+#define PKT_TIMEOUT (-1)    /* nothing more was received */
+#define PKT_BAD     (-2)    /* a damaged or oversized packet was received */
 
 class PacketDriver {
 public:
-    PacketDriver(PropConnection &connection) : m_connection(connection) {}
+    PacketDriver(PropConnection &connection)
+        : m_connection(connection), m_maxDataLen(PKTDEFLEN), m_baseSeq(0), m_nextSeq(0), m_outstanding(0), m_lastNakSeq(-1) {}
     int waitForInitialAck(void);
-    int sendPacket(int type, uint8_t *buf, int len);
+    int maxDataLen() { return m_maxDataLen; }
+    int sendPacket(int type, const uint8_t *buf, int len);
+    int flush(void);
     int receivePacket(int *pType, uint8_t *buf, int len, int timeout);
 private:
+    int waitForResponse(void);
+    int receiveResponse(uint8_t *rsp);
+    int resendOutstanding(int first);
     int waitForAckNak(int timeout);
 
     PropConnection &m_connection;
+    int m_maxDataLen;                       /* largest packet data length the helper accepts */
+    uint8_t m_frames[PKTWINDOW][FRAMELEN];  /* unacknowledged frames in sequence order */
+    int m_frameLengths[PKTWINDOW];
+    int m_baseSeq;                          /* sequence number of the oldest unacknowledged frame */
+    int m_nextSeq;                          /* sequence number of the next frame */
+    int m_outstanding;                      /* number of unacknowledged frames */
+    int m_lastNakSeq;                       /* sequence number in the last NAK or -1 */
 };
 
 
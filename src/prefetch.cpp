@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include "prefetch.h"
+
+FilePrefetcher::FilePrefetcher()
+    : m_fp(NULL), m_data(NULL), m_size(0), m_offset(0), m_blockSize(0), m_buffers(NULL), m_head(0), m_tail(0), m_filled(0), m_holding(false), m_stopping(false)
+{
+}
+
+FilePrefetcher::~FilePrefetcher()
+{
+    stop();
+}
+
+/* start - start reading from the current position of an open file */
+int FilePrefetcher::start(FILE *fp, int blockSize)
+{
+    stop();
+    if (!(m_buffers = (uint8_t *)malloc(PREFETCH_BLOCKS * blockSize)))
+        return -1;
+    m_fp = fp;
+    m_blockSize = blockSize;
+    m_head = m_tail = m_filled = 0;
+    m_holding = false;
+    m_stopping = false;
+    m_thread = std::thread(&FilePrefetcher::run, this);
+    return 0;
+}
+
+/* start - hand out blocks of a file that has already been read into memory */
+int FilePrefetcher::start(const uint8_t *data, size_t size, int blockSize)
+{
+    stop();
+    m_data = data;
+    m_size = size;
+    m_offset = 0;
+    m_blockSize = blockSize;
+    return 0;
+}
+
+/*
+   next - return the next block of the file
+
+   The block stays valid until the next call. Returns the number of bytes in the block, 0 at the
+   end of the file or -1 if the file can't be read.
+*/
+int FilePrefetcher::next(const uint8_t **pData)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    int count;
+
+    /* no need to wait for a file that's in memory */
+    if (m_data) {
+        count = m_size - m_offset < (size_t)m_blockSize ? (int)(m_size - m_offset) : m_blockSize;
+        *pData = &m_data[m_offset];
+        m_offset += count;
+        return count;
+    }
+
+    /* hand the previous block back to the reader unless it was the last one */
+    if (m_holding) {
+        if (m_counts[m_tail] <= 0) {
+            *pData = NULL;
+            return m_counts[m_tail];
+        }
+        m_tail = (m_tail + 1) % PREFETCH_BLOCKS;
+        --m_filled;
+        m_holding = false;
+        m_changed.notify_all();
+    }
+
+    m_changed.wait(lock, [this] { return m_filled > 0; });
+    m_holding = true;
+    count = m_counts[m_tail];
+    *pData = &m_buffers[m_tail * m_blockSize];
+    return count;
+}
+
+/* stop - stop reading and wait for the reader to finish */
+void FilePrefetcher::stop()
+{
+    if (m_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+            m_changed.notify_all();
+        }
+        m_thread.join();
+    }
+    if (m_buffers) {
+        free(m_buffers);
+        m_buffers = NULL;
+    }
+    m_fp = NULL;
+    m_data = NULL;
+}
+
+/* run - fill free blocks until the end of the file */
+void FilePrefetcher::run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    int count;
+
+    for (;;) {
+        m_changed.wait(lock, [this] { return m_filled < PREFETCH_BLOCKS || m_stopping; });
+        if (m_stopping)
+            break;
+
+        /* the block at m_head is free so it can be filled without holding the lock */
+        lock.unlock();
+        count = fread(&m_buffers[m_head * m_blockSize], 1, m_blockSize, m_fp);
+        if (count == 0 && ferror(m_fp))
+            count = -1;
+        lock.lock();
+
+        m_counts[m_head] = count;
+        m_head = (m_head + 1) % PREFETCH_BLOCKS;
+        ++m_filled;
+        m_changed.notify_all();
+        if (count <= 0)
+            break;
+    }
+}
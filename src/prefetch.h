@@ -0,0 +1,44 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/* number of blocks read ahead of the consumer */
+#define PREFETCH_BLOCKS     4
+
+/* FilePrefetcher - read a file a block at a time on a background thread so the next block is
+   ready as soon as the consumer asks for it, or hand out blocks of a file already in memory */
+class FilePrefetcher
+{
+public:
+    FilePrefetcher();
+    ~FilePrefetcher();
+    int start(FILE *fp, int blockSize);
+    int start(const uint8_t *data, size_t size, int blockSize);
+    int next(const uint8_t **pData);
+    void stop();
+private:
+    void run();
+
+    FILE *m_fp;
+    const uint8_t *m_data;              /* the file contents when they're already in memory */
+    size_t m_size;
+    size_t m_offset;
+    int m_blockSize;
+    uint8_t *m_buffers;                 /* PREFETCH_BLOCKS blocks of m_blockSize bytes */
+    int m_counts[PREFETCH_BLOCKS];      /* bytes in each block, 0 at the end of the file or -1 */
+    int m_head;                         /* next block to fill */
+    int m_tail;                         /* next block to consume */
+    int m_filled;                       /* number of filled blocks including one held by the consumer */
+    bool m_holding;                     /* the consumer holds the block at m_tail */
+    bool m_stopping;
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+};
+
+#endif
@@ -0,0 +1,63 @@
+#include "propconnection.h"
+
+/* lower bound on the round-trip part of an adaptive timeout (in milliseconds) */
+#define MIN_RTT_TIMEOUT     200
+
+/* serializationTime - return the time in milliseconds to send bytes at the current baud rate */
+int PropConnection::serializationTime(int byteCount)
+{
+    return m_baudRate > 0 ? (int)(((int64_t)byteCount * 10 * 1000 + m_baudRate - 1) / m_baudRate) : 0;
+}
+
+void PropConnection::resetRttEstimate()
+{
+    m_rttSamples = 0;
+    m_srtt = 0;
+    m_rttvar = 0;
+}
+
+/* updateRttEstimate - add a round-trip time sample (in milliseconds, excluding serialization time)
+
+   This is the estimator from RFC 6298 using Jacobson's scaled integer arithmetic:
+       RTTVAR = 3/4 * RTTVAR + 1/4 * |SRTT - R|
+       SRTT   = 7/8 * SRTT   + 1/8 * R
+*/
+void PropConnection::updateRttEstimate(int sample)
+{
+    if (sample < 0)
+        sample = 0;
+    if (m_rttSamples++ == 0) {
+        m_srtt = sample << 3;
+        m_rttvar = sample << 1;
+    }
+    else {
+        int delta = sample - (m_srtt >> 3);
+        m_srtt += delta;
+        if (delta < 0)
+            delta = -delta;
+        m_rttvar += delta - (m_rttvar >> 2);
+    }
+}
+
+/* retransmitTimeout - return the timeout for an attempt to send a packet and receive its response
+
+   The timeout is the estimated round-trip time (SRTT + 4 * RTTVAR) plus the time it takes to
+   serialize the bytes at the current baud rate. It doubles with each retry and never exceeds
+   maxTimeout. Until the first sample has been taken maxTimeout is used.
+*/
+int PropConnection::retransmitTimeout(int byteCount, int attempt, int maxTimeout)
+{
+    int timeout;
+
+    if (m_rttSamples == 0)
+        return maxTimeout;
+
+    if ((timeout = (m_srtt >> 3) + m_rttvar) < MIN_RTT_TIMEOUT)
+        timeout = MIN_RTT_TIMEOUT;
+    timeout += serializationTime(byteCount);
+
+    while (--attempt >= 0 && timeout < maxTimeout)
+        timeout *= 2;
+
+    return timeout < maxTimeout ? timeout : maxTimeout;
+}
@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <string.h>
 #include "config.h"
+#include "linkstats.h"
 
 typedef enum {
     ltShutdown = 0,
@@ -16,8 +17,8 @@ typedef enum {
 class PropConnection
 {
 public:
-    PropConnection() : m_config(NULL), m_portName(NULL) {}
-    ~PropConnection() {
+    PropConnection() : m_config(NULL), m_portName(NULL), m_baudRate(0) { resetRttEstimate(); }
+    virtual ~PropConnection() {
         if (m_portName)
             free(m_portName);
     }
@@ -45,10 +46,21 @@ public:
     }
     void setConfig(BoardConfig *config) { m_config = config; }
     BoardConfig *config() { return m_config; }
+    int baudRate() { return m_baudRate; }
+    int serializationTime(int byteCount);
+    void resetRttEstimate();
+    void updateRttEstimate(int sample);
+    int retransmitTimeout(int byteCount, int attempt, int maxTimeout);
+    int smoothedRtt() { return m_srtt >> 3; }
+    LinkStats &stats() { return m_stats; }
 protected:
     BoardConfig *m_config;
     char *m_portName;
     int m_baudRate;
+    int m_rttSamples;       // number of round-trip time samples taken
+    int m_srtt;             // smoothed round-trip time in milliseconds scaled by 8
+    int m_rttvar;           // round-trip time variation in milliseconds scaled by 4
+    LinkStats m_stats;      // throughput and latency counters for the current load
 };
 
 #endif // PROPCONNECTION_H
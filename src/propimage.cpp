@@ -1,15 +1,19 @@
+#include <stddef.h>
 #include "propimage.h"
 #include "proploader.h"
 
 static uint8_t initialCallFrame[] = {0xFF, 0xFF, 0xF9, 0xFF, 0xFF, 0xFF, 0xF9, 0xFF};
 
+/* words summed in 16 bit lanes before the lanes could overflow (65535 / 510) */
+#define SUM_BLOCK_WORDS     128
+
 PropImage::PropImage()
-    : m_imageData(NULL)
+    : m_imageData(NULL), m_imageSize(0), m_sum(0), m_sumValid(false)
 {
 }
 
 PropImage::PropImage(uint8_t *imageData, int imageSize)
-    : m_imageData(NULL)
+    : m_imageData(NULL), m_imageSize(0), m_sum(0), m_sumValid(false)
 {
     setImage(imageData, imageSize);
 }
@@ -22,6 +26,7 @@ void PropImage::setImage(uint8_t *imageData, int imageSize)
 {
     m_imageData = imageData;
     m_imageSize = imageSize;
+    m_sumValid = false;
 }
 
 uint32_t PropImage::clkFreq()
@@ -31,7 +36,9 @@ uint32_t PropImage::clkFreq()
 
 void PropImage::setClkFreq(uint32_t clkFreq)
 {
-    setLong((uint8_t *)&((SpinHdr *)m_imageData)->clkfreq, clkFreq);
+    uint8_t buf[sizeof(uint32_t)];
+    setLong(buf, clkFreq);
+    storeBytes(offsetof(SpinHdr, clkfreq), buf, sizeof(buf));
 }
 
 uint8_t PropImage::clkMode()
@@ -41,61 +48,171 @@ uint8_t PropImage::clkMode()
 
 void PropImage::setClkMode(uint8_t clkMode)
 {
-    *(uint8_t *)&((SpinHdr *)m_imageData)->clkmode = clkMode;
+    storeBytes(offsetof(SpinHdr, clkmode), &clkMode, 1);
+}
+
+/*
+   patch - store a 1, 2 or 4 byte little-endian value in the image
+
+   The checksum is adjusted by the change in the sum of the patched bytes rather than recomputed
+   over the whole image. The header can't be patched this way since it holds the checksum.
+*/
+int PropImage::patch(int offset, uint32_t value, int size)
+{
+    SpinHdr *hdr = (SpinHdr *)m_imageData;
+    uint8_t buf[sizeof(uint32_t)], chksum;
+    int32_t oldSum;
+
+    if ((size != 1 && size != 2 && size != 4) || offset < (int)sizeof(SpinHdr) || offset > m_imageSize - size)
+        return IMAGE_TRUNCATED;
+
+    oldSum = sumBytes(&m_imageData[offset], size);
+    setLong(buf, value);
+    storeBytes(offset, buf, size);
+    chksum = hdr->chksum - (sumBytes(&m_imageData[offset], size) - oldSum);
+    storeBytes(offsetof(SpinHdr, chksum), &chksum, 1);
+
+    return SUCCESS;
+}
+
+/*
+   prepare - apply the clock settings from a board configuration and update the checksum
+
+   The image is summed at most once. Changes made through setClkFreq, setClkMode and patch
+   after that keep the sum up to date, so the checksum and loadChecksum cost nothing more.
+*/
+void PropImage::prepare(BoardConfig *config)
+{
+    bool changed = false;
+    int value;
+    if (GetNumericConfigField(config, "clkfreq", &value)) {
+        setClkFreq(value);
+        changed = true;
+    }
+    if (GetNumericConfigField(config, "clkmode", &value)) {
+        setClkMode(value);
+        changed = true;
+    }
+    if (changed)
+        updateChecksum();
+}
+
+/* imageSum - get the sum of the bytes in the image */
+int32_t PropImage::imageSum()
+{
+    if (!m_sumValid) {
+        m_sum = sumBytes(m_imageData, m_imageSize);
+        m_sumValid = true;
+    }
+    return m_sum;
+}
+
+/* loadChecksum - get the checksum of the code and the initial call frame the loaders verify */
+int32_t PropImage::loadChecksum()
+{
+    SpinHdr *hdr = (SpinHdr *)m_imageData;
+    int32_t sum = hdr->vbase == m_imageSize ? imageSum() : sumBytes(m_imageData, hdr->vbase);
+    return sum + sumBytes(initialCallFrame, sizeof(initialCallFrame));
+}
+
+/* storeBytes - change bytes in the image keeping the sum up to date */
+void PropImage::storeBytes(int offset, const uint8_t *data, int size)
+{
+    if (m_sumValid)
+        m_sum -= sumBytes(&m_imageData[offset], size);
+    memcpy(&m_imageData[offset], data, size);
+    if (m_sumValid)
+        m_sum += sumBytes(&m_imageData[offset], size);
 }
 
+/*
+   validate - check the header, checksum and trailing data of a Spin image
+
+   This works directly on the image in a single pass. The image is treated as if it were padded
+   with zeros to MAX_IMAGE_SIZE with the initial call frame stored just below dbase, but the
+   padding adds nothing to the sum and the call frame is accounted for separately.
+*/
 int PropImage::validate()
+{
+    const char *reason;
+    return validate(&reason);
+}
+
+int PropImage::validate(const char **pReason)
 {
     SpinHdr *hdr = (SpinHdr *)m_imageData;
-    uint8_t fullImage[MAX_IMAGE_SIZE];
+    int callFrameStart, callFrameEnd, codeEnd;
+    int32_t sum;
 
     // make sure the image is at least the size of a Spin header
-    if (m_imageSize <= (int)sizeof(SpinHdr))
+    if (m_imageSize <= (int)sizeof(SpinHdr)) {
+        *pReason = "image is too small for a Spin header";
         return IMAGE_TRUNCATED;
+    }
         
     // make sure the file is big enough to contain all of the code
-    if (m_imageSize < hdr->vbase)
+    if (m_imageSize < hdr->vbase) {
+        *pReason = "image ends before vbase";
         return IMAGE_TRUNCATED;
+    }
         
     // make sure the image isn't too large
-    if (m_imageSize > MAX_IMAGE_SIZE)
+    if (m_imageSize > MAX_IMAGE_SIZE) {
+        *pReason = "image is larger than hub memory";
         return IMAGE_TOO_LARGE;
+    }
         
     // make sure the code starts in the right place
-    if (hdr->pbase != 0x0010)
+    if (hdr->pbase != 0x0010) {
+        *pReason = "pbase is not 0x0010";
         return IMAGE_CORRUPTED;
+    }
 
-    // make a local full-sized copy of the image
-    memset(fullImage, 0, sizeof(fullImage));
-    memcpy(fullImage, m_imageData, m_imageSize);
-    
     // make sure there is space for the initial call frame
-    if (hdr->dbase > MAX_IMAGE_SIZE)
+    if (hdr->dbase > MAX_IMAGE_SIZE) {
+        *pReason = "dbase is beyond the end of hub memory";
         return IMAGE_TOO_LARGE;
+    }
+    if (hdr->dbase < (int)sizeof(initialCallFrame)) {
+        *pReason = "dbase leaves no room for the initial call frame";
+        return IMAGE_CORRUPTED;
+    }
+    callFrameStart = hdr->dbase - sizeof(initialCallFrame);
+    callFrameEnd = hdr->dbase;
 
-    // setup the initial call frame
-    int callFrameStart = hdr->dbase - sizeof(initialCallFrame);
-    memcpy(&fullImage[callFrameStart], initialCallFrame, sizeof(initialCallFrame));
-        
-    // verify the checksum
-    uint8_t *p = fullImage;
-    uint8_t chksum = 0;
-    for (int cnt = MAX_IMAGE_SIZE; --cnt >= 0; )
-        chksum += *p++;
-    if (chksum != 0)
+    // sum the code and the call frame which replaces any code it overlaps
+    codeEnd = hdr->vbase;
+    sum = sumBytes(m_imageData, codeEnd) + sumBytes(initialCallFrame, sizeof(initialCallFrame));
+    if (callFrameStart < codeEnd)
+        sum -= sumBytes(&m_imageData[callFrameStart], (callFrameEnd < codeEnd ? callFrameEnd : codeEnd) - callFrameStart);
+
+    // make sure there is no data after the code other than where the call frame goes
+    int32_t trailingSum = sumTrailingBytes(codeEnd, callFrameStart < codeEnd ? codeEnd : callFrameStart)
+                        + sumTrailingBytes(callFrameEnd > codeEnd ? callFrameEnd : codeEnd, m_imageSize);
+
+    // verify the checksum counting any data after the code
+    if (((sum + trailingSum) & 0xFF) != 0) {
+        *pReason = "checksum mismatch";
         return IMAGE_CORRUPTED;
-        
-    // make sure there is no data after the code
-    uint16_t idx = hdr->vbase;
-    while (idx < m_imageSize && (fullImage[idx] == 0 || (idx >= hdr->dbase - sizeof(initialCallFrame) && idx < hdr->dbase && fullImage[idx] == initialCallFrame[idx - (hdr->dbase - sizeof(initialCallFrame))])))
-        ++idx;
-    if (idx < m_imageSize)
+    }
+    if (trailingSum != 0) {
+        *pReason = "data after the code";
         return IMAGE_CORRUPTED;
-
+    }
+        
     // image is okay
+    *pReason = NULL;
     return 0;
 }
 
+/* sumTrailingBytes - sum the bytes of the image from start up to end, all zero after the code */
+int32_t PropImage::sumTrailingBytes(int start, int end)
+{
+    if (end > m_imageSize)
+        end = m_imageSize;
+    return start < end ? sumBytes(&m_imageData[start], end - start) : 0;
+}
+
 int PropImage::validate(uint8_t *imageData, int imageSize)
 {
     PropImage image(imageData, imageSize);
@@ -105,14 +222,10 @@ int PropImage::validate(uint8_t *imageData, int imageSize)
 void PropImage::updateChecksum()
 {
     SpinHdr *spinHdr = (SpinHdr *)m_imageData;
-    uint8_t *p = m_imageData;
     uint8_t chksum;
-    int cnt;
-    spinHdr->chksum = 0;
-    chksum = SPIN_STACK_FRAME_CHECKSUM;
-    for (cnt = m_imageSize; --cnt >= 0; )
-        chksum += *p++;
-    spinHdr->chksum = -chksum;
+    chksum = SPIN_STACK_FRAME_CHECKSUM + imageSum() - spinHdr->chksum;
+    chksum = -chksum;
+    storeBytes(offsetof(SpinHdr, chksum), &chksum, 1);
 }
 
 void PropImage::updateChecksum(uint8_t *imageData, int imageSize)
@@ -121,6 +234,38 @@ void PropImage::updateChecksum(uint8_t *imageData, int imageSize)
     image.updateChecksum();
 }
 
+/*
+   sumBytes - add up the bytes in a buffer for the image checksums
+
+   Eight bytes are added at a time as four 16 bit lanes of even bytes and four of odd bytes in a
+   64 bit word. A lane grows by at most 510 for each word so the lanes are folded into the sum
+   every SUM_BLOCK_WORDS words before they can overflow.
+*/
+int32_t PropImage::sumBytes(const uint8_t *buf, int len)
+{
+    const uint64_t evenBytes = 0x00FF00FF00FF00FFull;
+    uint64_t lanes, word;
+    int32_t sum = 0;
+    int words;
+
+    while (len >= (int)sizeof(uint64_t)) {
+        words = len / sizeof(uint64_t);
+        if (words > SUM_BLOCK_WORDS)
+            words = SUM_BLOCK_WORDS;
+        len -= words * sizeof(uint64_t);
+        for (lanes = 0; --words >= 0; buf += sizeof(uint64_t)) {
+            memcpy(&word, buf, sizeof(uint64_t));
+            lanes += (word & evenBytes) + ((word >> 8) & evenBytes);
+        }
+        lanes = (lanes & 0x0000FFFF0000FFFFull) + ((lanes >> 16) & 0x0000FFFF0000FFFFull);
+        sum += (int32_t)((lanes & 0xFFFFFFFF) + (lanes >> 32));
+    }
+
+    while (--len >= 0)
+        sum += *buf++;
+    return sum;
+}
+
 uint16_t PropImage::getWord(const uint8_t *buf)
 {
      return (buf[1] << 8) | buf[0];
@@ -6,6 +6,7 @@
 #include <string.h>
 #include <stdint.h>
 #include "loadelf.h"
+#include "config.h"
 
 /* initial stack frame checksum for a binary file */
 /* this value is the sum of the bytes in the initial stack frame which are not included in the .binary file.
@@ -50,6 +51,7 @@ public:
     ~PropImage();
     void setImage(uint8_t *imageData, int imageSize);
     int validate();
+    int validate(const char **pReason);
     void updateChecksum();
     uint8_t *imageData() { return m_imageData; }
     int imageSize() { return m_imageSize; }
@@ -57,8 +59,13 @@ public:
     void setClkFreq(uint32_t clkFreq);
     uint8_t clkMode();
     void setClkMode(uint8_t clkMode);
+    int patch(int offset, uint32_t value, int size);
+    void prepare(BoardConfig *config);
+    int32_t imageSum();
+    int32_t loadChecksum();
     static int validate(uint8_t *imageData, int imageSize);
     static void updateChecksum(uint8_t *imageData, int imageSize);
+    static int32_t sumBytes(const uint8_t *buf, int len);
 
 private:
     int loadSpinBinaryFile(FILE *fp);
@@ -67,9 +74,13 @@ private:
     static void setWord(uint8_t *buf, uint16_t value);
     static uint32_t getLong(const uint8_t *buf);
     static void setLong(uint8_t *buf, uint32_t value);
+    void storeBytes(int offset, const uint8_t *data, int size);
+    int32_t sumTrailingBytes(int start, int end);
 
     uint8_t *m_imageData;
     int m_imageSize;
+    int32_t m_sum;      /* sum of the bytes in the image once m_sumValid is set */
+    bool m_sumValid;
 };
 
 #endif // PROPELLERIMAGE_H
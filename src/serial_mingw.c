@@ -36,6 +36,7 @@
 #include <stdarg.h>
 #include <stdint.h>
 #include "serial.h"
+#include "deadline.h"
 
 static void ShowLastError(void);
 
@@ -239,40 +240,18 @@ int ReceiveSerialDataTimeout(SERIAL *serial, void *buf, int len, int timeout)
     return dwBytes;
 }
 
-int ReceiveSerialDataExactTimeout(SERIAL *serial, void *buf, int len, int timeout)
+/* ReceiveSerialDataTimeoutHandle - adapt ReceiveSerialDataTimeout for ReceiveExactWithDeadline */
+static int ReceiveSerialDataTimeoutHandle(void *handle, void *buf, int len, int timeout)
 {
-    uint8_t *ptr = (uint8_t *)buf;
-    int remaining = len;
-    DWORD dwBytes = 0;
-    
-    FlushFileBuffers(serial->hSerial);
-
-    serial->timeouts.ReadTotalTimeoutConstant = timeout;
-    SetCommTimeouts(serial->hSerial, &serial->timeouts);
-    
-    /* return only when the buffer contains the exact amount of data requested */
-    while (remaining > 0) {
-    
-        /* read the next bit of data */
-        if (!ReadFile(serial->hSerial, ptr, remaining, &dwBytes, NULL)) {
-            printf("Error reading port\n");
-            ShowLastError();
-            return -1;
-        }
-        
-        /* check for a timeout */
-        if (dwBytes == 0) {
-            //printf("Timeout %d %d\n", len, remaining);
-            return -1;
-        }
-                    
-        /* update the buffer pointer */
-        remaining -= dwBytes;
-        ptr += dwBytes;
-    }
+    /* a zero ReadTotalTimeoutConstant would block rather than poll */
+    if (timeout <= 0)
+        timeout = 1;
+    return ReceiveSerialDataTimeout((SERIAL *)handle, buf, len, timeout);
+}
 
-    /* return the full size of the buffer */
-    return len;
+int ReceiveSerialDataExactTimeout(SERIAL *serial, void *buf, int len, int timeout)
+{
+    return ReceiveExactWithDeadline(ReceiveSerialDataTimeoutHandle, serial, buf, len, timeout);
 }
 
 static void ShowLastError(void)
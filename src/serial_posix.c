@@ -48,6 +48,7 @@
 
 #include "serial.h"
 #include "proploader.h"
+#include "deadline.h"
 #ifdef RASPBERRY_PI
 #include "gpio_sysfs.h"
 #define DEFAULT_GPIO_PIN    17
@@ -424,44 +425,15 @@ int ReceiveSerialDataTimeout(SERIAL *serial, void *buf, int len, int timeout)
     return (int)(bytes > 0 ? bytes : -1);
 }
 
-int ReceiveSerialDataExactTimeout(SERIAL *serial, void *buf, int len, int timeout)
+/* ReceiveSerialDataTimeoutHandle - adapt ReceiveSerialDataTimeout for ReceiveExactWithDeadline */
+static int ReceiveSerialDataTimeoutHandle(void *handle, void *buf, int len, int timeout)
 {
-    uint8_t *ptr = (uint8_t *)buf;
-    int remaining = len;
-    int cnt = 0;
-    struct timeval toval;
-    fd_set set;
-
-    /* return only when the buffer contains the exact amount of data requested */
-    while (remaining > 0) {
-        
-        /* initialize the socket set */
-        FD_ZERO(&set);
-        FD_SET(serial->fd, &set);
-
-        /* setup the timeout */
-        toval.tv_sec = timeout / 1000;
-        toval.tv_usec = (timeout % 1000) * 1000;
-
-        /* wait for data to be available on the port */
-        if (select(serial->fd + 1, &set, NULL, NULL, &toval) <= 0)
-            return -1;
-
-        /* read the incoming data */
-        if (FD_ISSET(serial->fd, &set)) {
-        
-            /* read the next bit of data */
-            if ((cnt = read(serial->fd, ptr, remaining)) < 0)
-                return -1;
-                
-            /* update the buffer pointer */
-            remaining -= cnt;
-            ptr += cnt;
-        }
-    }
+    return ReceiveSerialDataTimeout((SERIAL *)handle, buf, len, timeout);
+}
 
-    /* return the full size of the buffer */
-    return len;
+int ReceiveSerialDataExactTimeout(SERIAL *serial, void *buf, int len, int timeout)
+{
+    return ReceiveExactWithDeadline(ReceiveSerialDataTimeoutHandle, serial, buf, len, timeout);
 }
 
 static int CheckPrefix(const char *prefix)
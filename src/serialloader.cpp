@@ -11,6 +11,7 @@
 #include "serialpropconnection.h"
 #include "loader.h"
 #include "proploader.h"
+#include "trace.h"
 
 #define MAX_BUFFER_SIZE         32768   /* The maximum buffer size. (BUG: git rid of this magic number) */
 #define LENGTH_FIELD_SIZE       11      /* number of bytes in the length field */
@@ -151,7 +152,7 @@ static uint8_t rxHandshake[] = {
         outSize is the size of the outBytes buffer
     returns the number of bytes written to the outBytes buffer or -1 if the encoded data does not fit
 */
-static int EncodeBytes(const uint8_t *inBytes, int inCount, uint8_t *outBytes, int outSize)
+int EncodeBytes(const uint8_t *inBytes, int inCount, uint8_t *outBytes, int outSize)
 {
     static uint8_t masks[] = { 0x00, 0x01, 0x03, 0x07, 0x0f, 0x1f };
     int bitCount = inCount * 8;
@@ -339,6 +340,7 @@ int SerialPropConnection::loadImage(const uint8_t *image, int imageSize, LoadTyp
     int packetSize, version, retries, cnt, i;
     int loaderBaudRate;
     uint8_t *packet;
+    TracePhases phase;
     
     if (!GetNumericConfigField(config(), "loader-baud-rate", &loaderBaudRate))
         loaderBaudRate = DEF_LOADER_BAUDRATE;
@@ -359,6 +361,8 @@ int SerialPropConnection::loadImage(const uint8_t *image, int imageSize, LoadTyp
     generateResetSignal();
     
     /* send the packet including the image */
+    phase.begin("rom-download");
+    traceInstant("rom-stream", "\"image-bytes\":%d,\"wire-bytes\":%d", imageSize, packetSize);
     if (info)
         nmessage(INFO_DOWNLOADING, portName());
     sendData(packet, packetSize);
@@ -367,6 +371,7 @@ int SerialPropConnection::loadImage(const uint8_t *image, int imageSize, LoadTyp
     free(packet);
     
     /* clock out the handshake response */
+    phase.begin("rom-handshake");
     memset(packet2, 0xF9, sizeof(rxHandshake) + 4);
     sendData(packet2, sizeof(rxHandshake) + 4);
     
@@ -388,6 +393,7 @@ int SerialPropConnection::loadImage(const uint8_t *image, int imageSize, LoadTyp
         return -1;
     }
     
+    phase.begin("rom-verify-ram");
     if (info)
         nmessage(INFO_VERIFYING_RAM);
 
@@ -415,6 +421,7 @@ int SerialPropConnection::loadImage(const uint8_t *image, int imageSize, LoadTyp
     /* handle EEPROM programming */
     if (loadType == ltDownloadAndProgram || loadType == ltDownloadAndProgramAndRun) {
     
+        phase.begin("rom-program-eeprom");
         if (info)
             nmessage(INFO_PROGRAMMING_EEPROM);
 
@@ -439,6 +446,7 @@ int SerialPropConnection::loadImage(const uint8_t *image, int imageSize, LoadTyp
             return -1;
         }
     
+        phase.begin("rom-verify-eeprom");
         if (info)
             nmessage(INFO_VERIFYING_EEPROM);
 
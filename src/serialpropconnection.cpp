@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include "serialpropconnection.h"
 #include "messages.h"
+#include "trace.h"
 
 #define CALIBRATE_DELAY         10
 
@@ -90,6 +91,7 @@ int SerialPropConnection::setResetMethod(const char *method)
 
 int SerialPropConnection::generateResetSignal()
 {
+    TraceSpan span("reset");
     if (!isOpen())
         return -1;
     SerialGenerateResetSignal(m_serialPort);
@@ -100,21 +102,27 @@ int SerialPropConnection::sendData(const uint8_t *buf, int len)
 {
     if (!isOpen())
         return -1;
-    return SendSerialData(m_serialPort, buf, len);
+    int cnt = SendSerialData(m_serialPort, buf, len);
+    m_stats.addWireBytes(cnt);
+    return cnt;
 }
 
 int SerialPropConnection::receiveDataTimeout(uint8_t *buf, int len, int timeout)
 {
     if (!isOpen())
         return -1;
-    return ReceiveSerialDataTimeout(m_serialPort, buf, len, timeout);
+    int cnt = ReceiveSerialDataTimeout(m_serialPort, buf, len, timeout);
+    m_stats.addWireBytes(cnt);
+    return cnt;
 }
 
 int SerialPropConnection::receiveDataExactTimeout(uint8_t *buf, int len, int timeout)
 {
     if (!isOpen())
         return -1;
-    return ReceiveSerialDataExactTimeout(m_serialPort, buf, len, timeout);
+    int cnt = ReceiveSerialDataExactTimeout(m_serialPort, buf, len, timeout);
+    m_stats.addWireBytes(cnt);
+    return cnt;
 }
 
 int SerialPropConnection::receiveChecksumAck(int byteCount, int delay)
@@ -17,6 +17,9 @@ private:
 
 typedef std::list<SerialInfo> SerialInfoList;
 
+/* translate bytes into a Propeller download stream (in serialloader.cpp) */
+int EncodeBytes(const uint8_t *inBytes, int inCount, uint8_t *outBytes, int outSize);
+
 class SerialPropConnection : public PropConnection
 {
 public:
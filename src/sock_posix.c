@@ -15,6 +15,7 @@
 #endif
 
 #include "sock.h"
+#include "deadline.h"
 
 #ifdef __MINGW32__
 
@@ -323,10 +324,16 @@ int ReceiveSocketDataTimeout(SOCKET sock, void *buf, int len, int timeout)
     return -1;
 }
 
+/* ReceiveSocketDataTimeoutHandle - adapt ReceiveSocketDataTimeout for ReceiveExactWithDeadline */
+static int ReceiveSocketDataTimeoutHandle(void *handle, void *buf, int len, int timeout)
+{
+    return ReceiveSocketDataTimeout(*(SOCKET *)handle, buf, len, timeout);
+}
+
 /* ReceiveSocketDataExactTimeout - receive an exact amount of socket data */
 int ReceiveSocketDataExactTimeout(SOCKET sock, void *buf, int len, int timeout)
 {
-    return ReceiveSocketDataTimeout(sock, buf, len, timeout);
+    return ReceiveExactWithDeadline(ReceiveSocketDataTimeoutHandle, &sock, buf, len, timeout);
 }
 
 /* ReceiveSocketDataAndAddress - receive socket data and sender's address */
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <mutex>
+#include "trace.h"
+#include "deadline.h"
+
+static FILE *traceFile = NULL;
+static TraceFormat traceFormat = TRACE_JSON_LINES;
+static uint64_t traceStartTime;
+static int traceEventCount;
+
+/* targets loaded in parallel each get their own thread id so they show up as separate tracks */
+static std::mutex traceMutex;
+static int traceThreadCount = 0;
+static thread_local int traceThreadId = 0;
+
+static void traceEvent(const char *name, const char *phase, const char *fmt, va_list ap);
+
+/* traceOpen - start writing trace events to a file */
+int traceOpen(const char *path, TraceFormat format)
+{
+    if (traceFile)
+        traceClose();
+    if (!(traceFile = fopen(path, "w")))
+        return -1;
+    traceFormat = format;
+    traceStartTime = MicrosecondTimer();
+    traceEventCount = 0;
+    if (traceFormat == TRACE_CHROME)
+        fprintf(traceFile, "{\"traceEvents\":[");
+    atexit(traceClose);
+    return 0;
+}
+
+/* traceClose - finish the trace file */
+void traceClose(void)
+{
+    if (traceFile) {
+        if (traceFormat == TRACE_CHROME)
+            fprintf(traceFile, "\n],\"displayTimeUnit\":\"ms\"}\n");
+        fclose(traceFile);
+        traceFile = NULL;
+    }
+}
+
+int traceEnabled(void)
+{
+    return traceFile != NULL;
+}
+
+void traceBegin(const char *name, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    traceEvent(name, "B", fmt, ap);
+    va_end(ap);
+}
+
+void traceEnd(const char *name, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    traceEvent(name, "E", fmt, ap);
+    va_end(ap);
+}
+
+void traceInstant(const char *name, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    traceEvent(name, "i", fmt, ap);
+    va_end(ap);
+}
+
+static void traceEvent(const char *name, const char *phase, const char *fmt, va_list ap)
+{
+    uint64_t ts;
+
+    if (!traceFile)
+        return;
+
+    std::lock_guard<std::mutex> lock(traceMutex);
+    if (!traceThreadId)
+        traceThreadId = ++traceThreadCount;
+
+    ts = MicrosecondTimer() - traceStartTime;
+
+    if (traceFormat == TRACE_CHROME)
+        fprintf(traceFile, "%s\n", traceEventCount > 0 ? "," : "");
+
+    fprintf(traceFile, "{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%llu,\"pid\":1,\"tid\":%d", name, phase, (unsigned long long)ts, traceThreadId);
+    if (*phase == 'i')
+        fprintf(traceFile, ",\"s\":\"t\"");
+    if (fmt) {
+        fprintf(traceFile, ",\"args\":{");
+        vfprintf(traceFile, fmt, ap);
+        fprintf(traceFile, "}");
+    }
+    fprintf(traceFile, "}");
+
+    if (traceFormat == TRACE_JSON_LINES)
+        fprintf(traceFile, "\n");
+
+    ++traceEventCount;
+}
@@ -0,0 +1,63 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdarg.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+
+Timing trace of the phases of a load. When a trace file is open, every event is written with a monotonic
+timestamp in microseconds relative to the moment the trace was opened. Each event has a name, a phase
+("B" begin, "E" end or "i" instant) and optional arguments given as a printf format that expands to the
+members of a JSON object, for example:
+
+    traceInstant("packet-retry", "\"id\":%d,\"attempt\":%d", id, attempt);
+
+The events are the same in both formats. TRACE_JSON_LINES writes one JSON object per line.
+TRACE_CHROME wraps them in the Chrome trace-event format so the file can be loaded into
+chrome://tracing or Perfetto.
+
+*/
+
+typedef enum {
+    TRACE_JSON_LINES,
+    TRACE_CHROME
+} TraceFormat;
+
+int traceOpen(const char *path, TraceFormat format);
+void traceClose(void);
+int traceEnabled(void);
+void traceBegin(const char *name, const char *fmt, ...);
+void traceEnd(const char *name, const char *fmt, ...);
+void traceInstant(const char *name, const char *fmt, ...);
+
+#ifdef __cplusplus
+}
+
+/* TraceSpan - emit a begin event now and the matching end event when the span goes out of scope */
+class TraceSpan {
+public:
+    TraceSpan(const char *name) : m_name(name) { traceBegin(name, NULL); }
+    ~TraceSpan() { traceEnd(m_name, NULL); }
+private:
+    const char *m_name;
+};
+
+/* TracePhases - a sequence of consecutive spans where beginning one phase ends the previous one */
+class TracePhases {
+public:
+    TracePhases() : m_name(NULL) {}
+    ~TracePhases() { end(); }
+    void begin(const char *name) { end(); m_name = name; traceBegin(name, NULL); }
+    void end() { if (m_name) { traceEnd(m_name, NULL); m_name = NULL; } }
+private:
+    const char *m_name;
+};
+
+#endif
+
+#endif
@@ -4,6 +4,7 @@
 #include "wifipropconnection.h"
 #include "loader.h"
 #include "proploader.h"
+#include "trace.h"
 
 #define CALIBRATE_DELAY 10
 
@@ -508,6 +509,7 @@ int WiFiPropConnection::setResetMethod(const char *method)
 
 int WiFiPropConnection::generateResetSignal()
 {
+    TraceSpan span("reset");
     uint8_t buffer[1024];
     int hdrCnt, result;
     
@@ -531,21 +533,27 @@ int WiFiPropConnection::sendData(const uint8_t *buf, int len)
 {
     if (!isOpen())
         return -1;
-    return SendSocketData(m_telnetSocket, buf, len);
+    int cnt = SendSocketData(m_telnetSocket, buf, len);
+    m_stats.addWireBytes(cnt);
+    return cnt;
 }
 
 int WiFiPropConnection::receiveDataTimeout(uint8_t *buf, int len, int timeout)
 {
     if (!isOpen())
         return -1;
-    return ReceiveSocketDataTimeout(m_telnetSocket, buf, len, timeout);
+    int cnt = ReceiveSocketDataTimeout(m_telnetSocket, buf, len, timeout);
+    m_stats.addWireBytes(cnt);
+    return cnt;
 }
 
 int WiFiPropConnection::receiveDataExactTimeout(uint8_t *buf, int len, int timeout)
 {
     if (!isOpen())
         return -1;
-    return ReceiveSocketDataExactTimeout(m_telnetSocket, buf, len, timeout);
+    int cnt = ReceiveSocketDataExactTimeout(m_telnetSocket, buf, len, timeout);
+    m_stats.addWireBytes(cnt);
+    return cnt;
 }
 
 int WiFiPropConnection::setBaudRate(int baudRate)
@@ -584,10 +592,18 @@ int WiFiPropConnection::terminal(bool checkForExit, bool pstMode)
 
 int WiFiPropConnection::sendRequest(uint8_t *req, int reqSize, uint8_t *res, int resMax, int *pResult)
 {
+    TraceSpan span("http-request");
     SOCKET sock;
     char buf[80];
     int cnt;
     
+    if (traceEnabled()) {
+        int len = 0;
+        while (len < reqSize && len < (int)sizeof(buf) - 1 && req[len] != '\r' && req[len] != '"' && req[len] != '\\')
+            ++len;
+        traceInstant("http-request-line", "\"request\":\"%.*s\",\"bytes\":%d", len, (char *)req, reqSize);
+    }
+    
     if (ConnectSocketTimeout(&m_httpAddr, CONNECT_TIMEOUT, &sock) != 0) {
         message("Connect failed");
         return -1;
@@ -604,8 +620,11 @@ int WiFiPropConnection::sendRequest(uint8_t *req, int reqSize, uint8_t *res, int
         return -1;
     }
     
+    m_stats.addWireBytes(reqSize);
+    
     cnt = ReceiveSocketDataTimeout(sock, res, resMax, RESPONSE_TIMEOUT);
     CloseSocket(sock);
+    m_stats.addWireBytes(cnt);
 
     if (cnt == -1) {
         message("Receive response failed");
@@ -0,0 +1,137 @@
+#!/bin/sh
+#
+# bench.sh - time proploader against simulated targets and report the results as CSV
+#
+# usage: bench.sh <bindir> <workdir> [ <blink.binary> ]
+#
+# The scenarios run over every combination of these (space separated) settings:
+#
+#   BENCH_BAUDS         fast loader and SD helper baud rates (default "230400 460800 921600")
+#   BENCH_RTTS          round-trip latency added by the target in milliseconds (default "0 10")
+#   BENCH_TRANSPORTS    serial and/or wifi (default "serial wifi")
+#
+# The Wi-Fi module is emulated on BENCH_WIFI_ADDR (default 127.0.0.1) ports 80 and 23. The wifi
+# runs are skipped if those ports can't be used. BENCH_SD_SIZE sets the size of the SD card file.
+#
+
+BINDIR=$1
+WORKDIR=$2
+BLINK=$3
+
+if [ -z "$BINDIR" ] || [ -z "$WORKDIR" ]; then
+    echo "usage: bench.sh <bindir> <workdir> [ <blink.binary> ]" >&2
+    exit 1
+fi
+
+PROPLOADER=$BINDIR/proploader
+PROPSIM=$BINDIR/propsim
+BENCHIMG=$BINDIR/benchimg
+
+BAUDS=${BENCH_BAUDS:-"230400 460800 921600"}
+RTTS=${BENCH_RTTS:-"0 10"}
+TRANSPORTS=${BENCH_TRANSPORTS:-"serial wifi"}
+WIFI_ADDR=${BENCH_WIFI_ADDR:-127.0.0.1}
+SD_SIZE=${BENCH_SD_SIZE:-1048576}
+
+PTY=$WORKDIR/ttyPROPSIM
+SDDIR=$WORKDIR/sd
+SIMLOG=$WORKDIR/propsim.log
+SIMPID=
+
+mkdir -p "$WORKDIR" "$SDDIR" || exit 1
+
+# generate the images
+if [ -z "$BLINK" ] || [ ! -f "$BLINK" ]; then
+    BLINK=$WORKDIR/blink.binary
+    "$BENCHIMG" spin 128 "$BLINK" || exit 1
+fi
+"$BENCHIMG" spin 32752 "$WORKDIR/full.binary" || exit 1
+ELF_BYTES=$("$BENCHIMG" elf "$WORKDIR/gaps.elf") || exit 1
+"$BENCHIMG" data "$SD_SIZE" "$WORKDIR/sd.dat" || exit 1
+
+stop_sim() {
+    if [ -n "$SIMPID" ]; then
+        kill "$SIMPID" 2>/dev/null
+        wait "$SIMPID" 2>/dev/null
+        SIMPID=
+    fi
+}
+
+# start_sim <transport> <rtt> - start a simulated target and wait until it's ready
+start_sim() {
+    rm -f "$WORKDIR/propsim.ready"
+    if [ "$1" = serial ]; then
+        "$PROPSIM" -p "$PTY" -r "$2" -s "$SDDIR" > "$WORKDIR/propsim.ready" 2> "$SIMLOG" &
+    else
+        "$PROPSIM" -w "$WIFI_ADDR" -r "$2" -s "$SDDIR" > "$WORKDIR/propsim.ready" 2> "$SIMLOG" &
+    fi
+    SIMPID=$!
+    tries=0
+    while ! grep -q ready "$WORKDIR/propsim.ready" 2>/dev/null; do
+        if ! kill -0 "$SIMPID" 2>/dev/null || [ $tries -ge 50 ]; then
+            stop_sim
+            return 1
+        fi
+        sleep 0.1
+        tries=$((tries + 1))
+    done
+    return 0
+}
+
+# date +%N is GNU only so the clock is read through perl, which BSD and macOS have too
+now_ns() {
+    perl -MTime::HiRes=time -e 'printf "%.0f\n", time * 1e9'
+}
+
+trap 'stop_sim; exit 1' INT TERM
+
+echo "scenario,transport,baud,rtt_ms,bytes,seconds,bytes_per_sec,result"
+
+for transport in $TRANSPORTS; do
+    case $transport in
+    serial) target="-p $PTY" ;;
+    wifi)   target="-i $WIFI_ADDR" ;;
+    *)      echo "unknown transport: $transport" >&2; continue ;;
+    esac
+
+    for rtt in $RTTS; do
+        if ! start_sim "$transport" "$rtt"; then
+            echo "skipping $transport: can't start the simulated target ($(cat "$SIMLOG"))" >&2
+            break
+        fi
+
+        for baud in $BAUDS; do
+            for scenario in blink full elf eeprom sd; do
+                case $scenario in
+                blink)  args="$BLINK -r";                       bytes=$(wc -c < "$BLINK") ;;
+                full)   args="$WORKDIR/full.binary -r";         bytes=$(wc -c < "$WORKDIR/full.binary") ;;
+                elf)    args="$WORKDIR/gaps.elf -r";            bytes=$ELF_BYTES ;;
+                eeprom) args="$WORKDIR/full.binary -e";         bytes=$(wc -c < "$WORKDIR/full.binary") ;;
+                sd)     args="-f $WORKDIR/sd.dat";              bytes=$SD_SIZE; rm -f "$SDDIR/sd.dat" ;;
+                esac
+                bytes=$((bytes + 0))
+
+                echo "$scenario $transport $baud baud $rtt ms" >&2
+                start=$(now_ns)
+                # shellcheck disable=SC2086
+                if "$PROPLOADER" $target $args -D fast-loader-baud-rate="$baud" -D baud-rate="$baud" > "$WORKDIR/proploader.log" 2>&1; then
+                    result=ok
+                else
+                    result=failed
+                fi
+                end=$(now_ns)
+                if [ "$scenario" = sd ] && [ "$result" = ok ] && ! cmp -s "$WORKDIR/sd.dat" "$SDDIR/sd.dat"; then
+                    result=mismatch
+                fi
+
+                awk -v s="$scenario" -v t="$transport" -v b="$baud" -v r="$rtt" -v n="$bytes" \
+                    -v start="$start" -v end="$end" -v res="$result" 'BEGIN {
+                    secs = (end - start) / 1e9
+                    printf "%s,%s,%s,%s,%d,%.3f,%.0f,%s\n", s, t, b, r, n, secs, (secs > 0 ? n / secs : 0), res
+                }'
+            done
+        done
+
+        stop_sim
+    done
+done
@@ -0,0 +1,222 @@
+/* benchimg - generate the images used by the benchmark suite
+
+  benchimg spin <size> <outfile>    a valid Spin binary of <size> bytes (at most 32752)
+  benchimg elf <outfile>            an ELF file with several loadable segments separated by gaps
+                                    and print the size of the image the loader sends for it
+  benchimg data <size> <outfile>    <size> bytes of file data for the SD card
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define HUB_SIZE            32768
+#define SPIN_HDR_SIZE       16
+#define ELF_HDR_SIZE        52
+#define ELF_PHDR_SIZE       32
+#define ELF_SHDR_SIZE       40
+
+/* loadable segments of the ELF image: address and size */
+static const uint32_t elfSegments[][2] = {
+    { 0x0000, 0x1000 },
+    { 0x2000, 0x1800 },
+    { 0x5000, 0x2000 }
+};
+#define ELF_SEGMENT_COUNT   ((int)(sizeof(elfSegments) / sizeof(elfSegments[0])))
+
+static const char elfStrings[] = "\0.shstrtab\0.text\0.data\0.hub";
+
+static uint32_t seed = 0x12345678;
+
+/* fill - pseudo-random bytes with some repetition, roughly like code and data */
+static void fill(uint8_t *buf, int size)
+{
+    int i;
+    for (i = 0; i < size; ++i) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        buf[i] = (seed & 0x300) ? (uint8_t)seed : 0;
+    }
+}
+
+static void setWord(uint8_t *buf, uint16_t value)
+{
+     buf[1] = value >>  8;
+     buf[0] = value;
+}
+
+static void setLong(uint8_t *buf, uint32_t value)
+{
+     buf[3] = value >> 24;
+     buf[2] = value >> 16;
+     buf[1] = value >>  8;
+     buf[0] = value;
+}
+
+/* spinHeader - setup a Spin header for an image that ends at vbase and update its checksum */
+static void spinHeader(uint8_t *image, int vbase)
+{
+    uint8_t chksum = 0xEC; /* the initial call frame: 0xFF * 6 + 0xF9 * 2 */
+    int i;
+    setLong(&image[0], 80000000);
+    image[4] = 0x6F;
+    image[5] = 0;
+    setWord(&image[6], 0x0010);
+    setWord(&image[8], vbase);
+    setWord(&image[10], vbase + 8);
+    setWord(&image[12], 0x0018);
+    setWord(&image[14], vbase + 12);
+    for (i = 0; i < vbase; ++i)
+        chksum += image[i];
+    image[5] = -chksum;
+}
+
+static int writeFile(const char *path, const uint8_t *buf, int size)
+{
+    FILE *fp;
+    if (!(fp = fopen(path, "wb"))) {
+        fprintf(stderr, "error: can't create: %s\n", path);
+        return -1;
+    }
+    if (fwrite(buf, 1, size, fp) != (size_t)size) {
+        fprintf(stderr, "error: can't write: %s\n", path);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+static int makeSpin(int size, const char *path)
+{
+    uint8_t image[HUB_SIZE];
+    size &= ~3;
+    if (size <= SPIN_HDR_SIZE || size > HUB_SIZE - 16) {
+        fprintf(stderr, "error: spin image size must be between %d and %d\n", SPIN_HDR_SIZE + 4, HUB_SIZE - 16);
+        return -1;
+    }
+    fill(image, size);
+    spinHeader(image, size);
+    return writeFile(path, image, size);
+}
+
+static int makeElf(const char *path)
+{
+    int dataOffset = ELF_HDR_SIZE + ELF_SEGMENT_COUNT * ELF_PHDR_SIZE;
+    int stringOffset, shdrOffset, fileSize, offset, i;
+    uint8_t *elf, *p;
+
+    fileSize = dataOffset;
+    for (i = 0; i < ELF_SEGMENT_COUNT; ++i)
+        fileSize += elfSegments[i][1];
+    stringOffset = fileSize;
+    fileSize += sizeof(elfStrings);
+    fileSize = (fileSize + 3) & ~3;
+    shdrOffset = fileSize;
+    fileSize += (ELF_SEGMENT_COUNT + 2) * ELF_SHDR_SIZE;
+
+    if (!(elf = (uint8_t *)calloc(1, fileSize))) {
+        fprintf(stderr, "error: insufficient memory\n");
+        return -1;
+    }
+
+    /* elf header */
+    memcpy(elf, "\177ELF\001\001\001", 7);
+    setWord(&elf[16], 2);                                   /* type: executable */
+    setWord(&elf[18], 0x5072);                              /* machine: propeller */
+    setLong(&elf[20], 1);                                   /* version */
+    setLong(&elf[28], ELF_HDR_SIZE);                        /* phoff */
+    setLong(&elf[32], shdrOffset);                          /* shoff */
+    setWord(&elf[40], ELF_HDR_SIZE);                        /* ehsize */
+    setWord(&elf[42], ELF_PHDR_SIZE);                       /* phentsize */
+    setWord(&elf[44], ELF_SEGMENT_COUNT);                   /* phnum */
+    setWord(&elf[46], ELF_SHDR_SIZE);                       /* shentsize */
+    setWord(&elf[48], ELF_SEGMENT_COUNT + 2);               /* shnum */
+    setWord(&elf[50], 1);                                   /* shstrndx */
+
+    /* section name strings */
+    memcpy(&elf[stringOffset], elfStrings, sizeof(elfStrings));
+    p = &elf[shdrOffset + ELF_SHDR_SIZE];
+    setLong(&p[0], 1);
+    setLong(&p[4], 3);                                      /* type: strtab */
+    setLong(&p[16], stringOffset);
+    setLong(&p[20], sizeof(elfStrings));
+
+    /* program headers, segment contents and section headers */
+    offset = dataOffset;
+    for (i = 0; i < ELF_SEGMENT_COUNT; ++i) {
+        p = &elf[ELF_HDR_SIZE + i * ELF_PHDR_SIZE];
+        setLong(&p[0], 1);                                  /* type: load */
+        setLong(&p[4], offset);
+        setLong(&p[8], elfSegments[i][0]);                  /* vaddr */
+        setLong(&p[12], elfSegments[i][0]);                 /* paddr */
+        setLong(&p[16], elfSegments[i][1]);                 /* filesz */
+        setLong(&p[20], elfSegments[i][1]);                 /* memsz */
+        setLong(&p[24], 7);                                 /* flags: rwx */
+        setLong(&p[28], 4);                                 /* align */
+
+        fill(&elf[offset], elfSegments[i][1]);
+
+        p = &elf[shdrOffset + (i + 2) * ELF_SHDR_SIZE];
+        setLong(&p[0], 11 + i * 6);                         /* .text, .data or .hub */
+        setLong(&p[4], 1);                                  /* type: progbits */
+        setLong(&p[8], 6);                                  /* flags: alloc, execute */
+        setLong(&p[12], elfSegments[i][0]);
+        setLong(&p[16], offset);
+        setLong(&p[20], elfSegments[i][1]);
+        setLong(&p[32], 4);
+
+        offset += elfSegments[i][1];
+    }
+
+    /* the loader fills in the rest of the spin header */
+    setLong(&elf[dataOffset], 80000000);
+    elf[dataOffset + 4] = 0x6F;
+    setWord(&elf[dataOffset + 6], 0x0010);
+    setWord(&elf[dataOffset + 12], 0x0018);
+
+    i = writeFile(path, elf, fileSize);
+    free(elf);
+
+    /* the loader sends the segments with the gaps between them filled in */
+    if (i == 0)
+        printf("%u\n", (unsigned)(elfSegments[ELF_SEGMENT_COUNT - 1][0] + elfSegments[ELF_SEGMENT_COUNT - 1][1] - elfSegments[0][0]));
+    return i;
+}
+
+static int makeData(int size, const char *path)
+{
+    uint8_t *data;
+    int sts;
+    if (size <= 0 || !(data = (uint8_t *)malloc(size))) {
+        fprintf(stderr, "error: bad data size: %d\n", size);
+        return -1;
+    }
+    fill(data, size);
+    sts = writeFile(path, data, size);
+    free(data);
+    return sts;
+}
+
+int main(int argc, char *argv[])
+{
+    int sts;
+
+    if (argc == 4 && strcmp(argv[1], "spin") == 0)
+        sts = makeSpin(atoi(argv[2]), argv[3]);
+    else if (argc == 3 && strcmp(argv[1], "elf") == 0)
+        sts = makeElf(argv[2]);
+    else if (argc == 4 && strcmp(argv[1], "data") == 0)
+        sts = makeData(atoi(argv[2]), argv[3]);
+    else {
+        fprintf(stderr, "\
+usage: benchimg spin <size> <outfile>\n\
+       benchimg elf <outfile>\n\
+       benchimg data <size> <outfile>\n");
+        exit(1);
+    }
+
+    return sts == 0 ? 0 : 1;
+}
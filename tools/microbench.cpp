@@ -0,0 +1,272 @@
+/* microbench - time the CPU-side work done for every load
+
+  usage: microbench [ -t <ms> ] [ <kernel>... ]
+
+  Each kernel is run repeatedly for about <ms> milliseconds (default 200) and reported as
+  nanoseconds per call, nanoseconds per byte processed and heap allocations per call.
+  Allocations are counted by wrapping malloc, calloc and realloc at link time and aren't
+  available on platforms whose linker doesn't support that.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include "loader.h"
+#include "propimage.h"
+#include "serialpropconnection.h"
+#include "config.h"
+#include "crc16.h"
+#include "lz4.h"
+#include "deadline.h"
+
+#define IMAGE_SIZE          32752       /* a full Spin image */
+#define PACKET_SIZE         1024        /* an SD helper packet */
+#define BLOCK_SIZE          4096        /* an SD file block compressed into a packet */
+#define ENCODED_SIZE        (MAX_IMAGE_SIZE * 3)
+
+static long allocations = 0;
+
+#ifdef COUNT_ALLOCATIONS
+extern "C" {
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    ++allocations;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    ++allocations;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    ++allocations;
+    return __real_realloc(ptr, size);
+}
+}
+
+/* route C++ allocations through the wrapped malloc so they're counted too */
+void *operator new(size_t size)
+{
+    void *ptr;
+    if (!(ptr = malloc(size ? size : 1)))
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+#endif
+
+typedef struct {
+    const char *name;
+    void (*run)(void);
+    int bytesPerCall;
+} Kernel;
+
+static uint8_t image[MAX_IMAGE_SIZE];
+static uint8_t encoded[ENCODED_SIZE];
+static BoardConfig *config;
+static volatile int32_t sink;
+
+static const char expression[] = "({clkfreq} / 4 + 1k) * 3 - ({fast-loader-baud-rate} >> 2) + 0x10 * ({rxpin} & 7)";
+
+static void runEncodeBytes(void)
+{
+    sink = EncodeBytes(image, IMAGE_SIZE, encoded, sizeof(encoded));
+}
+
+static void runCRC16(void)
+{
+    static const uint8_t zeros[2] = { 0, 0 };
+    uint16_t crc = UpdateCRC16(0, image, PACKET_SIZE);
+    sink = UpdateCRC16(crc, zeros, sizeof(zeros));
+}
+
+static void runCompressLZ4(void)
+{
+    static uint8_t compressed[BLOCK_SIZE];
+    sink = CompressLZ4(image, BLOCK_SIZE, compressed, sizeof(compressed));
+}
+
+static void runSumBytes(void)
+{
+    sink = PropImage::sumBytes(image, IMAGE_SIZE);
+}
+
+static void runUpdateChecksum(void)
+{
+    PropImage::updateChecksum(image, IMAGE_SIZE);
+}
+
+static void runPatch(void)
+{
+    static PropImage img(image, IMAGE_SIZE);
+    static uint32_t serial = 0;
+    img.patch(IMAGE_SIZE / 2, ++serial, sizeof(uint32_t));
+    sink = img.loadChecksum();
+}
+
+static void runValidate(void)
+{
+    sink = PropImage::validate(image, IMAGE_SIZE);
+}
+
+static void runGenerateLoaderImage(void)
+{
+    uint8_t *loaderImage;
+    int length;
+    if ((loaderImage = Loader::generateInitialLoaderImage(80000000, 0x6F, 32, 115200, 921600, &length)) != NULL) {
+        sink = length;
+        free(loaderImage);
+    }
+}
+
+static void runNumericConfigField(void)
+{
+    int value;
+    if (GetNumericConfigField(config, "bench-expression", &value))
+        sink = value;
+}
+
+static Kernel kernels[] = {
+    { "EncodeBytes",                    runEncodeBytes,             IMAGE_SIZE              },
+    { "UpdateCRC16",                    runCRC16,                   PACKET_SIZE + 2         },
+    { "CompressLZ4",                    runCompressLZ4,             BLOCK_SIZE              },
+    { "PropImage::sumBytes",            runSumBytes,                IMAGE_SIZE              },
+    { "PropImage::updateChecksum",      runUpdateChecksum,          IMAGE_SIZE              },
+    { "PropImage::patch",               runPatch,                   sizeof(uint32_t)        },
+    { "PropImage::validate",            runValidate,                IMAGE_SIZE              },
+    { "generateInitialLoaderImage",     runGenerateLoaderImage,     0                       },
+    { "GetNumericConfigField",          runNumericConfigField,      sizeof(expression) - 1  },
+    { NULL,                             NULL,                       0                       }
+};
+
+/* setup - a full-sized Spin image with a valid checksum and a configuration with an expression */
+static void setup(void)
+{
+    SpinHdr *hdr = (SpinHdr *)image;
+    uint32_t seed = 0x12345678;
+    uint16_t crc;
+    int i;
+
+    for (i = 0; i < IMAGE_SIZE; ++i) {
+        seed = seed * 1103515245 + 12345;
+        image[i] = seed >> 16;
+    }
+    memset(image, 0, sizeof(SpinHdr));
+    hdr->clkfreq = 80000000;
+    hdr->clkmode = 0x6F;
+    hdr->pbase = 0x0010;
+    hdr->vbase = IMAGE_SIZE;
+    hdr->dbase = IMAGE_SIZE + 8;
+    hdr->pcurr = 0x0018;
+    hdr->dcurr = IMAGE_SIZE + 12;
+    PropImage::updateChecksum(image, IMAGE_SIZE);
+
+    config = NewBoardConfig(ParseConfigurationFile(DEF_BOARD), "bench");
+    SetConfigField(config, "clkfreq", "80000000");
+    SetConfigField(config, "bench-expression", expression);
+
+    /* make sure the kernels do the real work rather than failing early */
+    if (PropImage::validate(image, IMAGE_SIZE) != 0 || !GetNumericConfigField(config, "bench-expression", &i)) {
+        fprintf(stderr, "error: benchmark setup failed\n");
+        exit(1);
+    }
+
+    /* make sure the multi-byte crc matches the byte at a time crc */
+    for (i = 0, crc = 0; i < PACKET_SIZE + 3; ++i)
+        crc = UpdateCRC16(crc, &image[i], 1);
+    if (UpdateCRC16(0, image, PACKET_SIZE + 3) != crc) {
+        fprintf(stderr, "error: UpdateCRC16 mismatch\n");
+        exit(1);
+    }
+}
+
+static void measure(Kernel *kernel, int targetMs)
+{
+    uint64_t start, elapsed;
+    long calls = 0, allocs;
+    double nsPerCall;
+
+    /* warm up and count the allocations for a single call */
+    allocs = allocations;
+    kernel->run();
+    allocs = allocations - allocs;
+
+    start = MicrosecondTimer();
+    do {
+        for (int i = 0; i < 16; ++i)
+            kernel->run();
+        calls += 16;
+        elapsed = MicrosecondTimer() - start;
+    } while (elapsed < (uint64_t)targetMs * 1000);
+
+    nsPerCall = elapsed * 1000.0 / calls;
+    printf("%-30s %8d %12.1f", kernel->name, kernel->bytesPerCall, nsPerCall);
+    if (kernel->bytesPerCall > 0)
+        printf(" %9.3f", nsPerCall / kernel->bytesPerCall);
+    else
+        printf(" %9s", "-");
+#ifdef COUNT_ALLOCATIONS
+    printf(" %12ld\n", allocs);
+#else
+    printf(" %12s\n", "-");
+#endif
+}
+
+static void usage(const char *progname)
+{
+    Kernel *kernel;
+    printf("usage: %s [ -t <ms> ] [ <kernel>... ]\n\nkernels:\n", progname);
+    for (kernel = kernels; kernel->name; ++kernel)
+        printf("    %s\n", kernel->name);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int targetMs = 200, selected = 0, i;
+    Kernel *kernel;
+
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-t") == 0) {
+            if (++i >= argc || (targetMs = atoi(argv[i])) <= 0)
+                usage(argv[0]);
+        }
+        else if (argv[i][0] == '-')
+            usage(argv[0]);
+        else
+            ++selected;
+    }
+
+    setup();
+
+    printf("%-30s %8s %12s %9s %12s\n", "kernel", "bytes", "ns/call", "ns/byte", "allocs/call");
+    for (kernel = kernels; kernel->name; ++kernel) {
+        bool run = selected == 0;
+        for (i = 1; i < argc && !run; ++i)
+            if (strcmp(argv[i], "-t") == 0)
+                ++i;
+            else if (strcmp(argv[i], kernel->name) == 0)
+                run = true;
+        if (run)
+            measure(kernel, targetMs);
+    }
+
+    return 0;
+}
@@ -0,0 +1,1628 @@
+/* propsim - simulated Propeller targets for exercising and benchmarking PropLoader
+
+  The simulator models a Propeller 1 well enough to complete every kind of download PropLoader does:
+
+    - the ROM boot loader protocol (handshake, command, image, checksum and EEPROM polling),
+    - the second-stage IP_Loader packet protocol including its executable packets,
+    - the SD helper's packet driver and file writes and reads,
+    - a Parallax Wi-Fi module's HTTP (port 80) and transparent telnet (port 23) services.
+
+  The serial target is a pseudo-terminal. A pty has no modem control lines so a reset can't be seen
+  directly. Instead the ROM handshake is recognized whenever it begins where a new packet could begin.
+
+  Nothing on a pty or a loopback socket takes real transmission time, so every byte is delayed by its
+  serialization time at the current baud rate plus an optional injected round-trip latency. Device
+  timing (EEPROM page writes, SD card writes and the helper's startup delay) is modelled the same way.
+*/
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "lz4.h"
+
+/* generated from spin/IP_Loader.spin by split */
+#include "IP_Loader.h"
+
+/* generated from spin/sd_helper.spin by bin2c */
+extern uint8_t sd_helper_array[];
+extern int sd_helper_size;
+
+#define HUB_SIZE                32768
+#define EEPROM_SIZE             65536       /* a 24LC512 */
+#define EEPROM_PAGE_SIZE        64
+#define I2C_BITS_PER_MS         400         /* 400 KHz I2C bus */
+
+#define ROM_HANDSHAKE_BITS      250
+#define ROM_PREAMBLE_PULSES     768         /* 2 calibration + 250 handshake + 500 rx templates + 16 version templates */
+#define ROM_RX_BYTES            129         /* 125 handshake bytes + 4 version bytes */
+#define ROM_VERSION             1
+
+#define LOADER_INIT_FROM_END    (10 * 4 + 8)
+#define EEPROM_REGION_FROM_END  (5 * 4)     /* host-set region values at the end of programVerifyEEPROM */
+#define READ_BLOCK_SIZE         (128 * 4)   /* data bytes in each block the loader sends when reading memory */
+#define LOADER_FAILSAFE_MS      2000
+#define LOADER_MAX_DATA         1024
+#define LOADER_PACKET_GAP_MS    1.0         /* end of packet timeout for packets of unknown size */
+
+#define HELPER_STARTUP_MS       500         /* waitcnt(CLKFREQ / 2 + CNT) in sd_helper.spin */
+#define HELPER_MOUNT_MS         100
+#define HELPER_OPEN_CLOSE_MS    10
+#define HELPER_HASH_RATE        100         /* SD card read and crc32 throughput (bytes per ms) */
+#define HELPER_READ_RATE        400         /* SD card read throughput (bytes per ms) */
+#define HELPER_HDR_LEN          6
+#define HELPER_DATA_MAX         4096        /* rxsize in packet_driver.spin */
+#define HELPER_FRAME_MAX        (HELPER_HDR_LEN + HELPER_DATA_MAX + 2)
+
+#define HELPER_TYPE_FILE_WRITE  0
+#define HELPER_TYPE_DATA        1
+#define HELPER_TYPE_EOF         2
+#define HELPER_TYPE_FILE_STAT   3
+#define HELPER_TYPE_DATA_LZ     4
+#define HELPER_TYPE_FILE_READ   5
+#define HELPER_TYPE_DIR_LIST    6
+
+#define SOH                     0x01
+#define ACK                     0x06
+#define NAK                     0x15
+
+#define HTTP_PORT               80
+#define TELNET_PORT             23
+#define HTTP_MAX_REQUEST        (4096 + HUB_SIZE)
+
+static const uint8_t initCallFrame[] = {0xFF, 0xFF, 0xF9, 0xFF, 0xFF, 0xFF, 0xF9, 0xFF};
+
+/* first bytes of every ROM download stream (timing template and the start of the handshake) */
+static const uint8_t romSignature[] = {0x49, 0xAA, 0x52, 0xA5};
+
+/* a byte stream between the host and the target */
+typedef struct {
+    const char *name;
+    int fd;
+    int termiosFd;      /* pty slave used to read the baud rate the host selected (-1 if none) */
+    int baudRate;
+    int prevBaudRate;   /* baud rate before the last change (data read just after a change may have been sent at either) */
+    double rxFree;      /* time at which the simulated line has delivered everything received so far */
+    double txFree;      /* time at which the simulated line has sent everything queued so far */
+} Link;
+
+/* delayed input or output */
+typedef struct Event {
+    struct Event *next;
+    double due;
+    int output;         /* output to the link's fd if true; input to the target if false */
+    Link *link;
+    int fd;             /* fd to write output to (the link's fd or an HTTP connection) */
+    int closeAfter;     /* close fd after writing (HTTP responses) */
+    int baudRate[2];    /* possible baud rates the input was sent at */
+    int len;
+    uint8_t data[1];
+} Event;
+
+typedef enum {
+    TS_ROM,             /* ROM boot loader waiting for or decoding a download stream */
+    TS_ROM_REPLY,       /* ROM boot loader answering handshake and checksum polls */
+    TS_IGNORING,        /* handshake failed or shutdown; ignore everything until the next reset */
+    TS_LOADER,          /* IP_Loader second-stage loader */
+    TS_HELPER,          /* SD helper packet driver */
+    TS_RUNNING          /* some other program is running */
+} TargetState;
+
+typedef enum {
+    RF_COMMAND,
+    RF_LENGTH,
+    RF_IMAGE,
+    RF_DONE
+} RomField;
+
+typedef struct {
+    TargetState state;
+    Link *link;                     /* where output goes */
+    uint8_t *capture;               /* when set, output is collected here instead (Wi-Fi load requests) */
+    int captureLen, captureMax;
+    uint8_t hub[HUB_SIZE];
+    uint8_t eeprom[EEPROM_SIZE];
+    int baudRate;                   /* baud rate the target is using (0 for the auto-bauding ROM) */
+    int inputBaudRate[2];           /* baud rates the current input may have been sent at */
+
+    /* ROM boot loader */
+    int romPulses;
+    int romLowRun;
+    RomField romField;
+    int romFieldBits;
+    uint32_t romValue;
+    uint32_t romCommand;
+    uint32_t romLongs;
+    int romImageBits;
+    int romRxSent;
+    double romReadyAt[3];
+    uint8_t romReplies[3];
+    int romReplyCount, romReplyIndex;
+
+    /* IP_Loader */
+    int32_t expectedID;
+    int32_t checksum;
+    uint32_t memAddr;
+    int fastBaudRate;
+    uint8_t packet[8 + HUB_SIZE];
+    int packetLen;
+    double packetDeadline;
+    double lastPacketTime;
+    int readyToLaunch;
+
+    /* SD helper */
+    int sdMounted;
+    FILE *sdFile;
+    uint8_t frame[HELPER_FRAME_MAX];
+    int frameLen;
+    double helperFree;
+    int helperFrames;
+    int helperExpected;
+    long helperBytes;
+} Target;
+
+static Event *events = NULL;
+static Target target;
+static Link serialLink = { "serial", -1, -1, 115200, 115200, 0, 0 };
+static Link telnetLink = { "telnet", -1, -1, 115200, 115200, 0, 0 };
+static double startTime;
+static int verbose = 0;
+static double latency = 0;          /* injected round-trip latency (ms) */
+static double eepromCycleTime = 5;  /* EEPROM page write cycle time (ms) */
+static double sdWriteRate = 200;    /* SD card write throughput (bytes per ms) */
+static const char *sdDir = NULL;
+static uint8_t lfsrBits[2 * ROM_HANDSHAKE_BITS];
+
+static void targetReset(Target *t, const char *why);
+static void targetInput(Target *t, const uint8_t *buf, int len, double now);
+static void targetTick(Target *t, double now);
+
+static void usage(const char *progname)
+{
+    printf("\
+usage: %s [options]\n\
+\n\
+options:\n\
+    -p <link>       create a pseudo-terminal and make <link> a symbolic link to it\n\
+    -w <ip-addr>    emulate a Parallax Wi-Fi module on <ip-addr> (ports %d and %d)\n\
+    -r <ms>         add <ms> of round-trip latency to every response (default 0)\n\
+    -e <ms>         EEPROM page write cycle time (default 5)\n\
+    -k <KB/s>       SD card write throughput (default 200)\n\
+    -s <dir>        store files written to the simulated SD card in <dir>\n\
+    -v              log protocol events to stderr\n\
+", progname, HTTP_PORT, TELNET_PORT);
+    exit(1);
+}
+
+static double msTimer(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void logEvent(const char *fmt, ...)
+{
+    va_list ap;
+    if (!verbose)
+        return;
+    va_start(ap, fmt);
+    fprintf(stderr, "[%9.3f] ", (msTimer() - startTime) / 1000.0);
+    vfprintf(stderr, fmt, ap);
+    putc('\n', stderr);
+    va_end(ap);
+}
+
+static int32_t getLong(const uint8_t *buf)
+{
+     return (buf[3] << 24) | (buf[2] << 16) | (buf[1] << 8) | buf[0];
+}
+
+static void setLong(uint8_t *buf, uint32_t value)
+{
+     buf[3] = value >> 24;
+     buf[2] = value >> 16;
+     buf[1] = value >>  8;
+     buf[0] = value;
+}
+
+static int getWord(const uint8_t *buf)
+{
+     return (buf[1] << 8) | buf[0];
+}
+
+/* serializationTime - time in milliseconds to send bytes at a baud rate (8N1) */
+static double serializationTime(int byteCount, int baudRate)
+{
+    return baudRate > 0 ? byteCount * 10 * 1000.0 / baudRate : 0;
+}
+
+static void queueEvent(Event *event)
+{
+    Event **pNext = &events;
+    while (*pNext && (*pNext)->due <= event->due)
+        pNext = &(*pNext)->next;
+    event->next = *pNext;
+    *pNext = event;
+}
+
+static Event *newEvent(double due, int output, Link *link, int fd, const uint8_t *buf, int len)
+{
+    Event *event;
+    if (!(event = (Event *)malloc(sizeof(Event) + len))) {
+        fprintf(stderr, "error: insufficient memory\n");
+        exit(1);
+    }
+    memset(event, 0, sizeof(Event));
+    event->due = due;
+    event->output = output;
+    event->link = link;
+    event->fd = fd;
+    event->len = len;
+    memcpy(event->data, buf, len);
+    return event;
+}
+
+/* linkReceive - bytes from the host arrive at the target after their serialization time */
+static void linkReceive(Link *link, const uint8_t *buf, int len)
+{
+    Event *event;
+    double now = msTimer();
+    if (link->rxFree < now)
+        link->rxFree = now;
+    link->rxFree += serializationTime(len, link->baudRate);
+    event = newEvent(link->rxFree, 0, link, link->fd, buf, len);
+    event->baudRate[0] = link->baudRate;
+    event->baudRate[1] = link->prevBaudRate;
+    link->prevBaudRate = link->baudRate;
+    queueEvent(event);
+}
+
+/* linkSend - bytes from the target arrive at the host after their serialization time plus the latency */
+static void linkSend(Link *link, const uint8_t *buf, int len, double now)
+{
+    if (link->txFree < now)
+        link->txFree = now;
+    link->txFree += serializationTime(len, link->baudRate);
+    queueEvent(newEvent(link->txFree + latency, 1, link, link->fd, buf, len));
+}
+
+static void targetSend(Target *t, const uint8_t *buf, int len, double now)
+{
+    if (t->capture) {
+        if (t->captureLen + len <= t->captureMax) {
+            memcpy(t->capture + t->captureLen, buf, len);
+            t->captureLen += len;
+        }
+    }
+    else if (t->link && t->link->fd >= 0)
+        linkSend(t->link, buf, len, now);
+}
+
+/* refreshBaudRate - pick up the baud rate the host selected on the pseudo-terminal */
+static void refreshBaudRate(Link *link)
+{
+    static const struct { speed_t speed; int baudRate; } speeds[] = {
+        { B9600, 9600 }, { B19200, 19200 }, { B38400, 38400 }, { B57600, 57600 }, { B115200, 115200 },
+        { B230400, 230400 },
+#ifdef B460800
+        { B460800, 460800 },
+#endif
+#ifdef B500000
+        { B500000, 500000 },
+#endif
+#ifdef B576000
+        { B576000, 576000 },
+#endif
+#ifdef B921600
+        { B921600, 921600 },
+#endif
+#ifdef B1000000
+        { B1000000, 1000000 },
+#endif
+    };
+    struct termios params;
+    speed_t speed;
+    int i;
+    if (link->termiosFd < 0 || tcgetattr(link->termiosFd, &params) != 0)
+        return;
+    speed = cfgetospeed(&params);
+    for (i = 0; i < (int)(sizeof(speeds) / sizeof(speeds[0])); ++i) {
+        if (speeds[i].speed == speed) {
+            if (link->baudRate != speeds[i].baudRate) {
+                logEvent("%s: %d baud", link->name, speeds[i].baudRate);
+                link->prevBaudRate = link->baudRate;
+            }
+            link->baudRate = speeds[i].baudRate;
+            break;
+        }
+    }
+}
+
+/* baudRatesMatch - a receiver tolerates a few percent of bit time error */
+static int baudRatesMatch(int a, int b)
+{
+    return a <= 0 || b <= 0 || (a > b ? a - b : b - a) * 100 <= b * 3;
+}
+
+/*
+ * EEPROM timing
+ */
+
+static double eepromProgramTime(int byteCount)
+{
+    int pages = (byteCount + EEPROM_PAGE_SIZE - 1) / EEPROM_PAGE_SIZE;
+    return pages * ((3 + EEPROM_PAGE_SIZE) * 9.0 / I2C_BITS_PER_MS + eepromCycleTime);
+}
+
+static double eepromVerifyTime(int byteCount)
+{
+    return (3 + byteCount) * 9.0 / I2C_BITS_PER_MS;
+}
+
+/* eepromUpdate - like the second-stage loader, read each page and only program the ones that differ */
+static double eepromUpdate(Target *t, uint32_t address, const uint8_t *data, int byteCount, int *pChanged)
+{
+    double time = 0;
+    int offset;
+
+    *pChanged = 0;
+    for (offset = 0; offset < byteCount; offset += EEPROM_PAGE_SIZE) {
+        uint8_t *page = &t->eeprom[(address + offset) % EEPROM_SIZE];
+        time += eepromVerifyTime(EEPROM_PAGE_SIZE);
+        if (memcmp(page, &data[offset], EEPROM_PAGE_SIZE) != 0) {
+            memcpy(page, &data[offset], EEPROM_PAGE_SIZE);
+            time += eepromProgramTime(EEPROM_PAGE_SIZE);
+            ++*pChanged;
+        }
+    }
+    return time;
+}
+
+/*
+ * ROM boot loader
+ */
+
+static void initLFSR(void)
+{
+    uint8_t lfsr = 'P';
+    int i;
+    for (i = 0; i < (int)sizeof(lfsrBits); ++i) {
+        lfsrBits[i] = lfsr & 0x01;
+        lfsr = ((lfsr << 1) & 0xFE) | (((lfsr >> 7) ^ (lfsr >> 5) ^ (lfsr >> 4) ^ (lfsr >> 1)) & 1);
+    }
+}
+
+/* romRxByte - the i'th byte of the handshake and version the ROM sends back, two bits per byte */
+static uint8_t romRxByte(int i)
+{
+    int bit0, bit1;
+    if (i < ROM_HANDSHAKE_BITS / 2) {
+        bit0 = lfsrBits[ROM_HANDSHAKE_BITS + i * 2];
+        bit1 = lfsrBits[ROM_HANDSHAKE_BITS + i * 2 + 1];
+    }
+    else {
+        i -= ROM_HANDSHAKE_BITS / 2;
+        bit0 = (ROM_VERSION >> (i * 2)) & 1;
+        bit1 = (ROM_VERSION >> (i * 2 + 1)) & 1;
+    }
+    return 0xCE | bit0 | (bit1 << 5);
+}
+
+/* imageChecksum - sum of RAM after the loader clears it and inserts the initial call frame */
+static int32_t imageChecksum(uint8_t *hub)
+{
+    int dbase = getWord(&hub[10]);
+    int32_t checksum = 0;
+    int i;
+    if (dbase >= (int)sizeof(initCallFrame) && dbase <= HUB_SIZE)
+        memcpy(&hub[dbase - sizeof(initCallFrame)], initCallFrame, sizeof(initCallFrame));
+    for (i = 0; i < HUB_SIZE; ++i)
+        checksum += hub[i];
+    return checksum;
+}
+
+static void launch(Target *t, double now);
+
+static void romImageComplete(Target *t, double now)
+{
+    int imageSize = t->romLongs * 4;
+    int checksumOkay = (imageChecksum(t->hub) & 0xFF) == 0;
+    double readyAt = now;
+
+    logEvent("rom: command %d, %d byte image, checksum %s", t->romCommand, imageSize, checksumOkay ? "okay" : "bad");
+
+    t->state = TS_ROM_REPLY;
+    t->romRxSent = 0;
+    t->romReplyIndex = 0;
+    t->romReplyCount = 0;
+    t->romReplies[t->romReplyCount] = checksumOkay ? 0xFE : 0xFF;
+    t->romReadyAt[t->romReplyCount++] = readyAt;
+    if (checksumOkay && (t->romCommand == 2 || t->romCommand == 3)) {
+        readyAt += eepromProgramTime(HUB_SIZE);
+        t->romReplies[t->romReplyCount] = 0xFE;
+        t->romReadyAt[t->romReplyCount++] = readyAt;
+        readyAt += eepromVerifyTime(HUB_SIZE);
+        t->romReplies[t->romReplyCount] = 0xFE;
+        t->romReadyAt[t->romReplyCount++] = readyAt;
+        memcpy(t->eeprom, t->hub, HUB_SIZE);
+    }
+}
+
+static void romField(Target *t, double now)
+{
+    switch (t->romField) {
+    case RF_COMMAND:
+        t->romCommand = t->romValue;
+        if (t->romCommand == 0) {
+            logEvent("rom: shutdown command");
+            t->state = TS_ROM_REPLY;
+            t->romRxSent = 0;
+            t->romReplyCount = t->romReplyIndex = 0;
+            t->romField = RF_DONE;
+        }
+        else if (t->romCommand > 3) {
+            logEvent("rom: bad command %u", t->romCommand);
+            t->state = TS_IGNORING;
+        }
+        else
+            t->romField = RF_LENGTH;
+        break;
+    case RF_LENGTH:
+        t->romLongs = t->romValue;
+        if (t->romLongs == 0 || t->romLongs > HUB_SIZE / 4) {
+            logEvent("rom: bad image length %u", t->romLongs);
+            t->state = TS_IGNORING;
+        }
+        else {
+            memset(t->hub, 0, sizeof(t->hub));
+            t->romImageBits = 0;
+            t->romField = RF_IMAGE;
+        }
+        break;
+    default:
+        break;
+    }
+    t->romValue = 0;
+    t->romFieldBits = 0;
+}
+
+/* romBit - handle one bit of the download stream ("1" is a short low pulse and "0" a long one) */
+static void romBit(Target *t, int bit, double now)
+{
+    int n = t->romPulses++;
+
+    /* calibration pulses and the rx handshake timing templates */
+    if (n < 2 || (n >= 2 + ROM_HANDSHAKE_BITS && n < ROM_PREAMBLE_PULSES))
+        return;
+
+    /* host handshake */
+    if (n < 2 + ROM_HANDSHAKE_BITS) {
+        if (bit != lfsrBits[n - 2]) {
+            logEvent("rom: handshake mismatch at bit %d", n - 2);
+            t->state = TS_IGNORING;
+        }
+        return;
+    }
+
+    /* command, length and image, least significant bit first */
+    if (t->romField == RF_IMAGE) {
+        if (bit)
+            t->hub[t->romImageBits / 8] |= 1 << (t->romImageBits % 8);
+        if (++t->romImageBits == (int)t->romLongs * 32) {
+            t->romField = RF_DONE;
+            romImageComplete(t, now);
+        }
+    }
+    else if (t->romField != RF_DONE) {
+        t->romValue |= (uint32_t)bit << t->romFieldBits;
+        if (++t->romFieldBits == 32)
+            romField(t, now);
+    }
+}
+
+static void romInput(Target *t, const uint8_t *buf, int len, double now)
+{
+    int i, j;
+    for (i = 0; i < len && t->state == TS_ROM; ++i) {
+
+        /* frame is a start bit (0), eight data bits lsb first, and a stop bit (1) */
+        int frame = (buf[i] << 1) | 0x200;
+        for (j = 0; j < 10 && t->state == TS_ROM; ++j) {
+            if (frame & (1 << j)) {
+                if (t->romLowRun == 1 || t->romLowRun == 2)
+                    romBit(t, t->romLowRun == 1, now);
+                t->romLowRun = 0;
+            }
+            else
+                ++t->romLowRun;
+        }
+    }
+
+    /* anything after the end of the stream is a poll */
+    if (i < len && t->state == TS_ROM_REPLY)
+        targetInput(t, buf + i, len - i, now);
+}
+
+static void romReplyInput(Target *t, const uint8_t *buf, int len, double now)
+{
+    uint8_t byte;
+    while (--len >= 0 && t->state == TS_ROM_REPLY) {
+        ++buf;
+
+        /* clock out the handshake response and the version */
+        if (t->romRxSent < ROM_RX_BYTES) {
+            byte = romRxByte(t->romRxSent++);
+            targetSend(t, &byte, 1, now);
+            if (t->romRxSent == ROM_RX_BYTES && t->romCommand == 0)
+                t->state = TS_IGNORING;
+        }
+
+        /* answer checksum polls once the result is ready */
+        else if (t->romReplyIndex < t->romReplyCount) {
+            if (now >= t->romReadyAt[t->romReplyIndex]) {
+                byte = t->romReplies[t->romReplyIndex++];
+                targetSend(t, &byte, 1, now);
+                if (byte != 0xFE)
+                    t->state = TS_IGNORING;
+                else if (t->romReplyIndex == t->romReplyCount) {
+                    if (t->romCommand & 1)
+                        launch(t, now);
+                    else
+                        t->state = TS_IGNORING;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * IP_Loader second-stage loader
+ */
+
+static int isLoaderImage(const uint8_t *image, int imageSize)
+{
+    int initOffset = sizeof(rawLoaderImage) - LOADER_INIT_FROM_END;
+    return imageSize >= (int)sizeof(rawLoaderImage)
+        && memcmp(image + 16, rawLoaderImage + 16, initOffset - 16) == 0
+        && memcmp(image + initOffset + 40, rawLoaderImage + initOffset + 40, sizeof(rawLoaderImage) - initOffset - 40) == 0;
+}
+
+static void loaderAcknowledge(Target *t, int32_t transmissionID, double now)
+{
+    uint8_t response[8];
+    setLong(&response[0], t->expectedID);
+    setLong(&response[4], transmissionID);
+    targetSend(t, response, sizeof(response), now);
+
+    /* the failsafe timer restarts once a packet has been handled */
+    if (t->lastPacketTime < now)
+        t->lastPacketTime = now;
+}
+
+static void loaderStart(Target *t, double now)
+{
+    int initOffset = sizeof(rawLoaderImage) - LOADER_INIT_FROM_END;
+    uint32_t clockSpeed = getLong(&t->hub[0]);
+    int32_t initialBitTime = getLong(&t->hub[initOffset + 4]);
+    int32_t finalBitTime = getLong(&t->hub[initOffset + 8]);
+
+    t->state = TS_LOADER;
+    t->expectedID = getLong(&t->hub[initOffset + 36]);
+    t->baudRate = initialBitTime > 0 ? clockSpeed / initialBitTime : 0;
+    t->fastBaudRate = finalBitTime > 0 ? clockSpeed / finalBitTime : 0;
+    t->memAddr = 0;
+    t->checksum = 0;
+    t->packetLen = 0;
+    t->packetDeadline = 0;
+    t->readyToLaunch = 0;
+    memset(t->hub, 0, sizeof(t->hub));
+    logEvent("loader: started, expecting %d packets at %d baud", t->expectedID, t->fastBaudRate);
+
+    /* the first acknowledgement is the ready signal at the initial baud rate */
+    loaderAcknowledge(t, 0, now);
+    t->baudRate = t->fastBaudRate;
+    t->lastPacketTime = now;
+}
+
+static int matchesOverlay(const uint8_t *payload, int payloadSize, const uint8_t *overlay, int overlaySize)
+{
+    return payloadSize == overlaySize && memcmp(payload, overlay, overlaySize) == 0;
+}
+
+/* matchesEEPROMOverlay - the host sets the region values at the end of the EEPROM programming packet */
+static int matchesEEPROMOverlay(const uint8_t *payload, int payloadSize)
+{
+    int codeSize = sizeof(programVerifyEEPROM) - EEPROM_REGION_FROM_END;
+    return payloadSize == (int)sizeof(programVerifyEEPROM) && memcmp(payload, programVerifyEEPROM, codeSize) == 0;
+}
+
+/* loaderReadMemory - stream a range of RAM or EEPROM back to the host in blocks of offset, checksum and data */
+static void loaderReadMemory(Target *t, int read, uint32_t address, uint32_t count, int32_t nextID, int32_t transmissionID, double now)
+{
+    uint8_t block[8 + READ_BLOCK_SIZE];
+    uint32_t offset, i;
+    int32_t sum;
+    int blockSize;
+
+    for (offset = 0; offset < count; offset += blockSize) {
+        if ((blockSize = count - offset) > READ_BLOCK_SIZE)
+            blockSize = READ_BLOCK_SIZE;
+        for (sum = 0, i = 0; i < (uint32_t)blockSize; ++i) {
+            uint32_t addr = address + offset + i;
+            block[8 + i] = read == 2 ? t->eeprom[addr % EEPROM_SIZE] : addr < HUB_SIZE ? t->hub[addr] : 0;
+            sum += block[8 + i];
+        }
+        setLong(&block[0], offset);
+        setLong(&block[4], sum);
+        if (read == 2)
+            now += eepromVerifyTime(blockSize);
+        targetSend(t, block, 8 + blockSize, now);
+    }
+    t->memAddr = 0;
+    t->checksum = 0;
+    t->expectedID = nextID;
+    if (count == 0)
+        logEvent("loader: reload, expecting %d packets", nextID);
+    else
+        logEvent("loader: read %s 0x%04x-0x%04x", read == 2 ? "EEPROM" : "RAM", address, address + count - 1);
+    loaderAcknowledge(t, transmissionID, now);
+}
+
+static void loaderProgramEEPROM(Target *t, const uint8_t *payload, int32_t transmissionID, double now)
+{
+    const uint8_t *region = payload + sizeof(programVerifyEEPROM) - EEPROM_REGION_FROM_END;
+    uint32_t eepromAddress = getLong(&region[0]);
+    uint32_t end = getLong(&region[4]);
+    uint32_t sum = getLong(&region[8]);
+    int32_t nextID = getLong(&region[12]);
+    int read = getLong(&region[16]);
+    int changed;
+    double done;
+    uint32_t i;
+
+    /* reading memory instead of programming */
+    if (read != 0) {
+        loaderReadMemory(t, read, eepromAddress, end, nextID, transmissionID, now);
+        return;
+    }
+
+    /* the application image; the checksum is from the RAM verify */
+    if (nextID == 0) {
+        done = now + eepromUpdate(t, 0, t->hub, HUB_SIZE, &changed) + eepromVerifyTime(HUB_SIZE);
+        t->expectedID = -t->checksum * 2;
+        logEvent("loader: program EEPROM, %d of %d pages changed, done in %.0f ms", changed, HUB_SIZE / EEPROM_PAGE_SIZE, done - now);
+        loaderAcknowledge(t, transmissionID, done);
+        return;
+    }
+
+    /* a region of a larger eeprom downloaded into RAM */
+    for (t->checksum = 0, i = 0; i < end && i < HUB_SIZE; ++i)
+        t->checksum += t->hub[i];
+    if ((uint32_t)t->checksum != sum || end > HUB_SIZE || end % EEPROM_PAGE_SIZE != 0) {
+        logEvent("loader: EEPROM region at 0x%04x, checksum %d, expected %u", eepromAddress, t->checksum, sum);
+        t->expectedID = -t->checksum;
+        loaderAcknowledge(t, transmissionID, now);
+        return;
+    }
+    done = now + eepromUpdate(t, eepromAddress, t->hub, end, &changed) + eepromVerifyTime(end);
+    t->memAddr = 0;
+    t->checksum = 0;
+    t->expectedID = nextID;
+    logEvent("loader: program EEPROM region 0x%04x-0x%04x, %d of %d pages changed, done in %.0f ms",
+             eepromAddress, eepromAddress + end - 1, changed, end / EEPROM_PAGE_SIZE, done - now);
+    loaderAcknowledge(t, transmissionID, done);
+}
+
+static void loaderPacket(Target *t, double now)
+{
+    int32_t packetID = getLong(&t->packet[0]);
+    int32_t transmissionID = getLong(&t->packet[4]);
+    uint8_t *payload = &t->packet[8];
+    int payloadSize = t->packetLen - 8;
+    uint32_t clockSpeed = getLong(&t->hub[0]);
+
+    t->packetLen = 0;
+    t->packetDeadline = 0;
+    t->lastPacketTime = now;
+
+    /* negatively acknowledge anything other than the expected packet */
+    if (packetID != t->expectedID) {
+        logEvent("loader: packet %d while expecting %d", packetID, t->expectedID);
+        loaderAcknowledge(t, transmissionID, now);
+        return;
+    }
+
+    /* copy data packets to RAM */
+    if (t->expectedID-- >= 1) {
+        if (payloadSize > HUB_SIZE - (int)t->memAddr)
+            payloadSize = HUB_SIZE - t->memAddr;
+        memcpy(&t->hub[t->memAddr], payload, payloadSize);
+        t->memAddr += payloadSize;
+        loaderAcknowledge(t, transmissionID, now);
+    }
+
+    /* run executable packets */
+    else if (matchesOverlay(payload, payloadSize, verifyRAM, sizeof(verifyRAM))) {
+        memset(&t->hub[t->memAddr], 0, HUB_SIZE - t->memAddr);
+        t->checksum = imageChecksum(t->hub);
+        t->expectedID = -t->checksum;
+        logEvent("loader: verify RAM, %d bytes, checksum %d", t->memAddr, t->checksum);
+        loaderAcknowledge(t, transmissionID, now + (clockSpeed > 0 ? HUB_SIZE * 28.0 * 1000 / clockSpeed : 0));
+    }
+    else if (matchesEEPROMOverlay(payload, payloadSize))
+        loaderProgramEEPROM(t, payload, transmissionID, now);
+    else if (matchesOverlay(payload, payloadSize, readyToLaunch, sizeof(readyToLaunch))) {
+        logEvent("loader: ready to launch");
+        t->readyToLaunch = 1;
+        loaderAcknowledge(t, transmissionID, now);
+    }
+    else if (matchesOverlay(payload, payloadSize, launchNow, sizeof(launchNow))) {
+        logEvent("loader: launch now");
+        launch(t, now);
+    }
+    else {
+        logEvent("loader: unknown executable packet of %d bytes", payloadSize);
+        t->state = TS_IGNORING;
+    }
+}
+
+/* loaderPacketComplete - full data packets and executable packets don't need to wait for the end of packet timeout */
+static int loaderPacketComplete(Target *t)
+{
+    uint8_t *payload = &t->packet[8];
+    int payloadSize = t->packetLen - 8;
+    return payloadSize == LOADER_MAX_DATA
+        || matchesOverlay(payload, payloadSize, verifyRAM, sizeof(verifyRAM))
+        || matchesEEPROMOverlay(payload, payloadSize)
+        || matchesOverlay(payload, payloadSize, readyToLaunch, sizeof(readyToLaunch))
+        || matchesOverlay(payload, payloadSize, launchNow, sizeof(launchNow));
+}
+
+static void loaderInput(Target *t, const uint8_t *buf, int len, double now)
+{
+    while (len > 0 && t->state == TS_LOADER) {
+        int cnt = len;
+        if (cnt > (int)sizeof(t->packet) - t->packetLen)
+            cnt = sizeof(t->packet) - t->packetLen;
+        memcpy(&t->packet[t->packetLen], buf, cnt);
+        t->packetLen += cnt;
+        buf += cnt;
+        len -= cnt;
+
+        /* a new download stream means the host reset the target */
+        if (t->packetLen >= (int)sizeof(romSignature) && memcmp(t->packet, romSignature, sizeof(romSignature)) == 0) {
+            uint8_t stream[sizeof(t->packet)];
+            int streamLen = t->packetLen;
+            memcpy(stream, t->packet, streamLen);
+            targetReset(t, "download stream");
+            targetInput(t, stream, streamLen, now);
+            targetInput(t, buf, len, now);
+            return;
+        }
+
+        if (t->packetLen >= 8 && loaderPacketComplete(t))
+            loaderPacket(t, now);
+        else
+            t->packetDeadline = msTimer() + LOADER_PACKET_GAP_MS;
+    }
+}
+
+/*
+ * SD helper
+ */
+
+static int isHelperImage(const uint8_t *image, int *pBaudRate)
+{
+    int pbase = getWord(&sd_helper_array[6]);
+    int vbase = getWord(&sd_helper_array[8]);
+    int dat = pbase + (sd_helper_array[pbase + 2] + sd_helper_array[pbase + 3]) * 4;
+    if (memcmp(image + 16, sd_helper_array + 16, dat - 16) != 0
+    ||  memcmp(image + dat + 20, sd_helper_array + dat + 20, vbase - dat - 20) != 0)
+        return 0;
+    *pBaudRate = getLong(&image[dat]);
+    return 1;
+}
+
+static uint16_t updcrc(uint16_t crc, uint8_t ch)
+{
+    int i;
+    for (i = 0; i < 8; ++i) {
+        int carry = crc & 0x8000;
+        crc = (crc << 1) | ((ch >> (7 - i)) & 1);
+        if (carry)
+            crc ^= 0x1021;
+    }
+    return crc;
+}
+
+static void helperReply(Target *t, uint8_t reply, int seq, double when)
+{
+    uint8_t buf[2];
+    buf[0] = reply;
+    buf[1] = seq;
+    targetSend(t, buf, 2, when);
+}
+
+/* helperSendPacket - send a packet to the host in the packet driver's frame format */
+static void helperSendPacket(Target *t, int type, const uint8_t *data, int len, double when)
+{
+    uint8_t frame[HELPER_FRAME_MAX];
+    uint16_t crc = 0;
+    int i;
+    frame[0] = SOH;
+    frame[1] = type;
+    frame[2] = 0;
+    frame[3] = len >> 8;
+    frame[4] = len;
+    frame[5] = frame[1] + frame[2] + frame[3] + frame[4];
+    memcpy(&frame[HELPER_HDR_LEN], data, len);
+    for (i = 0; i < len; ++i)
+        crc = updcrc(crc, data[i]);
+    crc = updcrc(updcrc(crc, 0), 0);
+    frame[HELPER_HDR_LEN + len] = crc >> 8;
+    frame[HELPER_HDR_LEN + len + 1] = crc;
+    targetSend(t, frame, HELPER_HDR_LEN + len + 2, when);
+}
+
+static void putLong(uint8_t *buf, uint32_t value)
+{
+    buf[0] = value;
+    buf[1] = value >> 8;
+    buf[2] = value >> 16;
+    buf[3] = value >> 24;
+}
+
+/* helperFileStat - build the reply to a FILE_STAT packet and return the time it takes */
+static double helperFileStat(Target *t, const uint8_t *data, int len, uint8_t *reply)
+{
+    uint32_t size = getLong(data), actual, crc = 0xffffffff;
+    double cost = HELPER_OPEN_CLOSE_MS;
+    char path[2048];
+    FILE *fp;
+    int ch, i;
+
+    if (!t->sdMounted) {
+        cost += HELPER_MOUNT_MS;
+        t->sdMounted = 1;
+    }
+    putLong(&reply[0], 1);
+    putLong(&reply[4], 0);
+    putLong(&reply[8], 0);
+    if (len < 5 || !sdDir)
+        return cost;
+    snprintf(path, sizeof(path), "%s/%.1000s", sdDir, (const char *)&data[4]);
+    if (!(fp = fopen(path, "rb")))
+        return cost;
+    fseek(fp, 0, SEEK_END);
+    actual = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    putLong(&reply[0], 0);
+    putLong(&reply[4], actual);
+    if (actual == size) {
+        while ((ch = getc(fp)) != EOF) {
+            crc ^= ch;
+            for (i = 0; i < 8; ++i)
+                crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320 : 0);
+        }
+        putLong(&reply[8], ~crc);
+        cost += actual / (double)HELPER_HASH_RATE;
+    }
+    fclose(fp);
+    logEvent("helper: file stat '%s' %u bytes", (const char *)&data[4], actual);
+    return cost;
+}
+
+/* helperFileRead - send a file in DATA packets and an EOF packet and return when it's done */
+static double helperFileRead(Target *t, const uint8_t *data, int len, double when)
+{
+    uint8_t packet[HELPER_DATA_MAX];
+    uint32_t offset = getLong(data), size = 0;
+    int status = 1, cnt;
+    char path[2048];
+    FILE *fp = NULL;
+
+    when += HELPER_OPEN_CLOSE_MS;
+    if (!t->sdMounted) {
+        when += HELPER_MOUNT_MS;
+        t->sdMounted = 1;
+    }
+    if (len >= 5 && sdDir) {
+        snprintf(path, sizeof(path), "%s/%.1000s", sdDir, (const char *)&data[4]);
+        fp = fopen(path, "rb");
+    }
+    if (fp) {
+        status = 0;
+        fseek(fp, 0, SEEK_END);
+        size = ftell(fp);
+        fseek(fp, offset < size ? offset : size, SEEK_SET);
+        while ((cnt = fread(&packet[8], 1, HELPER_DATA_MAX - 8, fp)) > 0) {
+            putLong(&packet[0], offset);
+            putLong(&packet[4], size);
+            when += cnt / (double)HELPER_READ_RATE;
+            helperSendPacket(t, HELPER_TYPE_DATA, packet, 8 + cnt, when);
+            offset += cnt;
+        }
+        fclose(fp);
+    }
+    logEvent("helper: file read '%s' %u bytes", len >= 5 ? (const char *)&data[4] : "", size);
+    putLong(&packet[0], status);
+    putLong(&packet[4], size);
+    helperSendPacket(t, HELPER_TYPE_EOF, packet, 8, when);
+    return when;
+}
+
+/* helperDirList - send the files in the SD card directory in DIR_LIST packets and an EOF packet */
+static double helperDirList(Target *t, double when)
+{
+    uint8_t packet[HELPER_DATA_MAX];
+    struct dirent *entry;
+    struct stat info;
+    char path[2048];
+    int len = 0, nameLen;
+    DIR *dirp;
+
+    if (!t->sdMounted) {
+        when += HELPER_MOUNT_MS;
+        t->sdMounted = 1;
+    }
+    if (sdDir && (dirp = opendir(sdDir)) != NULL) {
+        while ((entry = readdir(dirp)) != NULL) {
+            snprintf(path, sizeof(path), "%s/%.1000s", sdDir, entry->d_name);
+            if (stat(path, &info) != 0 || !S_ISREG(info.st_mode) || (nameLen = strlen(entry->d_name) + 1) > 13)
+                continue;
+            when += HELPER_OPEN_CLOSE_MS;
+            if (len + 4 + nameLen > HELPER_DATA_MAX) {
+                helperSendPacket(t, HELPER_TYPE_DIR_LIST, packet, len, when);
+                len = 0;
+            }
+            putLong(&packet[len], info.st_size);
+            memcpy(&packet[len + 4], entry->d_name, nameLen);
+            len += 4 + nameLen;
+        }
+        closedir(dirp);
+    }
+    if (len > 0)
+        helperSendPacket(t, HELPER_TYPE_DIR_LIST, packet, len, when);
+    helperSendPacket(t, HELPER_TYPE_EOF, packet, 0, when);
+    logEvent("helper: directory list");
+    return when;
+}
+
+static void helperFrame(Target *t, double now)
+{
+    int type = t->frame[1];
+    int seq = t->frame[2];
+    int len = (t->frame[3] << 8) | t->frame[4];
+    uint8_t *data = &t->frame[HELPER_HDR_LEN];
+    double start, cost = 0;
+    uint8_t reply[12];
+    int sendReply = 0;
+    uint16_t crc = 0;
+    int i;
+
+    /* check the crc over the data and the crc itself */
+    for (i = 0; i < len + 2; ++i)
+        crc = updcrc(crc, data[i]);
+    if (crc != 0) {
+        logEvent("helper: crc error");
+        helperReply(t, NAK, t->helperExpected, now);
+        return;
+    }
+
+    /* only the next packet in sequence is accepted */
+    if (seq != t->helperExpected) {
+        logEvent("helper: packet %d out of sequence, expected %d", seq, t->helperExpected);
+        helperReply(t, NAK, t->helperExpected, now);
+        return;
+    }
+    t->helperExpected = (t->helperExpected + 1) & 0xFF;
+
+    switch (type) {
+    case HELPER_TYPE_FILE_WRITE:
+        if (!t->sdMounted) {
+            cost += HELPER_MOUNT_MS;
+            t->sdMounted = 1;
+        }
+        cost += HELPER_OPEN_CLOSE_MS;
+        data[len > 0 ? len - 1 : 0] = '\0';
+        if (t->sdFile)
+            fclose(t->sdFile);
+        t->sdFile = NULL;
+        if (sdDir) {
+            char path[2048];
+            snprintf(path, sizeof(path), "%s/%.1000s", sdDir, (char *)data);
+            if (!(t->sdFile = fopen(path, "wb")))
+                logEvent("helper: can't create '%s'", path);
+        }
+        t->helperBytes = 0;
+        logEvent("helper: file write '%s'", (char *)data);
+        break;
+    case HELPER_TYPE_DATA:
+        cost += len / sdWriteRate;
+        if (t->sdFile)
+            fwrite(data, 1, len, t->sdFile);
+        t->helperBytes += len;
+        break;
+    case HELPER_TYPE_DATA_LZ:
+        {
+            uint8_t block[HELPER_DATA_MAX];
+            int size = len >= 2 ? data[0] | (data[1] << 8) : -1;
+            if (size > HELPER_DATA_MAX || DecompressLZ4(&data[2], len - 2, block, size) != size) {
+                logEvent("helper: bad compressed packet");
+                break;
+            }
+            cost += size / sdWriteRate;
+            if (t->sdFile)
+                fwrite(block, 1, size, t->sdFile);
+            t->helperBytes += size;
+        }
+        break;
+    case HELPER_TYPE_EOF:
+        if (t->sdFile) {
+            cost += HELPER_OPEN_CLOSE_MS;
+            fclose(t->sdFile);
+            t->sdFile = NULL;
+            logEvent("helper: closed file after %ld bytes", t->helperBytes);
+        }
+        break;
+    case HELPER_TYPE_FILE_STAT:
+        if (t->sdFile)
+            fclose(t->sdFile);
+        t->sdFile = NULL;
+        data[len > 0 ? len - 1 : 0] = '\0';
+        cost += helperFileStat(t, data, len, reply);
+        sendReply = 1;
+        break;
+    case HELPER_TYPE_FILE_READ:
+    case HELPER_TYPE_DIR_LIST:
+        if (t->sdFile)
+            fclose(t->sdFile);
+        t->sdFile = NULL;
+        data[len > 0 ? len - 1 : 0] = '\0';
+        break;
+    default:
+        logEvent("helper: bad packet type %d", type);
+        break;
+    }
+    ++t->helperFrames;
+
+    /* the packet driver hands over the packet and acknowledges it once the previous one is released */
+    start = now > t->helperFree ? now : t->helperFree;
+    helperReply(t, ACK, seq, start);
+    t->helperFree = start + cost;
+    if (sendReply)
+        helperSendPacket(t, type, reply, sizeof(reply), t->helperFree);
+
+    /* the helper doesn't take another packet until it has streamed the whole reply */
+    else if (type == HELPER_TYPE_FILE_READ || type == HELPER_TYPE_DIR_LIST) {
+        if (type == HELPER_TYPE_FILE_READ)
+            t->helperFree = helperFileRead(t, data, len, t->helperFree);
+        else
+            t->helperFree = helperDirList(t, t->helperFree);
+        if (t->link && t->link->txFree > t->helperFree)
+            t->helperFree = t->link->txFree;
+    }
+}
+
+static void helperInput(Target *t, const uint8_t *buf, int len, double now)
+{
+    while (--len >= 0) {
+        uint8_t byte = *buf++;
+        if (t->frameLen == 0 && byte != SOH)
+            continue;
+        t->frame[t->frameLen++] = byte;
+        if (t->frameLen == HELPER_HDR_LEN
+        &&  ((t->frame[1] + t->frame[2] + t->frame[3] + t->frame[4]) & 0xFF) != t->frame[5]) {
+            logEvent("helper: header checksum error");
+            helperReply(t, NAK, t->helperExpected, now);
+            t->frameLen = 0;
+        }
+        else if (t->frameLen == HELPER_HDR_LEN && ((t->frame[3] << 8) | t->frame[4]) > HELPER_FRAME_MAX - HELPER_HDR_LEN - 2) {
+            helperReply(t, NAK, t->helperExpected, now);
+            t->frameLen = 0;
+        }
+        else if (t->frameLen >= HELPER_HDR_LEN && t->frameLen == HELPER_HDR_LEN + ((t->frame[3] << 8) | t->frame[4]) + 2) {
+            helperFrame(t, now);
+            t->frameLen = 0;
+        }
+    }
+}
+
+/*
+ * Target
+ */
+
+/* launch - start the program in RAM */
+static void launch(Target *t, double now)
+{
+    int baudRate;
+    if (isLoaderImage(t->hub, t->romLongs * 4))
+        loaderStart(t, now);
+    else if (isHelperImage(t->hub, &baudRate)) {
+        uint8_t ready[3] = { ACK, HELPER_DATA_MAX >> 8, HELPER_DATA_MAX & 0xFF };
+        logEvent("helper: started at %d baud", baudRate);
+        t->state = TS_HELPER;
+        t->baudRate = baudRate;
+        t->frameLen = 0;
+        t->helperFrames = 0;
+        t->helperExpected = 0;
+        t->helperFree = now + HELPER_STARTUP_MS;
+        targetSend(t, ready, sizeof(ready), t->helperFree);
+    }
+    else {
+        logEvent("program: running");
+        t->state = TS_RUNNING;
+    }
+}
+
+static void targetReset(Target *t, const char *why)
+{
+    logEvent("reset (%s)", why);
+    if (t->sdFile) {
+        fclose(t->sdFile);
+        t->sdFile = NULL;
+    }
+    t->state = TS_ROM;
+    t->baudRate = 0;
+    t->romPulses = 0;
+    t->romLowRun = 0;
+    t->romField = RF_COMMAND;
+    t->romFieldBits = 0;
+    t->romValue = 0;
+    t->romLongs = 0;
+    t->packetLen = 0;
+    t->packetDeadline = 0;
+    t->sdMounted = 0;
+}
+
+static void targetInput(Target *t, const uint8_t *buf, int len, double now)
+{
+    if (len <= 0)
+        return;
+
+    /* bytes sent at the wrong baud rate are garbage to anything but the auto-bauding ROM */
+    if (t->state != TS_ROM && !baudRatesMatch(t->inputBaudRate[0], t->baudRate) && !baudRatesMatch(t->inputBaudRate[1], t->baudRate)) {
+        if (len >= (int)sizeof(romSignature) && memcmp(buf, romSignature, sizeof(romSignature)) == 0)
+            targetReset(t, "download stream");
+        else {
+            logEvent("%d bytes at %d baud lost (target at %d baud)", len, t->inputBaudRate[0], t->baudRate);
+            return;
+        }
+    }
+
+    switch (t->state) {
+    case TS_ROM:
+        if (t->romPulses > 0 && len >= (int)sizeof(romSignature) && memcmp(buf, romSignature, sizeof(romSignature)) == 0)
+            targetReset(t, "download stream");
+        romInput(t, buf, len, now);
+        break;
+    case TS_ROM_REPLY:
+        romReplyInput(t, buf, len, now);
+        break;
+    case TS_LOADER:
+        loaderInput(t, buf, len, now);
+        break;
+    case TS_HELPER:
+        if (len >= (int)sizeof(romSignature) && memcmp(buf, romSignature, sizeof(romSignature)) == 0) {
+            targetReset(t, "download stream");
+            romInput(t, buf, len, now);
+        }
+        else
+            helperInput(t, buf, len, now);
+        break;
+    case TS_IGNORING:
+    case TS_RUNNING:
+        if (len >= (int)sizeof(romSignature) && memcmp(buf, romSignature, sizeof(romSignature)) == 0) {
+            targetReset(t, "download stream");
+            romInput(t, buf, len, now);
+        }
+        break;
+    }
+}
+
+/* targetTick - timeouts */
+static void targetTick(Target *t, double now)
+{
+    if (t->state != TS_LOADER)
+        return;
+    if (t->packetDeadline > 0 && msTimer() >= t->packetDeadline) {
+        if (t->packetLen >= 8)
+            loaderPacket(t, now);
+        else {
+            t->packetLen = 0;
+            t->packetDeadline = 0;
+        }
+    }
+    else if (t->packetLen == 0 && now - t->lastPacketTime >= LOADER_FAILSAFE_MS) {
+        if (t->readyToLaunch) {
+            logEvent("loader: launching after timeout");
+            launch(t, now);
+        }
+        else
+            targetReset(t, "loader failsafe timeout");
+    }
+}
+
+/*
+ * Wi-Fi module
+ */
+
+static int listenOn(const char *addr, int port)
+{
+    struct sockaddr_in sin;
+    int one = 1;
+    int fd;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    if (inet_pton(AF_INET, addr, &sin.sin_addr) != 1
+    ||  bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0
+    ||  listen(fd, 4) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int getParameter(const char *request, const char *name, char *value, int valueMax)
+{
+    const char *p = strchr(request, '?');
+    int nameLen = strlen(name);
+    while (p && *p != ' ') {
+        ++p;
+        if (strncmp(p, name, nameLen) == 0 && p[nameLen] == '=') {
+            int i = 0;
+            p += nameLen + 1;
+            while (*p && *p != '&' && *p != ' ' && i < valueMax - 1)
+                value[i++] = *p++;
+            value[i] = '\0';
+            return 1;
+        }
+        while (*p && *p != '&' && *p != ' ')
+            ++p;
+    }
+    return 0;
+}
+
+static void httpRespond(int fd, int status, const char *reason, const uint8_t *body, int bodyLen, double due)
+{
+    char header[128];
+    int hdrLen = snprintf(header, sizeof(header), "HTTP/1.1 %d %s\r\nContent-Length: %d\r\n\r\n", status, reason, bodyLen);
+    Event *event = newEvent(due, 1, NULL, fd, (uint8_t *)header, 0);
+    Event *full;
+    if (!(full = (Event *)realloc(event, sizeof(Event) + hdrLen + bodyLen))) {
+        close(fd);
+        return;
+    }
+    memcpy(full->data, header, hdrLen);
+    memcpy(full->data + hdrLen, body, bodyLen);
+    full->len = hdrLen + bodyLen;
+    full->closeAfter = 1;
+    queueEvent(full);
+}
+
+/* wifiLoad - the module resets the Propeller and downloads an image with the ROM protocol */
+static void wifiLoad(int fd, const char *request, const uint8_t *body, int bodyLen, double now)
+{
+    char value[32];
+    int responseSize = 0, baudRate = 115200;
+    uint8_t response[64];
+    double done;
+
+    if (getParameter(request, "baud-rate", value, sizeof(value)))
+        baudRate = atoi(value);
+    if (getParameter(request, "response-size", value, sizeof(value)))
+        responseSize = atoi(value);
+    if (responseSize > (int)sizeof(response))
+        responseSize = sizeof(response);
+    if (bodyLen <= 0 || bodyLen > HUB_SIZE || (bodyLen & 3) != 0) {
+        httpRespond(fd, 400, "Bad Request", (uint8_t *)"Load image failed", 17, now + latency);
+        return;
+    }
+
+    targetReset(&target, "wifi load");
+    telnetLink.baudRate = telnetLink.prevBaudRate = baudRate;
+
+    /* the download stream averages about 3.5 image bits per byte plus the handshake and polls */
+    done = now + serializationTime(198 + 11 + 11 + (bodyLen * 8 * 2) / 7 + ROM_RX_BYTES, baudRate);
+
+    memset(target.hub, 0, sizeof(target.hub));
+    memcpy(target.hub, body, bodyLen);
+    target.romLongs = bodyLen / 4;
+    target.romCommand = 1;
+    if ((imageChecksum(target.hub) & 0xFF) != 0) {
+        target.state = TS_IGNORING;
+        httpRespond(fd, 500, "Internal Server Error", (uint8_t *)"Checksum error", 14, done + latency);
+        return;
+    }
+
+    /* collect the program's first output as the response */
+    target.capture = response;
+    target.captureLen = 0;
+    target.captureMax = responseSize;
+    target.link = &telnetLink;
+    launch(&target, done);
+    target.capture = NULL;
+
+    if (target.captureLen < responseSize) {
+        httpRespond(fd, 500, "Internal Server Error", (uint8_t *)"StartAck timeout", 16, done + latency);
+        return;
+    }
+    done += serializationTime(responseSize, target.baudRate);
+    telnetLink.txFree = done;
+    httpRespond(fd, 200, "OK", response, responseSize, done + latency);
+}
+
+static void httpRequest(int listenFd)
+{
+    static uint8_t request[HTTP_MAX_REQUEST + 1];
+    int fd, len = 0, contentLength = 0, headerLen = 0;
+    double now;
+    char *p;
+
+    if ((fd = accept(listenFd, NULL, NULL)) < 0)
+        return;
+
+    /* read the header and the body */
+    while (len < HTTP_MAX_REQUEST) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int cnt;
+        if (poll(&pfd, 1, 1000) <= 0 || (cnt = recv(fd, request + len, HTTP_MAX_REQUEST - len, 0)) <= 0)
+            break;
+        len += cnt;
+        request[len] = '\0';
+        if (!headerLen && (p = strstr((char *)request, "\r\n\r\n")) != NULL) {
+            headerLen = p + 4 - (char *)request;
+            if ((p = strstr((char *)request, "Content-Length:")) != NULL && p < (char *)request + headerLen)
+                contentLength = atoi(p + 15);
+        }
+        if (headerLen && len >= headerLen + contentLength)
+            break;
+    }
+    if (!headerLen) {
+        close(fd);
+        return;
+    }
+    request[headerLen] = '\0';
+    now = msTimer();
+    logEvent("http: %.*s", (int)(strchr((char *)request, '\r') - (char *)request), (char *)request);
+
+    if (strncmp((char *)request, "POST /propeller/load", 20) == 0)
+        wifiLoad(fd, (char *)request, request + headerLen, len - headerLen, now);
+    else if (strncmp((char *)request, "POST /propeller/reset", 21) == 0) {
+        targetReset(&target, "wifi reset");
+        httpRespond(fd, 200, "OK", NULL, 0, now + latency);
+    }
+    else if (strncmp((char *)request, "GET /wx/setting?name=version", 28) == 0)
+        httpRespond(fd, 200, "OK", (uint8_t *)"v1.0 (propsim)", 14, now + latency);
+    else if (strncmp((char *)request, "POST /wx/setting?name=baud-rate", 31) == 0) {
+        char value[32];
+        if (getParameter((char *)request, "value", value, sizeof(value)))
+            telnetLink.baudRate = telnetLink.prevBaudRate = atoi(value);
+        logEvent("telnet: %d baud", telnetLink.baudRate);
+        httpRespond(fd, 200, "OK", NULL, 0, now + latency);
+    }
+    else if (strncmp((char *)request, "POST /wx/", 9) == 0)
+        httpRespond(fd, 200, "OK", NULL, 0, now + latency);
+    else
+        httpRespond(fd, 404, "Not Found", NULL, 0, now + latency);
+}
+
+/*
+ * Serial port
+ */
+
+static int openPseudoTerminal(const char *linkPath)
+{
+    struct termios params;
+    const char *slaveName;
+    int fd;
+
+    if ((fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0 || !(slaveName = ptsname(fd))) {
+        fprintf(stderr, "error: can't create a pseudo-terminal -- %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* keep the slave open so the link survives the host closing it */
+    if ((serialLink.termiosFd = open(slaveName, O_RDWR | O_NOCTTY)) < 0) {
+        fprintf(stderr, "error: can't open '%s' -- %s\n", slaveName, strerror(errno));
+        return -1;
+    }
+    tcgetattr(serialLink.termiosFd, &params);
+    cfmakeraw(&params);
+    cfsetspeed(&params, B115200);
+    tcsetattr(serialLink.termiosFd, TCSANOW, &params);
+
+    unlink(linkPath);
+    if (symlink(slaveName, linkPath) != 0) {
+        fprintf(stderr, "error: can't create '%s' -- %s\n", linkPath, strerror(errno));
+        return -1;
+    }
+
+    serialLink.fd = fd;
+    logEvent("serial: %s -> %s", linkPath, slaveName);
+    return 0;
+}
+
+static void readLink(Link *link)
+{
+    uint8_t buf[4096];
+    int cnt;
+    refreshBaudRate(link);
+    if ((cnt = read(link->fd, buf, sizeof(buf))) > 0)
+        linkReceive(link, buf, cnt);
+    else if (link == &telnetLink) {
+        logEvent("telnet: disconnected");
+        close(link->fd);
+        link->fd = -1;
+    }
+}
+
+static volatile sig_atomic_t done = 0;
+
+static void stop(int sig)
+{
+    done = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *ptyLink = NULL, *wifiAddr = NULL, *p;
+    int httpFd = -1, telnetFd = -1;
+    int i;
+
+    /* get the arguments */
+    for (i = 1; i < argc; ++i) {
+        if (argv[i][0] != '-' || !argv[i][1] || argv[i][2])
+            usage(argv[0]);
+        switch (argv[i][1]) {
+        case 'v':
+            verbose = 1;
+            continue;
+        case 'p': case 'w': case 'r': case 'e': case 'k': case 's':
+            if (++i >= argc)
+                usage(argv[0]);
+            p = argv[i];
+            break;
+        default:
+            usage(argv[0]);
+            continue;
+        }
+        switch (argv[i - 1][1]) {
+        case 'p':   ptyLink = p; break;
+        case 'w':   wifiAddr = p; break;
+        case 'r':   latency = atof(p); break;
+        case 'e':   eepromCycleTime = atof(p); break;
+        case 'k':   sdWriteRate = atof(p) * 1024 / 1000; break;
+        case 's':   sdDir = p; break;
+        }
+    }
+    if (!ptyLink && !wifiAddr)
+        usage(argv[0]);
+
+    startTime = msTimer();
+    initLFSR();
+    targetReset(&target, "power on");
+
+    if (ptyLink) {
+        if (openPseudoTerminal(ptyLink) != 0)
+            return 1;
+        target.link = &serialLink;
+    }
+    if (wifiAddr) {
+        if ((httpFd = listenOn(wifiAddr, HTTP_PORT)) < 0 || (telnetFd = listenOn(wifiAddr, TELNET_PORT)) < 0) {
+            fprintf(stderr, "error: can't listen on %s ports %d and %d -- %s\n", wifiAddr, HTTP_PORT, TELNET_PORT, strerror(errno));
+            return 1;
+        }
+        logEvent("wifi: listening on %s", wifiAddr);
+    }
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* tell the caller we're ready */
+    printf("ready\n");
+    fflush(stdout);
+
+    while (!done) {
+        struct pollfd fds[4];
+        Link *links[4];
+        double now = msTimer(), wake = now + 100;
+        int nfds = 0, timeout;
+
+        /* handle the events that are due */
+        while (events && events->due <= now) {
+            Event *event = events;
+            events = event->next;
+            if (!event->output) {
+                target.inputBaudRate[0] = event->baudRate[0];
+                target.inputBaudRate[1] = event->baudRate[1];
+                targetInput(&target, event->data, event->len, event->due);
+            }
+            else if (event->fd >= 0) {
+                if (write(event->fd, event->data, event->len) != event->len)
+                    logEvent("write failed -- %s", strerror(errno));
+                if (event->closeAfter)
+                    close(event->fd);
+            }
+            free(event);
+            now = msTimer();
+        }
+        targetTick(&target, now);
+
+        /* wait for input or the next event */
+        if (events && events->due < wake)
+            wake = events->due;
+        if (target.packetDeadline > 0 && target.packetDeadline < wake)
+            wake = target.packetDeadline;
+        timeout = (int)(wake - now);
+        if (timeout < 0)
+            timeout = 0;
+
+        if (serialLink.fd >= 0) {
+            fds[nfds].fd = serialLink.fd; fds[nfds].events = POLLIN; links[nfds++] = &serialLink;
+        }
+        if (telnetLink.fd >= 0) {
+            fds[nfds].fd = telnetLink.fd; fds[nfds].events = POLLIN; links[nfds++] = &telnetLink;
+        }
+        if (httpFd >= 0) {
+            fds[nfds].fd = httpFd; fds[nfds].events = POLLIN; links[nfds++] = NULL;
+        }
+        if (telnetFd >= 0) {
+            fds[nfds].fd = telnetFd; fds[nfds].events = POLLIN; links[nfds++] = NULL;
+        }
+
+        /* sub-millisecond waits are spun rather than rounded up to a whole millisecond */
+        if (poll(fds, nfds, timeout) <= 0)
+            continue;
+
+        for (i = 0; i < nfds; ++i) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP)))
+                continue;
+            if (links[i])
+                readLink(links[i]);
+            else if (fds[i].fd == httpFd)
+                httpRequest(httpFd);
+            else if (fds[i].fd == telnetFd) {
+                int fd, one = 1;
+                if ((fd = accept(telnetFd, NULL, NULL)) >= 0) {
+                    if (telnetLink.fd >= 0)
+                        close(telnetLink.fd);
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    telnetLink.fd = fd;
+                    telnetLink.rxFree = telnetLink.txFree = 0;
+                    target.link = &telnetLink;
+                    logEvent("telnet: connected");
+                }
+            }
+        }
+    }
+
+    if (ptyLink)
+        unlink(ptyLink);
+    return 0;
+}